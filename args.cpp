@@ -20,10 +20,14 @@
 
 #include "args.h"
 
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <ios>
 #include <iostream>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -31,27 +35,55 @@
 #include <unordered_set>
 #include <utility>
 
+#include "helpers.h"
+#include "palette.h"
 #include "version.h"
 
-std::optional<int16_t>  bitmapWidth;          // -1 (if original width) or any number
-std::optional<int16_t>  bitmapHeight;         // -1 (if original height) or any number
-std::optional<bool>     filter;               // if true, use filtering when resizing
-std::optional<bool>     dither;               // if true, use dithering when resizing and/or converting colours
+// parsed options (not set = use the default)
+struct ParsedOptions {
+    std::optional<int16_t>  bitmapWidth;
+    std::optional<int16_t>  bitmapHeight;
+    std::optional<bool>     filter;
+    std::optional<Resampler>    resampler;
+    std::optional<bool>     dither;
+    std::optional<OrderedDither>    orderedDither;
+    std::optional<ErrorDiffusion>   errorDiffusion;
+    std::optional<Quantizer>    quantizer;
+    std::optional<int16_t>  seed;
+    std::optional<bool>     sharedPalette;
+    std::optional<std::string>  paletteFilename;
+    std::optional<std::string>  fixedPaletteFilename;
+
+    std::optional<int16_t>  bitsPerPixel;
+    std::optional<int16_t>  bytesPerChunk;
+    std::optional<int16_t>  paletteBits;
+    std::optional<bool>     stCompatiblePalette;
+    std::optional<bool>     ttCompatiblePalette;
+
+    std::optional<int16_t>  threadCount;
+    std::optional<int16_t>  bandHeight;
+
+    std::optional<std::string>  cacheDirectory;
+    std::optional<int16_t>  cacheSize;
+    std::optional<bool>     noCache;
+    std::optional<bool>     clearCache;
+    std::optional<bool>     incremental;
+    std::optional<StatsFormat>  stats;
+};
 
-std::optional<int16_t>  bitsPerPixel;         // 1, 2, 4, 6, 8 (both planar and chunky); 16, 24, 32 (chunky only) or 0 (if explicitly disabled)
-std::optional<int16_t>  bytesPerChunk;        // -1 (if implicit/packed), 1, 2, 3, 4 or 0 (if disabled)
-std::optional<int16_t>  paletteBits;          // 9, 12, 18, 24 or 0 (if bitsPerPixel > 8 or explicitly disabled)
-std::optional<bool>     stCompatiblePalette;  // if true, use ST/E palette registers
-std::optional<bool>     ttCompatiblePalette;  // if true, use TT palette registers
 // Possible TODOs:
 //  - grayscale
-//  - cat picture.gif | giftopnm | pnmquant 16 | ppmtoneo > picture.neo (call Netpbm instead of using GraphicsMagick)
 
 // defaults
 constexpr int16_t    DEFAULT_BITMAP_WIDTH = -1;
 constexpr int16_t   DEFAULT_BITMAP_HEIGHT = -1;
 constexpr bool            DEFAULT_FILTER  = false;
 constexpr bool            DEFAULT_DITHER  = false;
+constexpr Resampler    DEFAULT_RESAMPLER  = Resampler::GraphicsMagick;
+constexpr OrderedDither DEFAULT_ORDERED  = OrderedDither::None;
+constexpr ErrorDiffusion DEFAULT_DIFFUSE = ErrorDiffusion::None;
+constexpr Quantizer    DEFAULT_QUANTIZER  = Quantizer::GraphicsMagick;
+constexpr int16_t           DEFAULT_SEED  = 0;
 
 constexpr int16_t  DEFAULT_ST_BITS_PER_PIXEL = 4;
 constexpr int16_t    DEFAULT_BITS_PER_PIXEL  = 8;
@@ -61,56 +93,133 @@ constexpr int16_t      DEFAULT_PALETTE_BITS  = 24;
 constexpr bool        DEFAULT_ST_COMPATIBLE  = false;
 constexpr bool        DEFAULT_TT_COMPATIBLE  = false;
 
-std::unordered_map<std::string, std::pair<std::unordered_set<int16_t>, std::optional<int16_t>&>> allowedValues = {
-    { "-bpp",    { { 0, 1, 2, 4, 6, 8, 16, 24, 32 }, bitsPerPixel  } },
-    { "-bpc",    { { -1, 0, 1, 2, 3, 4 },            bytesPerChunk } },
-    { "-pal",    { { 0, 9, 12, 18, 24 },             paletteBits   } },
-    { "-width",  { { },                              bitmapWidth   } },
-    { "-height", { { },                              bitmapHeight  } }
+constexpr int16_t       DEFAULT_THREAD_COUNT = 0;
+constexpr int16_t        DEFAULT_BAND_HEIGHT = 0;
+
+constexpr int16_t         DEFAULT_CACHE_SIZE = 1024;
+
+constexpr StatsFormat          DEFAULT_STATS = StatsFormat::None;
+
+static const std::unordered_map<std::string, std::pair<std::unordered_set<int16_t>, std::optional<int16_t> ParsedOptions::*>> allowedValues = {
+    { "-bpp",       { { 0, 1, 2, 4, 6, 8, 16, 24, 32 }, &ParsedOptions::bitsPerPixel  } },
+    { "-bpc",       { { -1, 0, 1, 2, 3, 4 },           &ParsedOptions::bytesPerChunk } },
+    { "-pal",       { { 0, 9, 12, 18, 24 },            &ParsedOptions::paletteBits   } },
+    { "-width",     { { },                             &ParsedOptions::bitmapWidth   } },
+    { "-height",    { { },                             &ParsedOptions::bitmapHeight  } },
+    { "-j",         { { },                             &ParsedOptions::threadCount   } },
+    { "-band",      { { },                             &ParsedOptions::bandHeight    } },
+    { "-cachesize", { { },                             &ParsedOptions::cacheSize     } },
+    { "-seed",      { { },                             &ParsedOptions::seed          } }
+};
+
+static const std::vector<std::pair<std::string, Resampler>> resamplerNames = {
+    { "gm",         Resampler::GraphicsMagick },
+    { "box",        Resampler::Box            },
+    { "bilinear",   Resampler::Bilinear       },
+    { "bicubic",    Resampler::Bicubic        },
+    { "lanczos",    Resampler::Lanczos        }
+};
+
+static const std::vector<std::pair<std::string, OrderedDither>> orderedDitherNames = {
+    { "none",       OrderedDither::None      },
+    { "bayer",      OrderedDither::Bayer     },
+    { "bluenoise",  OrderedDither::BlueNoise }
+};
+
+static const std::vector<std::pair<std::string, ErrorDiffusion>> errorDiffusionNames = {
+    { "none",       ErrorDiffusion::None           },
+    { "fs",         ErrorDiffusion::FloydSteinberg },
+    { "atkinson",   ErrorDiffusion::Atkinson       },
+    { "sierralite", ErrorDiffusion::SierraLite     }
+};
+
+static const std::vector<std::pair<std::string, Quantizer>> quantizerNames = {
+    { "gm",     Quantizer::GraphicsMagick },
+    { "native", Quantizer::Native         }
 };
 
-std::unordered_map<std::string, std::optional<bool>&> allowedFlags = {
-    { "-st",     stCompatiblePalette  },
-    { "-tt",     ttCompatiblePalette  },
-    { "-filter", filter               },
-    { "-dither", dither               },
+static const std::unordered_map<std::string, std::optional<bool> ParsedOptions::*> allowedFlags = {
+    { "-st",          &ParsedOptions::stCompatiblePalette },
+    { "-tt",          &ParsedOptions::ttCompatiblePalette },
+    { "-filter",      &ParsedOptions::filter              },
+    { "-dither",      &ParsedOptions::dither              },
+    { "-nocache",     &ParsedOptions::noCache             },
+    { "-clearcache",  &ParsedOptions::clearCache          },
+    { "-incremental", &ParsedOptions::incremental         },
+    { "-sharedpal",   &ParsedOptions::sharedPalette       },
 };
 
+// the other way round than parse_name()
+template<typename T>
+static std::string get_name(T value, const std::vector<std::pair<std::string, T>>& names)
+{
+    for (const auto& [name, namedValue] : names) {
+        if (namedValue == value)
+            return name;
+    }
+
+    return {};
+}
+
 static void print_help(const char* name)
 {
     std::ostringstream oss;
-    oss << "Usage: " << name << " [OPTION...] FILE" << std::endl
-        << "Convert bitmap FILE into an Atari ST/STE/TT/Falcon-specific format." << std::endl
+    oss << "Usage: " << name << " [OPTION...] [--] FILE..." << std::endl
+        << "   or: " << name << " [OPTION...] -batch <filename>" << std::endl
+        << "   or: " << name << " [OPTION...] -serve <socket>" << std::endl
+        << "Convert bitmap FILE(s) into an Atari ST/STE/TT/Falcon-specific format." << std::endl
+        << "FILE '-' is read from stdin and written to stdout (unless '-out' says otherwise)." << std::endl
+        << "'--' ends the options, e.g. for a FILE starting with '-'." << std::endl
         << "Version " << (VERSION>>8) << "." << std::setfill('0') << std::setw(2) << (VERSION&0xFFu) << " (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>." << std::endl
         << std::endl
         << "Possible options:" << std::endl
         << "  -width <num>     specify new bitmap width [default " << DEFAULT_BITMAP_WIDTH << "]" << std::endl
         << "  -height <num>    specify new bitmap height [default " << DEFAULT_BITMAP_HEIGHT << "]" << std::endl
         << "  -filter          use filtering when resizing [default " << std::boolalpha << DEFAULT_FILTER << "]" << std::endl
+        << "  -kernel <name>   resizing filter (gm [see '-filter'], box, bilinear, bicubic, lanczos) [default " << get_name(DEFAULT_RESAMPLER, resamplerNames) << "]" << std::endl
         << "  -dither          use dithering when resizing and/or converting colours [default " << std::boolalpha << DEFAULT_DITHER << "]" << std::endl
+        << "  -ordered <name>  ordered dithering into the output's bits per channel (none, bayer, bluenoise) [default " << get_name(DEFAULT_ORDERED, orderedDitherNames) << "]" << std::endl
+        << "  -diffuse <name>  error diffusion into the palette or the output's bits per channel (none, fs, atkinson, sierralite) [default " << get_name(DEFAULT_DIFFUSE, errorDiffusionNames) << "]" << std::endl
+        << "  -quantize <name> palette quantizer for 1 - 8 bpp (gm, native) [default " << get_name(DEFAULT_QUANTIZER, quantizerNames) << "]" << std::endl
+        << "  -seed <num>      seed for the native quantizer [default " << DEFAULT_SEED << "]" << std::endl
+        << "  -sharedpal       build one palette for all FILEs (1 - 8 bpp, native quantizer) [default false]" << std::endl
+        << "  -palout <filename> save the shared palette into <filename> and the FILEs without it (implies '-sharedpal')" << std::endl
+        << "  -usepal <filename> remap to the palette of UIMG <filename> (e.g. saved by '-palout') instead of quantizing" << std::endl
         << "  -bpp <num>       bits per pixel, i.e. colour depth (0, 1, 2, 4, 6, 8, 16 [RGB565], 24, 32) [default " << DEFAULT_BITS_PER_PIXEL << "]" << std::endl
         << "  -bpc <num>       bytes per chunk (-1 for packed chunky pixels [default for bpp > 8], 0, 1, 2, 3, 4) [default " << DEFAULT_BYTES_PER_CHUNK << "]" << std::endl
         << "  -pal <num>       number of bits per palette entry where applicable (0, 9, 12, 18, 24; implicitly disabled for bpp > 8) [default " << DEFAULT_PALETTE_BITS << "]" << std::endl
         << "  -st              output palette in ST/E-specific format (only 9/12-bit palette) [default " << std::boolalpha << DEFAULT_ST_COMPATIBLE << "]" << std::endl
         << "  -tt              output palette in TT-specific format (only 9/12-bit palette) [default " << std::boolalpha << DEFAULT_TT_COMPATIBLE << "]" << std::endl
-        << "  -out <filename>  output bitmap as <filename> ('-bpp', '-bpc', '-pal', '-st' and '-tt' are ignored but still validated)"  << std::endl;
+        << "  -j <num>         number of threads (0 for one per hardware thread) [default " << DEFAULT_THREAD_COUNT << "]" << std::endl
+        << "  -band <num>      remap, encode and write bitmap data in bands of <num> rows (divisible by 16, 0 for whole bitmap) [default " << DEFAULT_BAND_HEIGHT << "]" << std::endl
+        << "  -out <filename>  output bitmap as <filename> ('-' for stdout, '<format>:-' for stdout as GraphicsMagick's <format>; '-bpp', '-bpc', '-pal', '-st' and '-tt' are ignored but still validated; only one FILE)"  << std::endl
+        << "  -emit <spec>     add an output described by <spec>, e.g. 'bp4:pal12:st', 'c08:pal24', 'c04:nib', 'c16:240x135:out=a.c16'" << std::endl
+        << "                   (repeatable; FILE is read only once for all of them)" << std::endl
+        << "  -cache <dir>     keep decoded and resized FILEs in <dir> and reuse them next time [default none]" << std::endl
+        << "  -cachesize <num> maximum size of the cache in MiB, least recently used FILEs are evicted first [default " << DEFAULT_CACHE_SIZE << "]" << std::endl
+        << "  -nocache         don't use the cache (even if '-cache' is given) [default false]" << std::endl
+        << "  -clearcache      empty the cache before converting [default false]" << std::endl
+        << "  -incremental     skip FILEs whose output is up to date (see <output>.manifest) [default false]" << std::endl
+        << "  -stats [json]    print time spent in every stage, memory and pixel counts at exit (as JSON) on stderr [default false]" << std::endl
+        << "  -batch <filename> read one [OPTION...] FILE... line per conversion from <filename> (on top of given options)" << std::endl
+        << "  -serve <socket>  keep running and convert JSON requests from a Unix domain <socket> ('-' for stdin) (on top of given options)" << std::endl;
 
     throw std::invalid_argument(oss.str());
 }
 
-std::string get_uimg_filename_ext()
+std::string get_uimg_filename_ext(const ConversionOptions& options)
 {
     std::ostringstream oss;
 
-    if (!*bitsPerPixel && *paletteBits) {
+    if (!options.bitsPerPixel && options.paletteBits) {
         // just palette
-        oss << ".p" << std::setw(2) << std::setfill('0') << *paletteBits;
-    } else if (*bitsPerPixel && *paletteBits && !*bytesPerChunk) {
+        oss << ".p" << std::setw(2) << std::setfill('0') << options.paletteBits;
+    } else if (options.bitsPerPixel && options.paletteBits && !options.bytesPerChunk) {
         // regular planar bitmap
-        oss << ".bp" << *bitsPerPixel;
-    } else if (*bitsPerPixel && (*bitsPerPixel > 8 || *paletteBits) && *bytesPerChunk) {
+        oss << ".bp" << options.bitsPerPixel;
+    } else if (options.bitsPerPixel && (options.bitsPerPixel > 8 || options.paletteBits) && options.bytesPerChunk) {
         // regular chunky bitmap
-        oss << ".c" << std::setw(2) << std::setfill('0') << *bitsPerPixel;
+        oss << ".c" << std::setw(2) << std::setfill('0') << options.bitsPerPixel;
     } else {
         // everything else: separate palette, plane raw words/chunky pixels or just the header...
         oss << ".dat";
@@ -119,99 +228,357 @@ std::string get_uimg_filename_ext()
     return oss.str();
 }
 
-std::string parse_arguments(int argc, char* argv[])
+ConversionOptions get_bitmap_options(const ConversionOptions& options)
 {
-    if (argc < 2) {
-        print_help("uconvert"/*argv[0]*/);
+    ConversionOptions bitmapOptions = options;
+
+    if (!options.paletteFilename.empty())
+        bitmapOptions.paletteBits = 0;
+
+    return bitmapOptions;
+}
+
+int get_palette_type(const ConversionOptions& options)
+{
+    if (!options.paletteBits)
+        return 0;
+    else if (options.stCompatiblePalette)
+        return StePalette;
+    else if (options.ttCompatiblePalette)
+        return TtPalette;
+    else
+        return FalconPalette;
+}
+
+std::string get_options_signature(const ConversionOptions& options)
+{
+    // threadCount, bandHeight, the cache settings and stats don't change the output
+    std::ostringstream oss;
+    oss << "-width " << options.bitmapWidth
+        << " -height " << options.bitmapHeight
+        << " -filter " << options.filter
+        << " -kernel " << get_name(options.resampler, resamplerNames)
+        << " -dither " << options.dither
+        << " -ordered " << get_name(options.orderedDither, orderedDitherNames)
+        << " -diffuse " << get_name(options.errorDiffusion, errorDiffusionNames)
+        << " -quantize " << get_name(options.quantizer, quantizerNames)
+        << " -seed " << options.seed
+        << " -sharedpal " << options.sharedPalette
+        << " -palout " << options.paletteFilename
+        << " -usepal " << options.fixedPaletteFilename
+        << " -bpp " << options.bitsPerPixel
+        << " -bpc " << options.bytesPerChunk
+        << " -pal " << options.paletteBits
+        << " -st " << options.stCompatiblePalette
+        << " -tt " << options.ttCompatiblePalette;
+
+    return oss.str();
+}
+
+static ConversionOptions apply_defaults(ParsedOptions parsed)
+{
+    // defaults (always assumed to be in a legal combination)
+    if (!parsed.bitmapWidth.has_value())
+        parsed.bitmapWidth = DEFAULT_BITMAP_WIDTH;
+
+    if (!parsed.bitmapHeight.has_value())
+        parsed.bitmapHeight = DEFAULT_BITMAP_HEIGHT;
+
+    if (!parsed.filter.has_value())
+        parsed.filter = DEFAULT_FILTER;
+
+    if (!parsed.resampler.has_value())
+        parsed.resampler = DEFAULT_RESAMPLER;
+
+    if (!parsed.dither.has_value())
+        parsed.dither = DEFAULT_DITHER;
+
+    if (!parsed.orderedDither.has_value())
+        parsed.orderedDither = DEFAULT_ORDERED;
+
+    if (!parsed.errorDiffusion.has_value())
+        parsed.errorDiffusion = DEFAULT_DIFFUSE;
+
+    if (!parsed.quantizer.has_value())
+        parsed.quantizer = DEFAULT_QUANTIZER;
+
+    if (!parsed.seed.has_value())
+        parsed.seed = DEFAULT_SEED;
+
+    if (!parsed.paletteFilename.has_value())
+        parsed.paletteFilename = "";
+
+    if (!parsed.sharedPalette.has_value())
+        parsed.sharedPalette = !parsed.paletteFilename->empty();
+
+    if (!parsed.fixedPaletteFilename.has_value())
+        parsed.fixedPaletteFilename = "";
+
+    if (!parsed.stCompatiblePalette.has_value())
+        parsed.stCompatiblePalette = DEFAULT_ST_COMPATIBLE;
+
+    if (!parsed.ttCompatiblePalette.has_value())
+        parsed.ttCompatiblePalette = DEFAULT_TT_COMPATIBLE;
+
+    if (!parsed.threadCount.has_value())
+        parsed.threadCount = DEFAULT_THREAD_COUNT;
+
+    if (!parsed.bandHeight.has_value())
+        parsed.bandHeight = DEFAULT_BAND_HEIGHT;
+
+    if (!parsed.cacheDirectory.has_value() || parsed.noCache.value_or(false))
+        parsed.cacheDirectory = "";
+
+    if (!parsed.cacheSize.has_value())
+        parsed.cacheSize = DEFAULT_CACHE_SIZE;
+
+    if (!parsed.clearCache.has_value())
+        parsed.clearCache = false;
+
+    if (!parsed.incremental.has_value())
+        parsed.incremental = false;
+
+    if (!parsed.stats.has_value())
+        parsed.stats = DEFAULT_STATS;
+
+    if (!parsed.bitsPerPixel.has_value()) {
+        if (*parsed.stCompatiblePalette)
+            parsed.bitsPerPixel = DEFAULT_ST_BITS_PER_PIXEL;
+        else
+            parsed.bitsPerPixel = DEFAULT_BITS_PER_PIXEL;
     }
 
-    std::string outputFilename;
+    if (!parsed.bytesPerChunk.has_value()) {
+        if (*parsed.bitsPerPixel > 8)
+            parsed.bytesPerChunk = *parsed.bitsPerPixel / 8;
+        else
+            parsed.bytesPerChunk = DEFAULT_BYTES_PER_CHUNK;
+    } else if (*parsed.bytesPerChunk == -1 && *parsed.bitsPerPixel >= 8) {
+        // make it easier to parse
+        parsed.bytesPerChunk = *parsed.bitsPerPixel / 8;
+    }
 
-    for (int i = 1; i < argc; ++i) {
-        const std::string arg = argv[i];
+    if (!parsed.paletteBits.has_value()) {
+        if (*parsed.bitsPerPixel <= 8) {
+            if (*parsed.stCompatiblePalette || *parsed.ttCompatiblePalette)
+                parsed.paletteBits = DEFAULT_ST_TT_PALETTE_BITS;
+            else
+                parsed.paletteBits = DEFAULT_PALETTE_BITS;
+        } else {
+            parsed.paletteBits = 0;
+        }
+    }
 
-        // last argument => it's a filename
-        if (i == argc-1) {
-            // defaults (always assumed to be in a legal combination)
-            if (!bitmapWidth.has_value())
-                bitmapWidth = DEFAULT_BITMAP_WIDTH;
+    // do some sanity checks
+    if (*parsed.stCompatiblePalette && *parsed.ttCompatiblePalette)
+        throw std::invalid_argument("Can't set both '-st' and '-tt'.");
 
-            if (!bitmapHeight.has_value())
-                bitmapHeight = DEFAULT_BITMAP_HEIGHT;
+    if (*parsed.bitsPerPixel > 8 && *parsed.paletteBits)
+        throw std::invalid_argument("Can't have palette with '-bpp' > 8.");
 
-            if (!filter.has_value())
-                filter = DEFAULT_FILTER;
+    if ((!*parsed.paletteBits || *parsed.paletteBits > 12) && (*parsed.stCompatiblePalette || *parsed.ttCompatiblePalette))
+        throw std::invalid_argument("'-st' and '-tt' require 9- or 12-bit palette.");
 
-            if (!dither.has_value())
-                dither = DEFAULT_DITHER;
+    if (*parsed.bitsPerPixel > 4 && *parsed.stCompatiblePalette)
+        throw std::invalid_argument("'-st' requires 1, 2 or 4 bits per pixel.");
 
-            if (!stCompatiblePalette.has_value())
-                stCompatiblePalette = DEFAULT_ST_COMPATIBLE;
+    if (*parsed.bitsPerPixel > 8 && *parsed.ttCompatiblePalette)
+        throw std::invalid_argument("'-tt' requires 1, 2, 4, 6 or 8 bits per pixel.");
 
-            if (!ttCompatiblePalette.has_value())
-                ttCompatiblePalette = DEFAULT_TT_COMPATIBLE;
+    if (*parsed.bitsPerPixel == 2 && !(*parsed.stCompatiblePalette || *parsed.ttCompatiblePalette))
+        throw std::invalid_argument("'2 bits per pixel work only with '-st' or '-tt'");
 
-            if (!bitsPerPixel.has_value()) {
-                if (*stCompatiblePalette)
-                    bitsPerPixel = DEFAULT_ST_BITS_PER_PIXEL;
-                else
-                    bitsPerPixel = DEFAULT_BITS_PER_PIXEL;
-            }
+    if (*parsed.bytesPerChunk && !*parsed.bitsPerPixel)
+        throw std::invalid_argument("-bpc requires bpp > 0.");
 
-            if (!bytesPerChunk.has_value()) {
-                if (*bitsPerPixel > 8)
-                    bytesPerChunk = *bitsPerPixel / 8;
-                else
-                    bytesPerChunk = DEFAULT_BYTES_PER_CHUNK;
-            } else if (*bytesPerChunk == -1 && *bitsPerPixel >= 8) {
-                // make it easier to parse
-                bytesPerChunk = *bitsPerPixel / 8;
-            }
+    if (*parsed.bytesPerChunk == -1 && *parsed.bitsPerPixel == 6)
+        throw std::invalid_argument("-bpp 6 requires bpc >= 0.");
 
-            if (!paletteBits.has_value()) {
-                if (*bitsPerPixel <= 8) {
-                    if (*stCompatiblePalette || *ttCompatiblePalette)
-                        paletteBits = DEFAULT_ST_TT_PALETTE_BITS;
-                    else
-                        paletteBits = DEFAULT_PALETTE_BITS;
-                } else {
-                    paletteBits = 0;
-                }
-            }
+    if (*parsed.bytesPerChunk > 0 && *parsed.bitsPerPixel/8 > *parsed.bytesPerChunk)
+        throw std::invalid_argument("bpp/8 > bpc.");
+
+    if (*parsed.threadCount < 0)
+        throw std::invalid_argument("-j must not be negative.");
+
+    if (*parsed.bandHeight < 0 || *parsed.bandHeight % 16 != 0)
+        throw std::invalid_argument("-band must be divisible by 16.");
+
+    if (*parsed.cacheSize <= 0)
+        throw std::invalid_argument("-cachesize must be a positive number.");
+
+    if (*parsed.sharedPalette && (*parsed.bitsPerPixel == 0 || *parsed.bitsPerPixel > 8))
+        throw std::invalid_argument("-sharedpal requires 1 - 8 bits per pixel.");
+
+    if (!parsed.paletteFilename->empty()) {
+        if (!*parsed.paletteBits)
+            throw std::invalid_argument("-palout requires a palette ('-pal' > 0).");
+    }
+
+    if (*parsed.orderedDither != OrderedDither::None && *parsed.errorDiffusion != ErrorDiffusion::None)
+        throw std::invalid_argument("-diffuse can't be used together with -ordered.");
 
-            // do some sanity checks
-            if (*stCompatiblePalette && *ttCompatiblePalette)
-                throw std::invalid_argument("Can't set both '-st' and '-tt'.");
+    if (!parsed.fixedPaletteFilename->empty()) {
+        if (*parsed.bitsPerPixel == 0 || *parsed.bitsPerPixel > 8)
+            throw std::invalid_argument("-usepal requires 1 - 8 bits per pixel.");
 
-            if (*bitsPerPixel > 8 && *paletteBits)
-                throw std::invalid_argument("Can't have palette with '-bpp' > 8.");
+        if (*parsed.sharedPalette)
+            throw std::invalid_argument("-usepal can't be used together with -sharedpal.");
+    }
 
-            if ((!*paletteBits || *paletteBits > 12) && (*stCompatiblePalette || *ttCompatiblePalette))
-                throw std::invalid_argument("'-st' and '-tt' require 9- or 12-bit palette.");
+    ConversionOptions options {
+        *parsed.bitmapWidth,
+        *parsed.bitmapHeight,
+        *parsed.filter,
+        *parsed.resampler,
+        *parsed.dither,
+        *parsed.orderedDither,
+        *parsed.errorDiffusion,
+        *parsed.quantizer,
+        *parsed.seed,
+        *parsed.sharedPalette,
+        *parsed.paletteFilename,
+        *parsed.fixedPaletteFilename,
+        *parsed.bitsPerPixel,
+        *parsed.bytesPerChunk,
+        *parsed.paletteBits,
+        *parsed.stCompatiblePalette,
+        *parsed.ttCompatiblePalette,
+        *parsed.threadCount,
+        *parsed.bandHeight,
+        *parsed.cacheDirectory,
+        *parsed.cacheSize,
+        *parsed.clearCache,
+        *parsed.incremental,
+        *parsed.stats
+    };
+
+    // the palette file has the bitmaps' bpp (and a bitmap of 0x0 pixels), not just a palette
+    // ('.pXX' is for bpp 0, i.e. a single palette entry), so it gets their extension
+    if (!options.paletteFilename.empty() && options.paletteFilename.find('.') == std::string::npos)
+        options.paletteFilename += get_uimg_filename_ext(options);
+
+    return options;
+}
 
-            if (*bitsPerPixel > 4 && *stCompatiblePalette)
-                throw std::invalid_argument("'-st' requires 1, 2 or 4 bits per pixel.");
+// one of 'names' or print_help()
+template<typename T>
+static T parse_name(const std::string& str, const std::vector<std::pair<std::string, T>>& names)
+{
+    for (const auto& [name, value] : names) {
+        if (name == str)
+            return value;
+    }
 
-            if (*bitsPerPixel > 8 && *ttCompatiblePalette)
-                throw std::invalid_argument("'-tt' requires 1, 2, 4, 6 or 8 bits per pixel.");
+    print_help("uconvert"/*argv[0]*/);
+    return {};
+}
 
-            if (*bitsPerPixel == 2 && !(*stCompatiblePalette || *ttCompatiblePalette))
-                throw std::invalid_argument("'2 bits per pixel work only with '-st' or '-tt'");
+// parses a number which must be the whole 'str'
+static std::optional<int16_t> parse_number(const std::string& str)
+{
+    if (str.empty() || str.size() > 5 || str.find_first_not_of("0123456789") != std::string::npos)
+        return std::nullopt;
 
-            if (*bytesPerChunk && !*bitsPerPixel)
-                throw std::invalid_argument("-bpc requires bpp > 0.");
+    return std::atoi(str.c_str());
+}
 
-            if (*bytesPerChunk == -1 && *bitsPerPixel == 6)
-                throw std::invalid_argument("-bpp 6 requires bpc >= 0.");
+// overrides 'parsed' with ':'-separated tokens from 'spec', e.g. "bp4:pal12:st:out=image.bp4"
+static void parse_emit_spec(const std::string& spec, ParsedOptions& parsed, std::string& outputFilename)
+{
+    const auto& bppValues = allowedValues.at("-bpp").first;
+    const auto& palValues = allowedValues.at("-pal").first;
 
-            if (*bytesPerChunk > 0 && *bitsPerPixel/8 > *bytesPerChunk)
-                throw std::invalid_argument("bpp/8 > bpc.");
+    bool packed = false;
 
+    for (size_t begin = 0; begin <= spec.size(); ) {
+        // the file name can contain anything (even ':') so it must be the last token
+        if (spec.compare(begin, 4, "out=") == 0) {
+            outputFilename = spec.substr(begin + 4);
             if (outputFilename.empty())
-                outputFilename = arg.substr(0, arg.find_last_of('.')) + get_uimg_filename_ext();
+                throw std::invalid_argument("Empty file name in -emit " + spec + ".");
+            break;
+        }
+
+        const size_t end = std::min(spec.find(':', begin), spec.size());
+        const std::string token = spec.substr(begin, end - begin);
+        begin = end + 1;
+
+        std::optional<int16_t> value;
+        const size_t x = token.find('x');
+
+        if (token == "st") {
+            parsed.stCompatiblePalette = true;
+        } else if (token == "tt") {
+            parsed.ttCompatiblePalette = true;
+        } else if (token == "nib") {
+            packed = true;
+        } else if (token.compare(0, 2, "bp") == 0 && (value = parse_number(token.substr(2))) && bppValues.count(*value) && *value <= 8) {
+            // planar
+            parsed.bitsPerPixel = *value;
+            parsed.bytesPerChunk = 0;
+        } else if (token.compare(0, 1, "c") == 0 && (value = parse_number(token.substr(1))) && bppValues.count(*value) && *value > 0) {
+            // chunky, as many bytes per pixel as needed
+            parsed.bitsPerPixel = *value;
+            parsed.bytesPerChunk = *value <= 8 ? 1 : *value / 8;
+        } else if (token.compare(0, 3, "pal") == 0 && (value = parse_number(token.substr(3))) && palValues.count(*value)) {
+            parsed.paletteBits = *value;
+        } else if (x != std::string::npos && parse_number(token.substr(0, x)) && parse_number(token.substr(x + 1))) {
+            parsed.bitmapWidth = *parse_number(token.substr(0, x));
+            parsed.bitmapHeight = *parse_number(token.substr(x + 1));
+        } else {
+            throw_oss<std::invalid_argument>(std::ostringstream()
+                << "Unknown token '" << token << "' in -emit " << spec << "."
+            );
+        }
+    }
+
+    // in any order with 'bp'/'c'
+    if (packed)
+        parsed.bytesPerChunk = -1;
+}
+
+bool is_stdio(const std::string& filename)
+{
+    return filename == "-" || (filename.size() > 2 && filename.compare(filename.size() - 2, 2, ":-") == 0);
+}
+
+static std::string make_output_filename(std::string outputFilename, const std::string& inputFilename, const ConversionOptions& options)
+{
+    // stdin goes to stdout unless told otherwise
+    if (outputFilename.empty() && inputFilename == "-")
+        return inputFilename;
+
+    if (is_stdio(outputFilename))
+        return outputFilename;
+
+    if (outputFilename.empty())
+        outputFilename = inputFilename.substr(0, inputFilename.find_last_of('.')) + get_uimg_filename_ext(options);
 
-            if (outputFilename.find('.') == std::string::npos)
-                outputFilename += get_uimg_filename_ext();
+    if (outputFilename.find('.') == std::string::npos)
+        outputFilename += get_uimg_filename_ext(options);
+
+    return outputFilename;
+}
+
+std::vector<Job> parse_arguments(const std::vector<std::string>& args)
+{
+    ParsedOptions parsed;
+    std::string outputFilename;
+    std::vector<std::string> emitSpecs;
+    std::vector<std::string> inputFilenames;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+
+        // first non-option => it's a filename and so is everything after it ('-' is stdin)
+        if (arg.empty() || arg[0] != '-' || arg == "-") {
+            inputFilenames.assign(args.begin() + i, args.end());
+            break;
+        }
+
+        // end of options => everything after it is a filename, even if it starts with '-'
+        if (arg == "--") {
+            inputFilenames.assign(args.begin() + i + 1, args.end());
             break;
         }
 
@@ -219,20 +586,71 @@ std::string parse_arguments(int argc, char* argv[])
         {
             auto it = allowedFlags.find(arg);
             if (it != allowedFlags.end()) {
-                it->second = true;
+                parsed.*(it->second) = true;
                 continue;
             }
         }
 
+        // flag with an optional value
+        if (arg == "-stats") {
+            if (i + 1 < args.size() && args[i + 1] == "json") {
+                parsed.stats = StatsFormat::Json;
+                i++;
+            } else {
+                parsed.stats = StatsFormat::Text;
+            }
+            continue;
+        }
+
         // it must be a pair
-        if (i + 1 < argc-1)
+        if (i + 1 < args.size())
             i++;
         else
             print_help("uconvert"/*argv[0]*/);
 
         // special pair
         if (arg == "-out") {
-            outputFilename = argv[i];
+            outputFilename = args[i];
+            continue;
+        }
+
+        if (arg == "-emit") {
+            emitSpecs.push_back(args[i]);
+            continue;
+        }
+
+        if (arg == "-cache") {
+            parsed.cacheDirectory = args[i];
+            continue;
+        }
+
+        if (arg == "-palout") {
+            parsed.paletteFilename = args[i];
+            continue;
+        }
+
+        if (arg == "-usepal") {
+            parsed.fixedPaletteFilename = args[i];
+            continue;
+        }
+
+        if (arg == "-kernel") {
+            parsed.resampler = parse_name(args[i], resamplerNames);
+            continue;
+        }
+
+        if (arg == "-ordered") {
+            parsed.orderedDither = parse_name(args[i], orderedDitherNames);
+            continue;
+        }
+
+        if (arg == "-diffuse") {
+            parsed.errorDiffusion = parse_name(args[i], errorDiffusionNames);
+            continue;
+        }
+
+        if (arg == "-quantize") {
+            parsed.quantizer = parse_name(args[i], quantizerNames);
             continue;
         }
 
@@ -240,16 +658,165 @@ std::string parse_arguments(int argc, char* argv[])
         {
             auto it = allowedValues.find(arg);
             if (it == allowedValues.end()
-                    || (!it->second.first.empty() && it->second.first.find(std::atoi(argv[i])) == it->second.first.end()))
+                    || (!it->second.first.empty() && it->second.first.find(std::atoi(args[i].c_str())) == it->second.first.end()))
                 print_help("uconvert"/*argv[0]*/);
 
-            it->second.second = std::atoi(argv[i]);
+            parsed.*(it->second.second) = std::atoi(args[i].c_str());
             continue;
         }
     }
 
-    if (outputFilename.empty())
+    if (inputFilenames.empty())
         print_help("uconvert"/*argv[0]*/);
 
-    return outputFilename;
+    if (!outputFilename.empty() && inputFilenames.size() > 1)
+        throw std::invalid_argument("-out can't be used with more than one FILE.");
+
+    if (!outputFilename.empty() && !emitSpecs.empty())
+        throw std::invalid_argument("-out can't be used together with -emit (use 'out=' in the spec).");
+
+    if ((parsed.sharedPalette.value_or(false) || parsed.paletteFilename.has_value()) && !emitSpecs.empty())
+        throw std::invalid_argument("-sharedpal can't be used together with -emit.");
+
+    // without '-emit' there's exactly one target, made from the options alone
+    std::vector<std::pair<ConversionOptions, std::string>> targets;
+
+    if (emitSpecs.empty()) {
+        targets.emplace_back(apply_defaults(parsed), outputFilename);
+    } else {
+        for (const std::string& spec : emitSpecs) {
+            // options outside of the spec apply to every target
+            ParsedOptions parsedTarget = parsed;
+            std::string targetFilename;
+
+            parse_emit_spec(spec, parsedTarget, targetFilename);
+
+            if (!targetFilename.empty() && inputFilenames.size() > 1)
+                throw std::invalid_argument("'out=' can't be used with more than one FILE.");
+
+            targets.emplace_back(apply_defaults(parsedTarget), targetFilename);
+        }
+    }
+
+    std::vector<Job> jobs;
+
+    for (const std::string& inputFilename : inputFilenames) {
+        Job job { inputFilename, {}, parsed.threadCount, parsed.stats };
+
+        for (const auto& [options, targetFilename] : targets) {
+            job.targets.push_back(Target { make_output_filename(targetFilename, inputFilename, get_bitmap_options(options)), options });
+
+            if (options.incremental && (is_stdio(inputFilename) || is_stdio(job.targets.back().outputFilename)))
+                throw std::invalid_argument("-incremental can't be used with stdin or stdout.");
+
+            for (size_t i = 0; i + 1 < job.targets.size(); ++i) {
+                if (job.targets[i].outputFilename == job.targets.back().outputFilename) {
+                    throw_oss<std::invalid_argument>(std::ostringstream()
+                        << "More than one -emit would write " << job.targets.back().outputFilename << " (use 'out=' in the spec)."
+                    );
+                }
+            }
+        }
+
+        jobs.push_back(job);
+    }
+
+    return jobs;
+}
+
+// removes '<option> <value>' from args and returns <value> (or an empty string); 'filesFollow'
+// is set if there is any FILE after the options
+static std::string take_option_value(std::vector<std::string>& args, const std::string& option, bool& filesFollow)
+{
+    std::string value;
+    filesFollow = false;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+
+        if (arg.empty() || arg[0] != '-' || arg == "-" || arg == "--") {
+            filesFollow = true;
+            break;
+        }
+
+        if (arg == option && i + 1 < args.size()) {
+            value = args[i + 1];
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            --i;
+        } else if (arg == "-batch" || arg == "-serve" || arg == "-out" || arg == "-emit" || arg == "-cache" || arg == "-palout" || arg == "-usepal" || arg == "-kernel" || arg == "-ordered" || arg == "-diffuse" || arg == "-quantize" || allowedValues.find(arg) != allowedValues.end()) {
+            ++i;    // skip value
+        } else if (arg == "-stats" && i + 1 < args.size() && args[i + 1] == "json") {
+            ++i;    // skip optional value
+        }
+    }
+
+    return value;
+}
+
+std::string take_batch_filename(std::vector<std::string>& args)
+{
+    bool filesFollow;
+    const std::string batchFilename = take_option_value(args, "-batch", filesFollow);
+
+    if (!batchFilename.empty() && filesFollow)
+        throw std::invalid_argument("FILE can't be used together with -batch.");
+
+    return batchFilename;
+}
+
+std::string take_serve_socket(std::vector<std::string>& args)
+{
+    bool filesFollow;
+    const std::string socketPath = take_option_value(args, "-serve", filesFollow);
+
+    if (!socketPath.empty() && filesFollow)
+        throw std::invalid_argument("FILE can't be used together with -serve.");
+
+    return socketPath;
+}
+
+std::vector<std::vector<std::string>> read_batch_file(const std::string& filePath)
+{
+    std::ifstream ifs(filePath);
+    if (!ifs)
+        throw std::runtime_error("Opening batch file " + filePath + " failed.");
+
+    std::vector<std::vector<std::string>> lines;
+    std::string line;
+
+    while (std::getline(ifs, line)) {
+        std::vector<std::string> args;
+        std::string arg;
+        bool quoted = false;
+        bool inArg = false;
+
+        for (char c : line) {
+            if (c == '"') {
+                quoted = !quoted;
+                inArg = true;
+            } else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+                if (inArg)
+                    args.push_back(arg);
+                arg.clear();
+                inArg = false;
+            } else if (!quoted && !inArg && c == '#') {
+                // comment until the end of line
+                break;
+            } else {
+                arg += c;
+                inArg = true;
+            }
+        }
+
+        if (quoted)
+            throw std::invalid_argument("Unterminated quote in batch file " + filePath + ": " + line);
+
+        if (inArg)
+            args.push_back(arg);
+
+        // empty lines and comments are kept so line numbers still match
+        lines.push_back(args);
+    }
+
+    return lines;
 }
@@ -22,21 +22,110 @@
 #define ARGS_H
 
 #include <cstdint>
-#include <string>
 #include <optional>
+#include <string>
+#include <vector>
+
+// resizing filter
+enum class Resampler {
+    GraphicsMagick,
+    Box,
+    Bilinear,
+    Bicubic,
+    Lanczos
+};
+
+// palette quantizer for 1 - 8 bpp
+enum class Quantizer {
+    GraphicsMagick,
+    Native
+};
+
+// threshold matrix for reducing colours to the output's bits per channel
+enum class OrderedDither {
+    None,
+    Bayer,
+    BlueNoise
+};
+
+// error diffusion kernel for reducing colours to the palette or the output's bits per channel
+enum class ErrorDiffusion {
+    None,
+    FloydSteinberg,
+    Atkinson,
+    SierraLite
+};
+
+// report printed by '-stats'
+enum class StatsFormat {
+    None,
+    Text,
+    Json
+};
+
+struct ConversionOptions {
+    int16_t     bitmapWidth;            // -1 (if original width) or any number
+    int16_t     bitmapHeight;           // -1 (if original height) or any number
+    bool        filter;                 // if true, use filtering when resizing (GraphicsMagick only)
+    Resampler   resampler;              // GraphicsMagick's or one of the built-in resampling filters
+    bool        dither;                 // if true, use dithering when resizing and/or converting colours
+    OrderedDither orderedDither;        // ordered dithering into the output's bits per channel (before quantizing)
+    ErrorDiffusion errorDiffusion;      // error diffusion into the palette or the output's bits per channel
+    Quantizer   quantizer;              // GraphicsMagick's or the built-in quantizer (working with paletteBits)
+    int16_t     seed;                   // seed of the built-in quantizer's random choices
+    bool        sharedPalette;          // if true, all FILEs get one palette built (by the built-in quantizer) from all of them
+    std::string paletteFilename;        // empty or file the shared palette is saved into (the FILEs are saved without it then)
+    std::string fixedPaletteFilename;   // empty or UIMG file whose palette is used instead of quantizing
+
+    int16_t     bitsPerPixel;           // 1, 2, 4, 6, 8 (both planar and chunky); 16, 24, 32 (chunky only) or 0 (if explicitly disabled)
+    int16_t     bytesPerChunk;          // -1 (if packed), 1, 2, 3, 4 or 0 (if planar or disabled)
+    int16_t     paletteBits;            // 9, 12, 18, 24 or 0 (if bitsPerPixel > 8 or explicitly disabled)
+    bool        stCompatiblePalette;    // if true, use the ST/E palette registers
+    bool        ttCompatiblePalette;    // if true, use the TT palette registers
+
+    int16_t     threadCount;            // 0 (if one per hardware thread) or number of threads used for encoding, resizing and quantizing
+    int16_t     bandHeight;             // 0 (if whole bitmap at once) or number of rows (divisible by 16) encoded and written at once
+
+    std::string cacheDirectory;         // empty (if disabled) or directory with decoded and resized source bitmaps
+    int16_t     cacheSize;              // maximum size of cacheDirectory in MiB
+    bool        clearCache;             // if true, empty cacheDirectory before converting
+
+    bool        incremental;            // if true, skip outputs whose manifest says they are up to date
+    StatsFormat stats;                  // report of the whole process' stages and counters printed at exit (if not None)
+};
+
+// one output file
+struct Target {
+    std::string         outputFilename;
+    ConversionOptions   options;        // all defaults applied
+};
 
-extern std::optional<int16_t>  bitmapWidth;           // -1 (if original width) or any number
-extern std::optional<int16_t>  bitmapHeight;          // -1 (if original height) or any number
-extern std::optional<bool>     filter;                // if true, use filtering when resizing
-extern std::optional<bool>     dither;                // if true, use dithering when resizing and/or converting colours
+struct Job {
+    std::string         inputFilename;
+    std::vector<Target> targets;        // one or more (see '-emit'), all made from the same decoded input
 
-extern std::optional<int16_t>   bitsPerPixel;         // 1, 2, 4, 6, 8 (both planar and chunky); 15, 16, 24, 32 (chunky only) or 0 (if explicitly disabled)
-extern std::optional<int16_t>   bytesPerChunk;        // -1 (if implicit/packed), 1, 2, 3, 4 or 0 (if disabled)
-extern std::optional<int16_t>   paletteBits;          // 9, 12, 18, 24 or 0 (if bitsPerPixel > 8 or explicitly disabled)
-extern std::optional<bool>      stCompatiblePalette;  // if true, use the ST/E palette registers
-extern std::optional<bool>      ttCompatiblePalette;  // if true, use the TT palette registers
+    // only if given explicitly (the targets have the defaults), '-j' and '-stats' apply to the whole process
+    std::optional<int16_t>      threadCount;
+    std::optional<StatsFormat>  stats;
+};
 
-extern std::string get_uimg_filename_ext();
-extern std::string parse_arguments(int argc, char* argv[]);
+extern std::string get_uimg_filename_ext(const ConversionOptions& options);
+// options the output bitmap is saved with (without palette if it goes into paletteFilename)
+extern ConversionOptions get_bitmap_options(const ConversionOptions& options);
+// palette type as stored in the UIMG flags (0 if no palette)
+extern int get_palette_type(const ConversionOptions& options);
+// all options which affect the output file's content (anything added to ConversionOptions must be considered here)
+extern std::string get_options_signature(const ConversionOptions& options);
+// '-' is stdin (as FILE) or stdout (as output, with the UIMG format), '<format>:-' is stdout
+// with a GraphicsMagick format
+extern bool is_stdio(const std::string& filename);
+// all options must precede the first FILE; every FILE is converted with the same options
+extern std::vector<Job> parse_arguments(const std::vector<std::string>& args);
+// removes '-batch <filename>' from args and returns <filename> (or an empty string)
+extern std::string take_batch_filename(std::vector<std::string>& args);
+// removes '-serve <socket>' from args and returns <socket> (or an empty string)
+extern std::string take_serve_socket(std::vector<std::string>& args);
+// one command line (options and FILE(s)) per line, '#' starts a comment
+extern std::vector<std::vector<std::string>> read_batch_file(const std::string& filePath);
 
 #endif // ARGS_H
@@ -0,0 +1,524 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <GraphicsMagick/Magick++.h>
+using namespace Magick;
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "args.h"
+#include "c2p.h"
+#include "encode.h"
+#include "helpers.h"
+#include "json.h"
+#include "palette.h"
+#include "quantize.h"
+#include "resample.h"
+#include "threadpool.h"
+#include "uimg.h"
+#include "version.h"
+
+namespace fs = std::filesystem;
+
+// Benchmark of the individual conversion stages: every stage runs once to warm up and then
+// '-runs' times, the fastest run is reported as one JSON object per line on stdout. Inputs are
+// two synthetic bitmaps and the given FILEs, resized to the sizes and converted into the
+// formats of ushow/tests/generate.sh.
+
+constexpr size_t DefaultRuns = 5;
+constexpr const char* DefaultInput = "ushow/tests/test.webp";
+
+// not equal to any of the sizes below so that every resize does some work
+constexpr size_t SyntheticWidth = 1280;
+constexpr size_t SyntheticHeight = 720;
+
+// bitmap sizes of ushow/tests/generate.sh
+static const std::vector<std::pair<size_t, size_t>> DefaultSizes = {
+    { 240, 135 }, { 480, 270 }, { 960, 540 }, { 1920, 1080 }
+};
+
+static const std::vector<std::pair<std::string, Resampler>> Resamplers = {
+    { "gm",       Resampler::GraphicsMagick },
+    { "box",      Resampler::Box            },
+    { "bilinear", Resampler::Bilinear       },
+    { "bicubic",  Resampler::Bicubic        },
+    { "lanczos",  Resampler::Lanczos        }
+};
+
+// one output format of ushow/tests/generate.sh
+struct Format {
+    int16_t     bitsPerPixel;
+    int16_t     bytesPerChunk;      // as '-bpc' (0: planar, only for bpp <= 8)
+    int16_t     paletteBits;        // only for bpp <= 8
+    std::string machine;            // "falcon", "tt" ('-tt') or "st" ('-st')
+};
+
+static std::vector<Format> get_formats()
+{
+    std::vector<Format> formats;
+
+    auto add = [&formats](int16_t paletteBits, const std::string& machine, std::initializer_list<int16_t> bitsPerPixels, std::initializer_list<int16_t> packedBitsPerPixels) {
+        for (int16_t bytesPerChunk : { 0, 1 }) {
+            for (int16_t bitsPerPixel : bitsPerPixels)
+                formats.push_back({ bitsPerPixel, bytesPerChunk, paletteBits, machine });
+        }
+        for (int16_t bitsPerPixel : packedBitsPerPixels)
+            formats.push_back({ bitsPerPixel, -1, paletteBits, machine });
+    };
+
+    for (int16_t paletteBits : { 9, 12, 18, 24 })
+        add(paletteBits, "falcon", { 1, 4, 6, 8 }, { 1, 4 });
+    for (int16_t paletteBits : { 9, 12 })
+        add(paletteBits, "tt", { 1, 2, 4, 6, 8 }, { 1, 2, 4 });
+    for (int16_t paletteBits : { 9, 12 })
+        add(paletteBits, "st", { 1, 2, 4 }, { 1, 2, 4 });
+
+    for (int16_t bitsPerPixel : { 16, 24, 32 })
+        formats.push_back({ bitsPerPixel, 0, 0, "falcon" });
+
+    return formats;
+}
+
+// all defaults applied the same way as for uconvert's command line
+static ConversionOptions get_options(const Format& format, size_t width, size_t height)
+{
+    std::vector<std::string> args = {
+        "-width", std::to_string(width), "-height", std::to_string(height), "-filter", "-dither",
+        "-bpp", std::to_string(format.bitsPerPixel)
+    };
+
+    if (format.bitsPerPixel <= 8) {
+        args.insert(args.end(), { "-pal", std::to_string(format.paletteBits) });
+        if (format.bytesPerChunk != 0)
+            args.insert(args.end(), { "-bpc", std::to_string(format.bytesPerChunk) });
+        if (format.machine != "falcon")
+            args.push_back("-" + format.machine);
+    }
+
+    args.push_back("bench.png");
+
+    return parse_arguments(args).front().targets.front().options;
+}
+
+static std::string get_layout(const ConversionOptions& options)
+{
+    if (options.bytesPerChunk == 0)
+        return "planar";
+    else if (options.bytesPerChunk == -1)
+        return "packed";
+    else
+        return "chunky";
+}
+
+// deterministic content: smooth gradients (few distinct colours per area) or white noise
+// (worst case for the quantizers)
+static Image make_synthetic_image(bool noise)
+{
+    Image image({ SyntheticWidth, SyntheticHeight }, { 0, 0, 0 });
+    image.modifyImage();
+
+    PixelPacket* pPixelPackets = image.getPixels(0, 0, SyntheticWidth, SyntheticHeight);
+    std::mt19937 random(1);
+
+    for (size_t y = 0; y < SyntheticHeight; ++y) {
+        for (size_t x = 0; x < SyntheticWidth; ++x) {
+            uint8_t r, g, b;
+
+            if (noise) {
+                const uint32_t value = random();
+                r = value;
+                g = value >> 8;
+                b = value >> 16;
+            } else {
+                r = x * 255 / (SyntheticWidth - 1);
+                g = y * 255 / (SyntheticHeight - 1);
+                b = std::lround(127.5 + 127.5 * std::sin(std::hypot(double(x) - SyntheticWidth / 2, double(y) - SyntheticHeight / 2) / 32));
+            }
+
+            PixelPacket& pixelPacket = pPixelPackets[y * SyntheticWidth + x];
+            pixelPacket.red     = r * (MaxRGB / 255);
+            pixelPacket.green   = g * (MaxRGB / 255);
+            pixelPacket.blue    = b * (MaxRGB / 255);
+            pixelPacket.opacity = 0;
+        }
+    }
+
+    image.syncPixels();
+
+    return image;
+}
+
+static Blob read_file(const std::string& filePath)
+{
+    std::ifstream ifs(filePath, std::ifstream::binary);
+    if (!ifs)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Opening " << filePath << " failed.");
+
+    const std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    return Blob(data.data(), data.size());
+}
+
+// fastest of 'runs' runs of 'stage' (after a warm-up run); 'setup' is called before every run and not timed
+static double measure(size_t runs, const std::function<void()>& setup, const std::function<void()>& stage)
+{
+    double best = std::numeric_limits<double>::max();
+
+    for (size_t i = 0; i <= runs; ++i) {
+        setup();
+
+        const auto start = std::chrono::steady_clock::now();
+        stage();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (i > 0)
+            best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+// what one measured stage has processed
+struct Measurement {
+    std::string                 stage;
+    std::string                 input;
+    std::string                 variant;                // resampler, quantizer or layout (if any)
+    size_t                      width = 0;
+    size_t                      height = 0;
+    const ConversionOptions*    pOptions = nullptr;     // output format (if any)
+    size_t                      pixels = 0;
+    size_t                      bytes = 0;              // read or produced
+};
+
+static void report(const Measurement& measurement, double seconds)
+{
+    std::ostringstream oss;
+
+    oss << "{\"stage\":" << json_string(measurement.stage)
+        << ",\"input\":" << json_string(measurement.input);
+
+    if (!measurement.variant.empty())
+        oss << ",\"variant\":" << json_string(measurement.variant);
+
+    oss << ",\"width\":" << measurement.width << ",\"height\":" << measurement.height;
+
+    if (const ConversionOptions* pOptions = measurement.pOptions) {
+        oss << ",\"bpp\":" << pOptions->bitsPerPixel << ",\"bpc\":" << pOptions->bytesPerChunk
+            << ",\"pal\":" << pOptions->paletteBits
+            << ",\"machine\":" << json_string(pOptions->stCompatiblePalette ? "st" : pOptions->ttCompatiblePalette ? "tt" : "falcon");
+    }
+
+    oss << ",\"seconds\":" << seconds << ",\"pixels\":" << measurement.pixels << ",\"bytes\":" << measurement.bytes;
+
+    if (measurement.pixels)
+        oss << ",\"mpixels_per_s\":" << measurement.pixels / seconds / 1e6;
+    oss << ",\"mb_per_s\":" << measurement.bytes / seconds / 1e6 << "}";
+
+    std::cout << oss.str() << std::endl;
+}
+
+// the same parallel encoding as uconvert's save_uimg()
+static void encode_image(const Image& image, const ConversionOptions& options, ThreadPool& threadPool, std::vector<uint8_t>& buffer)
+{
+    const EncodeFunc encode = get_encoder(options.bitsPerPixel, options.bytesPerChunk);
+
+    buffer.resize(get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, image.columns(), image.rows()));
+
+    const PixelPacket* pPixelPackets = image.getConstPixels(0, 0, image.columns(), image.rows());
+    const IndexPacket* pIndexPackets = image.getConstIndexes();
+
+    threadPool.parallel_for(image.rows(), EncodeGrain, [&](size_t begin, size_t end) {
+        const size_t offset = begin * image.columns();
+        encode(pPixelPackets + offset, pIndexPackets ? pIndexPackets + offset : nullptr, image.columns(), end - begin,
+               buffer.data() + get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, image.columns(), begin));
+    });
+}
+
+static void quantize(Image& image, const ConversionOptions& options, Quantizer quantizer, ThreadPool& threadPool)
+{
+    if (quantizer == Quantizer::Native) {
+        quantize_native(image, options, threadPool);
+    } else {
+        image.quantizeDither(options.dither);
+        image.quantizeColors(1u << options.bitsPerPixel);
+        image.quantize();
+    }
+}
+
+static void bench_input(const std::string& input, const Blob& blob, const std::vector<std::pair<size_t, size_t>>& sizes,
+                        size_t runs, const fs::path& outputPath, ThreadPool& threadPool)
+{
+    const std::vector<Format> formats = get_formats();
+
+    Image decoded;
+    {
+        Image image;
+        const double seconds = measure(runs, [] {}, [&] { image.read(blob); });
+        decoded = image;
+
+        report({ "decode", input, "", decoded.columns(), decoded.rows(), nullptr, size_t(decoded.columns()) * decoded.rows(), blob.length() }, seconds);
+    }
+
+    for (const auto& [width, height] : sizes) {
+        const size_t pixels = width * height;
+        const ConversionOptions resizeOptions = get_options(formats.back(), width, height);
+
+        // the same filter as in ushow/tests/generate.sh ('-filter') for the stages below
+        Image resized;
+
+        for (const auto& [name, resampler] : Resamplers) {
+            ConversionOptions options = resizeOptions;
+            options.resampler = resampler;
+
+            Image image;
+            const double seconds = measure(runs,
+                [&] { image = decoded; image.modifyImage(); },
+                [&] { resize_image(image, width, height, options, threadPool); });
+
+            if (resampler == Resampler::GraphicsMagick)
+                resized = image;
+
+            report({ "resize", input, name, width, height, nullptr, pixels, pixels * sizeof(PixelPacket) }, seconds);
+        }
+
+        // GraphicsMagick's (the default quantizer) result for every bpp and palette
+        std::map<std::pair<int16_t, int16_t>, Image> quantized;
+
+        for (const Format& format : formats) {
+            if (format.bitsPerPixel > 8 || quantized.count({ format.bitsPerPixel, format.paletteBits }))
+                continue;
+
+            const ConversionOptions options = get_options(format, width, height);
+
+            for (const Quantizer quantizer : { Quantizer::GraphicsMagick, Quantizer::Native }) {
+                Image image;
+                const double seconds = measure(runs,
+                    [&] { image = resized; image.modifyImage(); },
+                    [&] { quantize(image, options, quantizer, threadPool); });
+
+                if (quantizer == Quantizer::GraphicsMagick)
+                    quantized[{ format.bitsPerPixel, format.paletteBits }] = image;
+
+                report({ "quantize", input, quantizer == Quantizer::Native ? "native" : "gm", width, height, &options,
+                         pixels, pixels * sizeof(PixelPacket) }, seconds);
+            }
+        }
+
+        // on its own (single-threaded), the planar encoders do the same per row
+        for (int planes : { 1, 2, 4, 6, 8 }) {
+            const Image& image = quantized.lower_bound({ planes, 0 })->second;
+            image.getConstPixels(0, 0, width, height);
+            const IndexPacket* pIndexPackets = image.getConstIndexes();
+
+            std::vector<uint8_t> chunky(pixels);
+            for (size_t i = 0; i < pixels; ++i)
+                chunky[i] = pIndexPackets[i];
+
+            std::vector<uint8_t> planar(pixels * planes / 8);
+            const double seconds = measure(runs, [] {}, [&] { chunky_to_planar(chunky.data(), pixels, planes, planar.data()); });
+
+            report({ "c2p", input, std::to_string(planes) + (planes == 1 ? " plane" : " planes"), width, height, nullptr, pixels, planar.size() }, seconds);
+        }
+
+        for (const Format& format : formats) {
+            const ConversionOptions options = get_options(format, width, height);
+            const Image& image = format.bitsPerPixel <= 8 ? quantized.at({ format.bitsPerPixel, format.paletteBits }) : resized;
+
+            std::vector<uint8_t> bitmap;
+            {
+                const double seconds = measure(runs, [] {}, [&] { encode_image(image, options, threadPool, bitmap); });
+
+                report({ "encode", input, get_layout(options), width, height, &options, pixels, bitmap.size() }, seconds);
+            }
+
+            std::ostringstream uimg;
+            save_uimg_header(uimg, options, width, height);
+
+            if (options.paletteBits) {
+                const std::vector<PaletteColor> palette = get_palette(image);
+
+                std::ostringstream oss;
+                const double seconds = measure(runs,
+                    [&] { oss.str(""); },
+                    [&] { save_uimg_palette(oss, options, palette, 1 << options.bitsPerPixel); });
+
+                report({ "save_palette", input, "", width, height, &options, 0, oss.str().size() }, seconds);
+
+                uimg << oss.str();
+            }
+
+            uimg.write((const char*)bitmap.data(), sizeof_vector(bitmap));
+            const std::string data = uimg.str();
+
+            {
+                const double seconds = measure(runs, [] {}, [&] {
+                    std::ofstream ofs(outputPath, std::ofstream::binary);
+                    ofs.write(data.data(), data.size());
+                    ofs.close();
+                    if (!ofs)
+                        throw std::runtime_error("Writing the output file failed.");
+                });
+
+                report({ "write", input, "", width, height, &options, pixels, data.size() }, seconds);
+            }
+
+            {
+                const double seconds = measure(runs, [] {}, [&] {
+                    const UimgView view((const uint8_t*)data.data(), data.size());
+                    load_uimg(view);
+                });
+
+                report({ "load_uimg", input, "", width, height, &options, pixels, data.size() }, seconds);
+            }
+        }
+    }
+}
+
+static size_t parse_number(const std::string& arg, const std::string& value)
+{
+    size_t pos = 0;
+    long number = -1;
+
+    try {
+        number = std::stol(value, &pos);
+    }
+    catch (std::exception&) {
+    }
+
+    if (pos != value.size() || number < 0)
+        throw_oss<std::invalid_argument>(std::ostringstream() << "Invalid value for " << arg << ": '" << value << "'.");
+
+    return number;
+}
+
+static void print_usage(const char* argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [-j <threads>] [-runs <n>] [-size <width>x<height>] [FILE...]" << std::endl
+              << std::endl
+              << "Times decoding, resizing, quantizing, encoding, c2p, saving the palette, writing and loading" << std::endl
+              << "of the synthetic bitmaps and FILEs (default: " << DefaultInput << ") in the sizes and formats" << std::endl
+              << "of ushow/tests/generate.sh, one JSON object per line. '-size' (repeatable) replaces the sizes." << std::endl;
+
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    const std::vector<std::string> args(argv + 1, argv + argc);
+
+    size_t threadCount = 0;
+    size_t runs = DefaultRuns;
+    std::vector<std::pair<size_t, size_t>> sizes;
+    std::vector<std::string> inputFilenames;
+
+    try {
+        for (size_t i = 0; i < args.size(); ++i) {
+            const std::string& arg = args[i];
+
+            // first non-option => it's a filename and so is everything after it
+            if (arg.empty() || arg[0] != '-') {
+                inputFilenames.assign(args.begin() + i, args.end());
+                break;
+            }
+
+            if (i + 1 == args.size())
+                print_usage(argv[0]);
+
+            const std::string& value = args[++i];
+
+            if (arg == "-j") {
+                threadCount = parse_number(arg, value);
+            } else if (arg == "-runs") {
+                runs = std::max<size_t>(parse_number(arg, value), 1);
+            } else if (arg == "-size") {
+                const size_t x = value.find('x');
+                if (x == std::string::npos)
+                    print_usage(argv[0]);
+
+                sizes.emplace_back(parse_number(arg, value.substr(0, x)), parse_number(arg, value.substr(x + 1)));
+                if (sizes.back().first == 0 || sizes.back().first % 16 != 0 || sizes.back().second == 0)
+                    throw std::invalid_argument("Width must be a positive number divisible by 16, height a positive number.");
+            } else {
+                print_usage(argv[0]);
+            }
+        }
+
+        if (sizes.empty())
+            sizes = DefaultSizes;
+
+        if (inputFilenames.empty() && fs::exists(DefaultInput))
+            inputFilenames.push_back(DefaultInput);
+
+        InitializeMagick(argv[0]);
+        if (threadCount)
+            MagickLib::SetMagickResourceLimit(MagickLib::ThreadsResource, threadCount);   // OpenMP threads
+
+        ThreadPool threadPool(threadCount);
+
+        std::ostringstream version;
+        version << (VERSION >> 8) << "." << std::setfill('0') << std::setw(2) << (VERSION & 0xFFu);
+
+        std::cout << "{\"version\":" << json_string(version.str())
+                  << ",\"threads\":" << threadPool.threads() << ",\"runs\":" << runs << "}" << std::endl;
+
+        const fs::path outputPath = fs::temp_directory_path() / ("uconvert-bench-" + std::to_string(getpid()) + ".uimg");
+
+        for (bool noise : { false, true }) {
+            Blob blob;
+            make_synthetic_image(noise).write(&blob, "PNG");
+
+            bench_input(noise ? "synthetic-noise" : "synthetic-gradient", blob, sizes, runs, outputPath, threadPool);
+        }
+
+        for (const std::string& inputFilename : inputFilenames)
+            bench_input(inputFilename, read_file(inputFilename), sizes, runs, outputPath, threadPool);
+
+        std::error_code ec;
+        fs::remove(outputPath, ec);
+    }
+    catch(std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
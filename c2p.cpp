@@ -0,0 +1,264 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "c2p.h"
+#include "c2p_kernels.h"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define C2P_X86
+#include <immintrin.h>
+#endif
+
+#include "helpers.h"
+
+// 8x8 bit matrix transpose done in three merge passes (swap 1x1, 2x2 and 4x4 bit blocks),
+// the same idea as Kalms' c2p routines (see ushow/c2p1x1_8.s) just on a 64-bit register
+//
+// input:  8 pixels, pixel 0 in the most significant byte
+// output: 8 plane bytes, plane 0 in the least significant byte (pixel 0 in its MSB)
+static inline uint64_t transpose8x8(uint64_t x)
+{
+    x = (x & 0xAA55AA55AA55AA55ull) | ((x & 0x00AA00AA00AA00AAull) << 7)  | ((x >> 7)  & 0x00AA00AA00AA00AAull);
+    x = (x & 0xCCCC3333CCCC3333ull) | ((x & 0x0000CCCC0000CCCCull) << 14) | ((x >> 14) & 0x0000CCCC0000CCCCull);
+    x = (x & 0xF0F0F0F00F0F0F0Full) | ((x & 0x00000000F0F0F0F0ull) << 28) | ((x >> 28) & 0x00000000F0F0F0F0ull);
+    return x;
+}
+
+static inline uint64_t load_big_endian64(const uint8_t* p)
+{
+    uint64_t x;
+    std::memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static inline void store_big_endian64(uint8_t* p, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    std::memcpy(p, &x, sizeof(x));
+}
+
+static void c2p_scalar(const uint8_t* pChunky, size_t pixels, int planes, uint8_t* pPlanar)
+{
+    for (const uint8_t* pChunkyEnd = pChunky + pixels; pChunky != pChunkyEnd; pChunky += 16) {
+        const uint64_t hi = transpose8x8(load_big_endian64(pChunky));       // pixels 0-7
+        const uint64_t lo = transpose8x8(load_big_endian64(pChunky + 8));   // pixels 8-15
+
+        for (int i = 0; i < planes; ++i) {
+            *pPlanar++ = hi >> (i * 8);    // MSB
+            *pPlanar++ = lo >> (i * 8);    // LSB
+        }
+    }
+}
+
+#ifdef C2P_X86
+// pmovmskb collects bit 7 of every byte so all we need is to shift the wanted bit
+// into that position; bytes are reversed first so pixel 0 ends up in bit 15
+static inline __m128i reverse_bytes_sse2(__m128i v)
+{
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void c2p_sse2(const uint8_t* pChunky, size_t pixels, int planes, uint8_t* pPlanar)
+{
+    for (const uint8_t* pChunkyEnd = pChunky + pixels; pChunky != pChunkyEnd; pChunky += 16) {
+        const __m128i v = reverse_bytes_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pChunky)));
+
+        for (int i = 0; i < planes; ++i) {
+            const int plane = _mm_movemask_epi8(_mm_sll_epi16(v, _mm_cvtsi32_si128(7 - i)));
+            *pPlanar++ = plane >> 8;    // MSB
+            *pPlanar++ = plane;         // LSB
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void c2p_avx2(const uint8_t* pChunky, size_t pixels, int planes, uint8_t* pPlanar)
+{
+    // reverse bytes in each 128-bit lane, i.e. in each group of 16 pixels
+    const __m256i reverse = _mm256_setr_epi8(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+    const size_t groupSize = planes * 2;    // in bytes
+
+    const uint8_t* pChunkyEnd = pChunky + (pixels & ~size_t(31));
+    for (; pChunky != pChunkyEnd; pChunky += 32, pPlanar += groupSize * 2) {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pChunky)), reverse);
+
+        for (int i = 0; i < planes; ++i) {
+            // low half: first 16 pixels, high half: next 16 pixels
+            const uint32_t plane = _mm256_movemask_epi8(_mm256_sll_epi16(v, _mm_cvtsi32_si128(7 - i)));
+            pPlanar[i * 2]                 = plane >> 8;
+            pPlanar[i * 2 + 1]             = plane;
+            pPlanar[groupSize + i * 2]     = plane >> 24;
+            pPlanar[groupSize + i * 2 + 1] = plane >> 16;
+        }
+    }
+
+    if (pixels & 31)
+        c2p_sse2(pChunky, 16, planes, pPlanar);
+}
+#endif
+
+// the bit matrix transpose is its own inverse so p2c is the same thing backwards
+static void p2c_scalar(const uint8_t* pPlanar, size_t pixels, int planes, uint8_t* pChunky)
+{
+    for (const uint8_t* pChunkyEnd = pChunky + pixels; pChunky != pChunkyEnd; pChunky += 16) {
+        uint64_t hi = 0;
+        uint64_t lo = 0;
+
+        for (int i = 0; i < planes; ++i) {
+            hi |= uint64_t(*pPlanar++) << (i * 8);  // MSB
+            lo |= uint64_t(*pPlanar++) << (i * 8);  // LSB
+        }
+
+        store_big_endian64(pChunky,     transpose8x8(hi));
+        store_big_endian64(pChunky + 8, transpose8x8(lo));
+    }
+}
+
+#ifdef C2P_X86
+// transpose8x8() on both 64-bit halves at once
+static inline __m128i transpose8x8_sse2(__m128i x)
+{
+    const auto swap = [](__m128i x, uint64_t mask, int shift) {
+        const __m128i m = _mm_set1_epi64x(mask);
+        const __m128i t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, shift)), m);
+        return _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, shift));
+    };
+
+    x = swap(x, 0x00AA00AA00AA00AAull, 7);
+    x = swap(x, 0x0000CCCC0000CCCCull, 14);
+    x = swap(x, 0x00000000F0F0F0F0ull, 28);
+    return x;
+}
+
+static void p2c_sse2(const uint8_t* pPlanar, size_t pixels, int planes, uint8_t* pChunky)
+{
+    const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+    const size_t groupSize = planes * 2;    // in bytes
+
+    for (const uint8_t* pChunkyEnd = pChunky + pixels; pChunky != pChunkyEnd; pChunky += 16, pPlanar += groupSize) {
+        __m128i v;
+        if (planes == 8) {
+            v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPlanar));
+        } else {
+            alignas(16) uint8_t group[16] = {};
+            std::memcpy(group, pPlanar, groupSize);
+            v = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+        }
+
+        // low half: plane MSBs (pixels 0-7), high half: plane LSBs (pixels 8-15)
+        v = _mm_packus_epi16(_mm_and_si128(v, lowBytes), _mm_srli_epi16(v, 8));
+        v = transpose8x8_sse2(v);
+
+        // pixel 0 is in the most significant byte of each half
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pChunky), v);
+    }
+}
+#endif
+
+std::vector<C2pKernel> get_c2p_kernels()
+{
+    std::vector<C2pKernel> kernels { { "scalar", c2p_scalar } };
+#ifdef C2P_X86
+    kernels.push_back({ "sse2", c2p_sse2 });
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({ "avx2", c2p_avx2 });
+#endif
+    return kernels;
+}
+
+std::vector<C2pKernel> get_p2c_kernels()
+{
+    std::vector<C2pKernel> kernels { { "scalar", p2c_scalar } };
+#ifdef C2P_X86
+    kernels.push_back({ "sse2", p2c_sse2 });
+#endif
+    return kernels;
+}
+
+static C2pFunc select_c2p()
+{
+#ifdef C2P_X86
+    if (__builtin_cpu_supports("avx2"))
+        return c2p_avx2;
+    return c2p_sse2;
+#else
+    return c2p_scalar;
+#endif
+}
+
+void chunky_to_planar(const uint8_t* pChunky, size_t pixels, int planes, uint8_t* pPlanar)
+{
+    static const C2pFunc c2p = select_c2p();
+
+    assert(pixels % 16 == 0);
+
+    switch (planes) {
+    case 1:
+    case 2:
+    case 4:
+    case 6:
+    case 8:
+        c2p(pChunky, pixels, planes, pPlanar);
+        break;
+
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of bitplanes: " << planes
+        );
+    }
+}
+
+void planar_to_chunky(const uint8_t* pPlanar, size_t pixels, int planes, uint8_t* pChunky)
+{
+#ifdef C2P_X86
+    constexpr C2pFunc p2c = p2c_sse2;
+#else
+    constexpr C2pFunc p2c = p2c_scalar;
+#endif
+
+    assert(pixels % 16 == 0);
+
+    if (planes < 1 || planes > 8) {
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of bitplanes: " << planes
+        );
+    }
+
+    p2c(pPlanar, pixels, planes, pChunky);
+}
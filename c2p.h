@@ -0,0 +1,35 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef C2P_H
+#define C2P_H
+
+#include <cstddef>
+#include <cstdint>
+
+// converts 'pixels' (must be divisible by 16) chunky pixels into interleaved bitplanes,
+// i.e. 'planes' (1, 2, 4, 6 or 8) big endian words per every 16 pixels
+void chunky_to_planar(const uint8_t* pChunky, size_t pixels, int planes, uint8_t* pPlanar);
+
+// the opposite: 'planes' (1 - 8) big endian words per every 16 pixels into 'pixels'
+// (must be divisible by 16) chunky pixels
+void planar_to_chunky(const uint8_t* pPlanar, size_t pixels, int planes, uint8_t* pChunky);
+
+#endif // C2P_H
@@ -0,0 +1,42 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef C2P_KERNELS_H
+#define C2P_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// internal to c2p.cpp: every implementation behind chunky_to_planar() and planar_to_chunky(),
+// not only the one picked for this CPU (so the differential test can check all of them)
+
+using C2pFunc = void (*)(const uint8_t*, size_t, int, uint8_t*);
+
+struct C2pKernel {
+    const char* name;
+    C2pFunc     func;
+};
+
+// only the ones this CPU supports
+std::vector<C2pKernel> get_c2p_kernels();
+std::vector<C2pKernel> get_p2c_kernels();
+
+#endif // C2P_KERNELS_H
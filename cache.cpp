@@ -0,0 +1,270 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+namespace fs = std::filesystem;
+
+// bump whenever the layout below (or the way resizing is done) changes
+constexpr uint16_t CacheVersion = 1;
+
+constexpr const char* CacheExtension = ".ucache";
+
+// native endianness and Quantum size, the cache is not meant to be shared between machines
+struct CacheHeader {
+    char        id[4];
+    uint16_t    version;
+    uint16_t    quantumDepth;
+    uint32_t    columns;
+    uint32_t    rows;
+    uint32_t    sourceColumns;
+    uint32_t    sourceRows;
+    uint32_t    colorMapSize;   // 0 if DirectClass
+    uint8_t     matte;
+    uint8_t     reserved[3];
+    // colormap (PixelPacket[colorMapSize])
+    // pixels (PixelPacket[columns * rows])
+    // indexes (IndexPacket[columns * rows], only if PseudoClass)
+};
+
+static size_t get_entry_size(const CacheHeader& header)
+{
+    const size_t pixels = size_t(header.columns) * header.rows;
+
+    return sizeof(CacheHeader)
+        + header.colorMapSize * sizeof(Magick::PixelPacket)
+        + pixels * sizeof(Magick::PixelPacket)
+        + (header.colorMapSize ? pixels * sizeof(Magick::IndexPacket) : 0);
+}
+
+static fs::path get_entry_path(const std::string& directory, const std::string& key)
+{
+    return fs::path(directory) / (key + CacheExtension);
+}
+
+std::string get_cache_key(uint64_t sourceHash, int16_t width, int16_t height, bool filter, Resampler resampler)
+{
+    const int64_t fields[] = { CacheVersion, QuantumDepth, width, height, filter, static_cast<int64_t>(resampler) };
+
+    Hasher hasher(sourceHash);
+    hasher.update(fields, sizeof(fields));
+
+    return to_hex(sourceHash) + "-" + to_hex(hasher.digest());
+}
+
+bool load_cached_image(const std::string& directory, const std::string& key, ResizedImage& resizedImage)
+{
+    const fs::path path = get_entry_path(directory, key);
+
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* pMapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMapped == MAP_FAILED)
+        return false;
+
+    const uint8_t* p = static_cast<const uint8_t*>(pMapped);
+
+    CacheHeader header;
+    std::memcpy(&header, p, sizeof(header));
+
+    const bool valid = std::memcmp(header.id, "UCCH", 4) == 0
+        && header.version == CacheVersion
+        && header.quantumDepth == QuantumDepth
+        && header.columns > 0 && header.rows > 0
+        && get_entry_size(header) == static_cast<size_t>(st.st_size);
+
+    if (valid) {
+        const size_t pixels = size_t(header.columns) * header.rows;
+
+        const Magick::PixelPacket* pColorMap = reinterpret_cast<const Magick::PixelPacket*>(p + sizeof(CacheHeader));
+        const Magick::PixelPacket* pPixels = pColorMap + header.colorMapSize;
+        const Magick::IndexPacket* pIndexes = reinterpret_cast<const Magick::IndexPacket*>(pPixels + pixels);
+
+        Magick::Image image({header.columns, header.rows}, {0, 0, 0});
+        image.matte(header.matte);
+
+        if (header.colorMapSize) {
+            image.classType(Magick::PseudoClass);
+            image.colorMapSize(header.colorMapSize);
+            for (size_t i = 0; i < header.colorMapSize; ++i)
+                image.colorMap(i, Magick::Color(pColorMap[i].red, pColorMap[i].green, pColorMap[i].blue, pColorMap[i].opacity));
+        } else {
+            image.classType(Magick::DirectClass);
+        }
+
+        std::memcpy(image.getPixels(0, 0, header.columns, header.rows), pPixels, pixels * sizeof(Magick::PixelPacket));
+        if (header.colorMapSize)
+            std::memcpy(image.getIndexes(), pIndexes, pixels * sizeof(Magick::IndexPacket));
+        image.syncPixels();
+
+        resizedImage = ResizedImage { image, header.sourceColumns, header.sourceRows };
+
+        // the most recently used entries are the last to be evicted
+        std::error_code ec;
+        fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    }
+
+    munmap(pMapped, st.st_size);
+
+    return valid;
+}
+
+static void evict(const std::string& directory, uint64_t maxSize)
+{
+    struct Entry {
+        fs::path            path;
+        uint64_t            size;
+        fs::file_time_type  time;
+    };
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+
+    std::error_code ec;
+    for (const fs::directory_entry& dirEntry : fs::directory_iterator(directory, ec)) {
+        if (dirEntry.path().extension() != CacheExtension)
+            continue;
+
+        const uint64_t size = dirEntry.file_size(ec);
+        if (ec)
+            continue;
+        const fs::file_time_type time = dirEntry.last_write_time(ec);
+        if (ec)
+            continue;
+
+        entries.push_back({ dirEntry.path(), size, time });
+        totalSize += size;
+    }
+
+    if (totalSize <= maxSize)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+
+    for (const Entry& entry : entries) {
+        if (totalSize <= maxSize)
+            break;
+
+        // another process may have removed it already
+        fs::remove(entry.path, ec);
+        totalSize -= entry.size;
+    }
+}
+
+void store_cached_image(const std::string& directory, const std::string& key, const ResizedImage& resizedImage, uint64_t maxSize)
+{
+    const Magick::Image& image = resizedImage.image;
+
+    CacheHeader header = {};
+    std::memcpy(header.id, "UCCH", 4);
+    header.version = CacheVersion;
+    header.quantumDepth = QuantumDepth;
+    header.columns = image.columns();
+    header.rows = image.rows();
+    header.sourceColumns = resizedImage.sourceColumns;
+    header.sourceRows = resizedImage.sourceRows;
+    header.colorMapSize = image.classType() == Magick::PseudoClass ? image.colorMapSize() : 0;
+    header.matte = image.matte();
+
+    if (get_entry_size(header) > maxSize)
+        return;
+
+    const size_t pixels = size_t(header.columns) * header.rows;
+
+    std::vector<Magick::PixelPacket> colorMap(header.colorMapSize);
+    for (size_t i = 0; i < colorMap.size(); ++i) {
+        const Magick::Color color = image.colorMap(i);
+        colorMap[i].red = color.redQuantum();
+        colorMap[i].green = color.greenQuantum();
+        colorMap[i].blue = color.blueQuantum();
+        colorMap[i].opacity = color.alphaQuantum();
+    }
+
+    const Magick::PixelPacket* pPixels = image.getConstPixels(0, 0, header.columns, header.rows);
+    const Magick::IndexPacket* pIndexes = image.getConstIndexes();
+    if (!pPixels || (header.colorMapSize && !pIndexes))
+        return;
+
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+
+    // written under a unique name first so readers never see a partial entry
+    const fs::path path = get_entry_path(directory, key);
+    const fs::path tempPath = path.string() + "." + std::to_string(getpid())
+        + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+    {
+        std::ofstream ofs(tempPath, std::ofstream::binary);
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char*>(colorMap.data()), colorMap.size() * sizeof(Magick::PixelPacket));
+        ofs.write(reinterpret_cast<const char*>(pPixels), pixels * sizeof(Magick::PixelPacket));
+        if (header.colorMapSize)
+            ofs.write(reinterpret_cast<const char*>(pIndexes), pixels * sizeof(Magick::IndexPacket));
+
+        if (!ofs) {
+            ofs.close();
+            fs::remove(tempPath, ec);
+            return;
+        }
+    }
+
+    fs::rename(tempPath, path, ec);
+    if (ec) {
+        fs::remove(tempPath, ec);
+        return;
+    }
+
+    evict(directory, maxSize);
+}
+
+void clear_cache(const std::string& directory)
+{
+    std::error_code ec;
+    for (const fs::directory_entry& dirEntry : fs::directory_iterator(directory, ec)) {
+        const std::string name = dirEntry.path().filename().string();
+
+        if (dirEntry.path().extension() == CacheExtension || name.find(CacheExtension + std::string(".")) != std::string::npos)
+            fs::remove(dirEntry.path(), ec);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+#include "args.h"
+
+// decoded (and possibly resized) source bitmap
+struct ResizedImage {
+    Magick::Image   image;
+    unsigned int    sourceColumns;  // before resizing
+    unsigned int    sourceRows;
+};
+
+// identifies the source's content resized to width x height (-1 = original size) with or without filtering
+// and by the given resampler
+std::string get_cache_key(uint64_t sourceHash, int16_t width, int16_t height, bool filter, Resampler resampler);
+
+// returns false if 'key' is not in the cache (or its entry is unusable)
+bool load_cached_image(const std::string& directory, const std::string& key, ResizedImage& resizedImage);
+
+// never throws (the cache is just an optimisation); the least recently used entries are evicted
+// until the whole cache fits into 'maxSize' bytes
+void store_cached_image(const std::string& directory, const std::string& key, const ResizedImage& resizedImage, uint64_t maxSize);
+
+void clear_cache(const std::string& directory);
+
+#endif // CACHE_H
@@ -0,0 +1,871 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "convert.h"
+
+#include <GraphicsMagick/Magick++.h>
+using namespace Magick;
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "cache.h"
+#include "dither.h"
+#include "encode.h"
+#include "hash.h"
+#include "helpers.h"
+#include "manifest.h"
+#include "palette.h"
+#include "quantize.h"
+#include "resample.h"
+#include "stats.h"
+#include "transcode.h"
+#include "uimg.h"
+
+static void save_palette(std::ostream& os, const Image& image, const ConversionOptions& options)
+{
+    save_uimg_palette(os, options, get_palette(image), 1 << options.bitsPerPixel);
+}
+
+template<typename T>
+static void save_buffer(std::ostream& os, const std::vector<T>& buffer)
+{
+    os.write((char*)buffer.data(), sizeof_vector(buffer));
+}
+
+static void report_aspect_ratio(const ResizedImage& resizedImage, std::ostream& out)
+{
+    float old_ratio = (float)resizedImage.sourceColumns / (float)resizedImage.sourceRows;
+    float new_ratio = (float)resizedImage.image.columns() / (float)resizedImage.image.rows();
+
+    if (std::fabs(old_ratio - new_ratio) > 0.001)
+        out << "Aspect ratio changed; old: " << old_ratio << ", new: " << new_ratio << std::endl;
+}
+
+// the native quantizer's colour count, "at least" if big bitmaps were only sampled
+static std::string get_colour_count_text(const ColorHistogram& histogram)
+{
+    return (histogram.sampled() ? "at least " : "") + std::to_string(histogram.distinct_colors());
+}
+
+// the same for stats, 0 (unknown) if sampled
+static size_t get_colour_count(const ColorHistogram& histogram)
+{
+    return histogram.sampled() ? 0 : histogram.distinct_colors();
+}
+
+// only for 1 - 8 bpp; returns the number of colours before quantizing (0 if not counted)
+static size_t quantize_image(Image& image, const ConversionOptions& options, ThreadPool& threadPool, std::ostream& out, std::ostream& err)
+{
+    if (is_dithering_ordered(options))
+        dither_ordered(image, options, threadPool);
+
+    if (!options.fixedPaletteFilename.empty()) {
+        const std::shared_ptr<const InverseColormap> inverseColormap = load_inverse_colormap(options.fixedPaletteFilename, options, threadPool);
+        out << "Remapping to " << inverseColormap->palette().size() << " colours of " << options.fixedPaletteFilename << "." << std::endl;
+
+        // not needed for remapping so counted only if reported
+        const size_t sourceColors = options.stats != StatsFormat::None ? image.totalColors() : 0;
+        remap_image(image, *inverseColormap, options, threadPool);
+        return sourceColors;
+    }
+
+    if (options.quantizer == Quantizer::Native) {
+        const ColorHistogram histogram = quantize_native(image, options, threadPool);
+        if (histogram.distinct_colors() > (1u << options.bitsPerPixel))
+            out << "Converting from " << get_colour_count_text(histogram) << " to " << (1ul << options.bitsPerPixel) << " colours." << std::endl;
+        return get_colour_count(histogram);
+    }
+
+    // GraphicsMagick's palette, but the native error diffusion (a reference to the pixels makes
+    // quantize() clone them, so only if needed)
+    std::optional<Image> source;
+    if (is_diffusing_error(options))
+        source = image;
+
+    const size_t sourceColors = image.totalColors();
+    size_t totalColors = sourceColors;
+    if (totalColors > (1u << options.bitsPerPixel)) {
+        out << "Converting from " << totalColors << " to " << (1ul << options.bitsPerPixel) << " colours." << std::endl;
+
+        image.quantizeDither(options.dither);
+        image.quantizeColors(1u << options.bitsPerPixel);
+        image.quantize();
+
+        totalColors = image.totalColors();
+    }
+
+    if (image.classType() != PseudoClass)
+        throw std::runtime_error("Not a pseudo class.");
+
+    if (image.colorMapSize() > (1u << options.bitsPerPixel)) {
+    	err << "Warning, adjusting colorMapSize from " << image.colorMapSize()
+    		<< " to " <<  (1u << options.bitsPerPixel) 
+    		<< " (totalColors: " << totalColors << ")" 
+    		<< std::endl;
+    	image.colorMapSize(1u << options.bitsPerPixel);
+    }
+
+    if (is_diffusing_error(options)) {
+        const std::vector<PaletteColor> palette = get_palette(image);
+        image = *source;
+        remap_image(image, palette, options, threadPool);
+    }
+
+    //if (options.paletteBits && image.type() != PaletteType)
+    //    throw std::runtime_error("Not a palette type.");
+
+    //if (options.bitsPerPixel && image.colorMapSize() > (1u << options.bitsPerPixel)) {
+    //    throw_oss<std::runtime_error>(std::ostringstream()
+    //        << "Too few bpp for " << image.colorMapSize() << " colours."
+    //    );
+    //}
+
+    return sourceColors;
+}
+
+// throws if 'image' can't be saved as 'options'; nullptr if there's no bitmap to encode
+static EncodeFunc get_uimg_encoder(const ConversionOptions& options, const Image& image)
+{
+    if (options.bitsPerPixel && options.bitsPerPixel <= 8 && image.columns() % 16 != 0)
+        throw std::runtime_error("Width must be divisible by 16.");
+
+    return options.bitsPerPixel ? get_encoder(options.bitsPerPixel, options.bytesPerChunk) : nullptr;
+}
+
+// with 'pMapper', 'image' is the bitmap before remapping: every band is mapped to the mapper's
+// palette just before it's encoded (see is_streaming())
+static void save_uimg(std::ostream& os, const ConversionOptions& options, const Image& image, ThreadPool& threadPool,
+                      const PaletteMapper* pMapper = nullptr)
+{
+    // pick the encoder once
+    const EncodeFunc encode = get_uimg_encoder(options, image);
+
+    {
+        StageTimer timer(Stage::Write);
+
+        save_uimg_header(os, options, image.columns(), image.rows());
+        if (options.paletteBits && pMapper)
+            save_uimg_palette(os, options, pMapper->palette(), 1 << options.bitsPerPixel);
+        else if (options.paletteBits)
+            save_palette(os, image, options);
+    }
+
+    if (options.bitsPerPixel) {
+        // either the whole bitmap at once or in bands of rows, the output is the same
+        const size_t bandRows = options.bandHeight ? options.bandHeight : image.rows();
+
+        std::vector<uint8_t> atariImage;
+        std::vector<IndexPacket> bandIndexPackets;
+
+        for (size_t y = 0; y < image.rows(); y += bandRows) {
+            const size_t rows = std::min(bandRows, image.rows() - y);
+
+            const PixelPacket* pPixelPackets = image.getConstPixels(0, y, image.columns(), rows);
+            const IndexPacket* pIndexPackets = image.getConstIndexes();
+
+            if (pMapper) {
+                StageTimer timer(Stage::Quantize);
+
+                bandIndexPackets.resize(image.columns() * rows);
+                pMapper->map(pPixelPackets, bandIndexPackets.data(), bandIndexPackets.size(), threadPool);
+                pIndexPackets = bandIndexPackets.data();
+            }
+
+            {
+                StageTimer timer(Stage::Encode);
+
+                const size_t capacity = atariImage.capacity();
+                atariImage.resize(get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, image.columns(), rows));
+                if (atariImage.capacity() > capacity)
+                    add_encode_buffer_stats(atariImage.capacity());
+
+                // rows are independent and each range has its own place in the buffer
+                threadPool.parallel_for(rows, EncodeGrain, [&](size_t begin, size_t end) {
+                    const size_t offset = begin * image.columns();
+                    encode(pPixelPackets + offset, pIndexPackets ? pIndexPackets + offset : nullptr, image.columns(), end - begin,
+                           atariImage.data() + get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, image.columns(), begin));
+                });
+            }
+
+            StageTimer timer(Stage::Write);
+            save_buffer(os, atariImage);
+        }
+    }
+}
+
+// stdout is shared by all jobs so every output is written at once
+static void write_stdout(const void* pData, size_t size)
+{
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    StageTimer timer(Stage::Write);
+
+    std::cout.write((const char*)pData, size).flush();
+    if (!std::cout)
+        throw std::runtime_error("Writing to stdout failed.");
+}
+
+// 0 if it can't be determined
+static uint64_t get_file_size(const std::string& filename)
+{
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(filename, ec);
+
+    return ec ? 0 : size;
+}
+
+// returns the number of bytes written
+static uint64_t save_uimg(const Target& target, const Image& image, ThreadPool& threadPool, const PaletteMapper* pMapper = nullptr)
+{
+    if (is_stdio(target.outputFilename)) {
+        std::ostringstream oss;
+        save_uimg(oss, target.options, image, threadPool, pMapper);
+
+        const std::string uimg = oss.str();
+        write_stdout(uimg.data(), uimg.size());
+        return uimg.size();
+    }
+
+    // fail before touching the destination file
+    get_uimg_encoder(target.options, image);
+
+    // the destination may be the source itself, still mapped for the other targets
+    save_uimg_file(target.outputFilename, [&](std::ostream& os) {
+        save_uimg(os, target.options, image, threadPool, pMapper);
+    });
+
+    return get_file_size(target.outputFilename);
+}
+
+// any other format GraphicsMagick can write, returns the number of bytes written
+static uint64_t save_image(const Target& target, Image& image)
+{
+    if (is_stdio(target.outputFilename)) {
+        Blob blob;
+        {
+            StageTimer timer(Stage::Write);
+            image.write(&blob, target.outputFilename.substr(0, target.outputFilename.size() - 2));
+        }
+
+        write_stdout(blob.data(), blob.length());
+        return blob.length();
+    }
+
+    {
+        StageTimer timer(Stage::Write);
+        image.write(target.outputFilename);
+    }
+
+    return get_file_size(target.outputFilename);
+}
+
+// returns the number of bytes written
+static uint64_t transcode_uimg(const UimgView& view, const Target& target)
+{
+    if (is_stdio(target.outputFilename)) {
+        std::ostringstream oss;
+        {
+            StageTimer timer(Stage::Encode);
+            transcode(view, target.options, oss);
+        }
+
+        const std::string uimg = oss.str();
+        write_stdout(uimg.data(), uimg.size());
+        return uimg.size();
+    }
+
+    {
+        StageTimer timer(Stage::Encode);
+        transcode(view, target);
+    }
+
+    return get_file_size(target.outputFilename);
+}
+
+// all of stdin, read once no matter how many FILEs are '-'
+static ByteSpan read_stdin()
+{
+    static std::once_flag once;
+    static std::vector<uint8_t> data;
+
+    std::call_once(once, [] {
+        StageTimer timer(Stage::Read);
+
+        data.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    });
+
+    if (data.empty())
+        throw std::runtime_error("No data on stdin.");
+
+    return { data.data(), data.size() };
+}
+
+// in memory only if it comes from stdin (to be sniffed like any other bitmap in memory)
+static ByteSpan get_source_data(const std::string& filename)
+{
+    return filename == "-" ? read_stdin() : ByteSpan {};
+}
+
+// see set_magick_options()
+static const char* programPath;
+static int16_t magickThreadCount;
+
+void set_magick_options(const char* path, int16_t threadCount)
+{
+    programPath = path;
+    magickThreadCount = threadCount;
+}
+
+// GraphicsMagick is initialised only if some target really needs it (see transcode())
+void initialize_magick()
+{
+    static std::once_flag initialized;
+
+    std::call_once(initialized, [] {
+        StageTimer timer(Stage::Magick);
+
+        InitializeMagick(programPath);
+
+        if (magickThreadCount)
+            MagickLib::SetMagickResourceLimit(MagickLib::ThreadsResource, magickThreadCount);   // OpenMP threads
+    });
+}
+
+// one source bitmap, read only as much and as often as its targets need
+struct Source {
+    std::string                 filename;   // or just a name for the stats if 'data' is set
+    ByteSpan                    data;       // source in memory (not owned)
+    bool                        probed = false;
+    std::optional<UimgView>     view;       // if it is a UIMG file (mapped once, transcoded if possible)
+    std::optional<Image>        image;      // decoded only if some geometry is not cached
+    std::optional<uint64_t>     hash;
+    bool                        counted = false;    // in the input stats
+};
+
+static const UimgView* get_uimg_view(Source& source)
+{
+    if (!source.probed) {
+        if (source.data.data) {
+            if (UimgView::probe(source.data.data, source.data.size))
+                source.view.emplace(source.data.data, source.data.size);
+        } else if (is_uimg(source.filename)) {
+            source.view.emplace(source.filename);
+        }
+        source.probed = true;
+    }
+
+    return source.view ? &*source.view : nullptr;
+}
+
+static uint64_t get_hash(Source& source)
+{
+    if (!source.hash) {
+        if (source.data.data) {
+            Hasher hasher;
+            hasher.update(source.data.data, source.data.size);
+            source.hash = hasher.digest();
+        } else {
+            source.hash = hash_file(source.filename);
+        }
+    }
+
+    return *source.hash;
+}
+
+// once per source, no matter how many times or how it is read
+static void add_source_stats(Source& source, size_t pixels)
+{
+    if (!source.counted) {
+        const UimgView* pView = get_uimg_view(source);
+        add_input_stats(pixels, pView ? pView->data().size : source.data.data ? source.data.size : get_file_size(source.filename));
+        source.counted = true;
+    }
+}
+
+// from the cache or decoded (and stored in the cache, if enabled)
+static ResizedImage load_resized_image(Source& source, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    ResizedImage resizedImage;
+    std::string cacheKey;
+
+    if (!options.cacheDirectory.empty())
+        cacheKey = get_cache_key(get_hash(source), options.bitmapWidth, options.bitmapHeight, options.filter, options.resampler);
+
+    bool cached = false;
+    if (!cacheKey.empty()) {
+        StageTimer timer(Stage::Read);
+        cached = load_cached_image(options.cacheDirectory, cacheKey, resizedImage);
+    }
+
+    if (!cached) {
+        if (!source.image) {
+            StageTimer timer(Stage::Read);
+
+            source.image.emplace();
+            source.image->quiet(false);
+
+            if (const UimgView* pView = get_uimg_view(source)) {
+                *source.image = load_uimg(*pView);
+            } else if (source.data.data) {
+                source.image->read(Blob(source.data.data, source.data.size));
+            } else {
+                source.image->read(source.filename);
+            }
+
+            add_source_stats(source, size_t(source.image->columns()) * source.image->rows());
+        }
+
+        const int width = options.bitmapWidth == -1 ? source.image->columns() : options.bitmapWidth;
+        const int height = options.bitmapHeight == -1 ? source.image->rows() : options.bitmapHeight;
+
+        resizedImage = ResizedImage { *source.image, source.image->columns(), source.image->rows() };
+        {
+            StageTimer timer(Stage::Resize);
+            resize_image(resizedImage.image, width, height, options, threadPool);
+        }
+
+        if (!cacheKey.empty()) {
+            StageTimer timer(Stage::Write);
+            store_cached_image(options.cacheDirectory, cacheKey, resizedImage, uint64_t(options.cacheSize) << 20);
+        }
+    }
+
+    return resizedImage;
+}
+
+// the colours of a bitmap saved as UIMG: quantized for 1 - 8 bpp, dithered if asked for otherwise
+static void reduce_colours(Image& image, const std::string& inputFilename, const ConversionOptions& options,
+                           ThreadPool& threadPool, std::ostream& out, std::ostream& err)
+{
+    if (options.bitsPerPixel && options.bitsPerPixel <= 8) {
+        size_t sourceColors;
+        {
+            StageTimer timer(Stage::Quantize);
+            sourceColors = quantize_image(image, options, threadPool, out, err);
+        }
+        add_quantize_stats(inputFilename, options.bitsPerPixel, sourceColors, image.colorMapSize());
+    } else if (is_dithering_ordered(options)) {
+        StageTimer timer(Stage::Quantize);
+        dither_ordered(image, options, threadPool);
+    } else if (is_diffusing_error(options)) {
+        StageTimer timer(Stage::Quantize);
+        diffuse_error(image, options, threadPool);
+    }
+}
+
+// the colours of a 1 - 8 bpp bitmap can be reduced band by band while it's encoded (see '-band'):
+// the palette is built (or loaded) once, then every pixel is mapped on its own; not with error
+// diffusion or GraphicsMagick's quantizer, which need the whole bitmap
+static bool is_streaming(const ConversionOptions& options)
+{
+    return options.bandHeight && options.bitsPerPixel && options.bitsPerPixel <= 8 && !is_diffusing_error(options)
+        && (options.quantizer == Quantizer::Native || !options.fixedPaletteFilename.empty());
+}
+
+// reduce_colours() for is_streaming() up to remapping: 'image' is dithered if asked for and the
+// palette is built or loaded; save_uimg() maps the bitmap to it band by band
+static PaletteMapper get_palette_mapper(Image& image, const std::string& inputFilename, const ConversionOptions& options,
+                                        ThreadPool& threadPool, std::ostream& out)
+{
+    StageTimer timer(Stage::Quantize);
+
+    if (is_dithering_ordered(options))
+        dither_ordered(image, options, threadPool);
+
+    if (!options.fixedPaletteFilename.empty()) {
+        PaletteMapper mapper(load_inverse_colormap(options.fixedPaletteFilename, options, threadPool));
+        out << "Remapping to " << mapper.palette().size() << " colours of " << options.fixedPaletteFilename << "." << std::endl;
+
+        // not needed for remapping so counted only if reported
+        const size_t sourceColors = options.stats != StatsFormat::None ? image.totalColors() : 0;
+        add_quantize_stats(inputFilename, options.bitsPerPixel, sourceColors, mapper.palette().size());
+        return mapper;
+    }
+
+    ColorHistogram histogram(options);
+    histogram.add(image);
+
+    PaletteMapper mapper(histogram.build_palette(size_t(1) << options.bitsPerPixel, threadPool), options);
+    if (histogram.distinct_colors() > (1u << options.bitsPerPixel))
+        out << "Converting from " << get_colour_count_text(histogram) << " to " << (1ul << options.bitsPerPixel) << " colours." << std::endl;
+
+    add_quantize_stats(inputFilename, options.bitsPerPixel, get_colour_count(histogram), mapper.palette().size());
+    return mapper;
+}
+
+static void check_geometry(const ConversionOptions& options)
+{
+    if (options.bitmapWidth != -1 && options.bitmapWidth <= 0)
+        throw std::invalid_argument("Width must be a positive number.");
+
+    if (options.bitmapHeight != -1 && options.bitmapHeight <= 0)
+        throw std::invalid_argument("Height must be a positive number.");
+}
+
+static bool is_saving_uimg(const Target& target)
+{
+    // '<format>:-' never is
+    if (is_stdio(target.outputFilename))
+        return target.outputFilename == "-";
+
+    return target.outputFilename.substr(target.outputFilename.find_last_of('.')) == get_uimg_filename_ext(target.options);
+}
+
+static void report_saved(const Target& target, size_t columns, size_t rows, bool saving_uimg, std::ostream& out)
+{
+    out << "File " << target.outputFilename
+              << " (" << columns << "x" << rows;
+
+    if (saving_uimg)
+        out << "@" << target.options.bitsPerPixel;
+
+    out << ") has been saved." << std::endl;
+}
+
+void convert(const Job& job, ThreadPool& threadPool, std::ostream& out, std::ostream& err)
+{
+    Source source { job.inputFilename, get_source_data(job.inputFilename) };
+
+    // the source is decoded once, every distinct geometry resized once and every distinct
+    // colour depth quantized once; all targets are encoded from these
+    using GeometryKey = std::tuple<int16_t, int16_t, bool, Resampler>;
+    using ColoursKey = std::tuple<GeometryKey, int16_t, bool, OrderedDither, ErrorDiffusion, Quantizer, int16_t, int16_t, std::string>;
+    std::map<GeometryKey, ResizedImage> resizedImages;
+    std::map<ColoursKey, Image> quantizedImages;
+
+    for (const Target& target : job.targets) {
+        const ConversionOptions& options = target.options;
+
+        if (options.incremental && is_up_to_date(job.inputFilename, target, source.hash)) {
+            out << "File " << target.outputFilename << " is up to date." << std::endl;
+            continue;
+        }
+
+        const bool saving_uimg = is_saving_uimg(target);
+
+        check_geometry(options);
+
+        size_t columns;
+        size_t rows;
+        uint64_t size;
+
+        const UimgView* pView = get_uimg_view(source);
+        if (saving_uimg && pView && can_transcode(*pView, options)) {
+            size = transcode_uimg(*pView, target);
+
+            columns = pView->width();
+            rows = pView->height();
+
+            add_source_stats(source, columns * rows);
+        } else {
+            initialize_magick();
+
+            const GeometryKey geometryKey { options.bitmapWidth, options.bitmapHeight, options.filter, options.resampler };
+
+            auto resizedIt = resizedImages.find(geometryKey);
+            if (resizedIt == resizedImages.end()) {
+                const ResizedImage resizedImage = load_resized_image(source, options, threadPool);
+
+                report_aspect_ratio(resizedImage, out);
+                resizedIt = resizedImages.emplace(geometryKey, resizedImage).first;
+            }
+            Image image = resizedIt->second.image;
+
+            if (saving_uimg && is_streaming(options)) {
+                const PaletteMapper mapper = get_palette_mapper(image, job.inputFilename, options, threadPool, out);
+                size = save_uimg(target, image, threadPool, &mapper);
+            } else if (saving_uimg) {
+                if (options.bitsPerPixel && options.bitsPerPixel <= 8) {
+                    // only the native quantizer depends on the seed; the palette bits matter also
+                    // for the fixed palette and dithering
+                    const bool native = options.quantizer == Quantizer::Native;
+                    const bool usesPaletteBits = native || !options.fixedPaletteFilename.empty()
+                        || is_dithering_ordered(options) || is_diffusing_error(options);
+                    const ColoursKey coloursKey {
+                        geometryKey, options.bitsPerPixel, options.dither, options.orderedDither, options.errorDiffusion,
+                        options.quantizer, native ? options.seed : 0,
+                        usesPaletteBits ? options.paletteBits : 0, options.fixedPaletteFilename
+                    };
+
+                    auto quantizedIt = quantizedImages.find(coloursKey);
+                    if (quantizedIt == quantizedImages.end()) {
+                        quantizedIt = quantizedImages.emplace(coloursKey, image).first;
+                        reduce_colours(quantizedIt->second, job.inputFilename, options, threadPool, out, err);
+                    }
+                    image = quantizedIt->second;
+                } else {
+                    reduce_colours(image, job.inputFilename, options, threadPool, out, err);
+                }
+
+                size = save_uimg(target, image, threadPool);
+            } else {
+                size = save_image(target, image);
+            }
+
+            columns = image.columns();
+            rows = image.rows();
+        }
+
+        report_saved(target, columns, rows, saving_uimg, out);
+        add_output_stats(columns * rows, size);
+
+        if (options.incremental)
+            write_manifest(job.inputFilename, target, get_hash(source));
+    }
+}
+
+// what every frame's output depends on besides its own source: all the frames in order (a frame
+// added or removed changes the palette) and the palette file (see '-palout'), if any
+static std::string get_frame_set_digest(const std::vector<Job>& jobs, const std::vector<uint64_t>& sourceHashes, const std::string& paletteFilename)
+{
+    Hasher hasher;
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        hasher.update(jobs[i].inputFilename.c_str(), jobs[i].inputFilename.size() + 1);
+        hasher.update(&sourceHashes[i], sizeof(sourceHashes[i]));
+    }
+
+    if (!paletteFilename.empty()) {
+        const uint64_t paletteHash = hash_file(paletteFilename);
+        hasher.update(&paletteHash, sizeof(paletteHash));
+    }
+
+    return to_hex(hasher.digest());
+}
+
+// every source is decoded and resized, one palette is built from all of them and then every
+// one of them is remapped to it and saved
+void convert_frames(const std::vector<Job>& jobs, ThreadPool& threadPool, std::ostream& out)
+{
+    const ConversionOptions& options = jobs.front().targets.front().options;
+
+    struct Frame {
+        Source              source;
+        Image               image;
+        std::ostringstream  out;
+    };
+    std::vector<Frame> frames(jobs.size());
+
+    // the palette depends on all of them so all or nothing
+    if (options.incremental) {
+        bool upToDate = true;
+        std::vector<uint64_t> sourceHashes;
+        for (size_t i = 0; i < jobs.size() && upToDate; ++i) {
+            frames[i].source.filename = jobs[i].inputFilename;
+            upToDate = is_up_to_date(jobs[i].inputFilename, jobs[i].targets.front(), frames[i].source.hash);
+            if (upToDate)
+                sourceHashes.push_back(*frames[i].source.hash);
+        }
+
+        // every frame must have been made from the same set (and the palette file must be intact)
+        if (upToDate) {
+            std::string dependencies;
+            try {
+                dependencies = get_frame_set_digest(jobs, sourceHashes, options.paletteFilename);
+            }
+            catch (std::exception&) {
+                upToDate = false;
+            }
+
+            for (size_t i = 0; i < jobs.size() && upToDate; ++i)
+                upToDate = has_dependencies(jobs[i].targets.front(), dependencies);
+        }
+
+        if (upToDate) {
+            for (const Job& job : jobs)
+                out << "File " << job.targets.front().outputFilename << " is up to date." << std::endl;
+            return;
+        }
+    }
+
+    check_geometry(options);
+    initialize_magick();
+
+    std::vector<ColorHistogram> histograms(jobs.size(), ColorHistogram(options));
+
+    threadPool.parallel_for(jobs.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            Frame& frame = frames[i];
+            frame.source.filename = jobs[i].inputFilename;
+            frame.source.data = get_source_data(jobs[i].inputFilename);
+
+            const ResizedImage resizedImage = load_resized_image(frame.source, options, threadPool);
+            report_aspect_ratio(resizedImage, frame.out);
+
+            frame.image = resizedImage.image;
+
+            StageTimer timer(Stage::Quantize);
+            if (is_dithering_ordered(options))
+                dither_ordered(frame.image, options, threadPool);
+
+            histograms[i].add(frame.image);
+        }
+    });
+
+    const size_t paletteSize = size_t(1) << options.bitsPerPixel;
+
+    // always in the same order
+    ColorHistogram histogram(options);
+    std::vector<PaletteColor> palette;
+    {
+        StageTimer timer(Stage::Quantize);
+
+        for (const ColorHistogram& frameHistogram : histograms)
+            histogram.add(frameHistogram);
+
+        palette = histogram.build_palette(paletteSize, threadPool);
+    }
+
+    if (histogram.distinct_colors() > paletteSize) {
+        out << "Converting from " << get_colour_count_text(histogram) << " to " << paletteSize
+            << " colours shared by " << jobs.size() << " bitmap(s)." << std::endl;
+    }
+
+    if (!options.paletteFilename.empty()) {
+        {
+            StageTimer timer(Stage::Write);
+
+            std::ofstream ofs(options.paletteFilename, std::ofstream::binary);
+            if (!ofs)
+                throw std::runtime_error("Opening palette file failed.");
+
+            // a bitmap of 0x0 pixels, i.e. just the palette for the given bpp
+            save_uimg_header(ofs, options, 0, 0);
+            save_uimg_palette(ofs, options, palette, paletteSize);
+            ofs.close();
+        }
+        add_output_stats(0, get_file_size(options.paletteFilename));
+
+        out << "File " << options.paletteFilename << " (" << paletteSize << " colours) has been saved." << std::endl;
+    }
+
+    // every frame mapped to the palette band by band (see is_streaming(), the palette is built already)
+    std::optional<PaletteMapper> mapper;
+    if (options.bandHeight && !is_diffusing_error(options))
+        mapper.emplace(palette, options);
+
+    std::string dependencies;
+    if (options.incremental) {
+        std::vector<uint64_t> sourceHashes;
+        for (Frame& frame : frames)
+            sourceHashes.push_back(get_hash(frame.source));
+
+        dependencies = get_frame_set_digest(jobs, sourceHashes, options.paletteFilename);
+    }
+
+    threadPool.parallel_for(jobs.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            Frame& frame = frames[i];
+            const Target target { jobs[i].targets.front().outputFilename, get_bitmap_options(options) };
+            const bool saving_uimg = is_saving_uimg(target);
+
+            add_quantize_stats(jobs[i].inputFilename, options.bitsPerPixel, get_colour_count(histograms[i]), palette.size());
+
+            uint64_t size;
+            if (saving_uimg && mapper) {
+                size = save_uimg(target, frame.image, threadPool, &*mapper);
+            } else {
+                {
+                    StageTimer timer(Stage::Quantize);
+                    remap_image(frame.image, palette, options, threadPool);
+                }
+                size = saving_uimg ? save_uimg(target, frame.image, threadPool) : save_image(target, frame.image);
+            }
+
+            report_saved(target, frame.image.columns(), frame.image.rows(), saving_uimg, frame.out);
+            add_output_stats(size_t(frame.image.columns()) * frame.image.rows(), size);
+
+            if (options.incremental)
+                write_manifest(jobs[i].inputFilename, jobs[i].targets.front(), get_hash(frame.source), dependencies);
+
+            // not needed anymore
+            frame.image = Image();
+        }
+    });
+
+    for (const Frame& frame : frames)
+        out << frame.out.str();
+}
+
+std::vector<uint8_t> convert_memory(const uint8_t* pData, size_t size, const ConversionOptions& options,
+                                    ThreadPool& threadPool, std::ostream& out, std::ostream& err)
+{
+    if (options.sharedPalette || !options.paletteFilename.empty())
+        throw std::invalid_argument("-sharedpal and -palout can't be used for a bitmap in memory.");
+
+    check_geometry(options);
+
+    Source source { "<memory>", { pData, size } };
+    std::ostringstream oss;
+
+    size_t columns;
+    size_t rows;
+
+    const UimgView* pView = get_uimg_view(source);
+    if (pView && can_transcode(*pView, options)) {
+        {
+            StageTimer timer(Stage::Encode);
+            transcode(*pView, options, oss);
+        }
+
+        columns = pView->width();
+        rows = pView->height();
+
+        add_source_stats(source, columns * rows);
+    } else {
+        initialize_magick();
+
+        const ResizedImage resizedImage = load_resized_image(source, options, threadPool);
+        report_aspect_ratio(resizedImage, out);
+
+        Image image = resizedImage.image;
+        if (is_streaming(options)) {
+            const PaletteMapper mapper = get_palette_mapper(image, source.filename, options, threadPool, out);
+            save_uimg(oss, options, image, threadPool, &mapper);
+        } else {
+            reduce_colours(image, source.filename, options, threadPool, out, err);
+            save_uimg(oss, options, image, threadPool);
+        }
+
+        columns = image.columns();
+        rows = image.rows();
+    }
+
+    const std::string uimg = oss.str();
+    add_output_stats(columns * rows, uimg.size());
+
+    return std::vector<uint8_t>(uimg.begin(), uimg.end());
+}
@@ -0,0 +1,53 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "args.h"
+#include "threadpool.h"
+
+// The conversion core (libuconvert): everything a conversion needs comes in its arguments,
+// messages go to 'out' and 'err' and errors are thrown, so any number of conversions can run
+// concurrently in one process, sharing one ThreadPool or not. Process-wide are only
+// GraphicsMagick (initialised on first use) and the '-stats' counters.
+
+// InitializeMagick()'s path and the number of GraphicsMagick's OpenMP threads (0 if its default);
+// has an effect only if called before the first conversion which needs GraphicsMagick
+void set_magick_options(const char* programPath, int16_t threadCount);
+// GraphicsMagick right away instead of on first use (only once, no matter how many times called)
+void initialize_magick();
+
+// every target of 'job', from a file into files
+void convert(const Job& job, ThreadPool& threadPool, std::ostream& out, std::ostream& err);
+// all jobs come from one command line with '-sharedpal' (so they have one target each, with the
+// same options) and share one palette
+void convert_frames(const std::vector<Job>& jobs, ThreadPool& threadPool, std::ostream& out);
+// a source bitmap in memory (UIMG or anything GraphicsMagick reads) into a UIMG file in memory;
+// '-sharedpal' and '-palout' can't be used, '-incremental' is ignored
+std::vector<uint8_t> convert_memory(const uint8_t* pData, size_t size, const ConversionOptions& options,
+                                    ThreadPool& threadPool, std::ostream& out, std::ostream& err);
+
+#endif // CONVERT_H
@@ -0,0 +1,799 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <GraphicsMagick/Magick++.h>
+using namespace Magick;
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+#include "args.h"
+#include "c2p.h"
+#include "c2p_kernels.h"
+#include "encode.h"
+#include "helpers.h"
+#include "palette.h"
+#include "reference.h"
+#include "transcode.h"
+#include "uimg.h"
+
+namespace fs = std::filesystem;
+
+// Differential test of the optimized code paths (encoders, c2p/p2c, palette conversion, UIMG
+// decoding and transcoding) against the reference implementations in reference.cpp: random
+// bitmaps in every format args.cpp accepts, random widths divisible by 16 and the colour values
+// where rounding and shifting go wrong most easily. Every UIMG file in the DIRs is used as a
+// golden file: decoding and encoding it again (also by transcoding it into its own format)
+// must give the same bytes. Exits with EXIT_FAILURE if any check fails; '-seed' repeats a run.
+
+constexpr size_t DefaultIterations = 10;
+constexpr size_t MaxReportedFailures = 20;
+// bytes after every output buffer which must stay untouched
+constexpr size_t GuardSize = 64;
+constexpr uint8_t GuardByte = 0xa5;
+
+// 8-bit boundaries, the middle and the extremes of a quantum
+static const std::vector<Quantum> EdgeQuantums = {
+    0, 1,
+    MaxRGB >> 8, (MaxRGB >> 8) + 1,
+    MaxRGB / 2, MaxRGB / 2 + 1,
+    MaxRGB - (MaxRGB >> 8), MaxRGB - 1, MaxRGB
+};
+
+// one output format (as parsed by args.cpp)
+struct Format {
+    ConversionOptions   options;
+    int                 paletteType;
+    std::string         name;
+};
+
+static std::mt19937 rng;
+static size_t checks;
+static size_t failures;
+
+static size_t random_number(size_t min, size_t max)
+{
+    return std::uniform_int_distribution<size_t>(min, max)(rng);
+}
+
+static Quantum random_quantum()
+{
+    if (random_number(0, 1))
+        return EdgeQuantums[random_number(0, EdgeQuantums.size() - 1)];
+    else
+        return random_number(0, MaxRGB);
+}
+
+static PixelPacket random_pixel_packet()
+{
+    PixelPacket pixelPacket;
+    pixelPacket.red     = random_quantum();
+    pixelPacket.green   = random_quantum();
+    pixelPacket.blue    = random_quantum();
+    pixelPacket.opacity = random_quantum();
+    return pixelPacket;
+}
+
+// the lowest and the highest index are more likely
+static uint8_t random_index(int bitsPerPixel)
+{
+    const size_t maxIndex = (1 << bitsPerPixel) - 1;
+
+    switch (random_number(0, 3)) {
+    case 0:
+        return 0;
+    case 1:
+        return maxIndex;
+    default:
+        return random_number(0, maxIndex);
+    }
+}
+
+static PaletteColor random_palette_color()
+{
+    return { uint8_t(random_quantum() >> (QuantumDepth - 8)), uint8_t(random_quantum() >> (QuantumDepth - 8)), uint8_t(random_quantum() >> (QuantumDepth - 8)) };
+}
+
+// 16 - 384 pixels wide, mostly a few rows but sometimes more than one encoding grain
+static std::pair<size_t, size_t> random_size()
+{
+    const size_t width = 16 * random_number(1, 24);
+    const size_t height = random_number(0, 3) ? random_number(1, 8) : random_number(EncodeGrain - 1, 3 * EncodeGrain + 1);
+
+    return { width, height };
+}
+
+static bool expect(bool ok, const std::string& what)
+{
+    ++checks;
+
+    if (!ok) {
+        if (failures++ < MaxReportedFailures)
+            std::cout << "FAIL: " << what << std::endl;
+        else if (failures == MaxReportedFailures + 1)
+            std::cout << "(more failures not reported)" << std::endl;
+    }
+
+    return ok;
+}
+
+// compares 'actual' with 'expected' and reports the first difference
+static bool expect_bytes(const uint8_t* pActual, const std::vector<uint8_t>& expected, const std::string& what)
+{
+    const auto mismatch = std::mismatch(expected.begin(), expected.end(), pActual);
+    if (mismatch.first == expected.end())
+        return expect(true, what);
+
+    const size_t offset = mismatch.first - expected.begin();
+    std::ostringstream oss;
+    oss << what << ": byte " << offset << " of " << expected.size()
+        << " is 0x" << std::hex << int(*mismatch.second) << " instead of 0x" << int(*mismatch.first);
+
+    return expect(false, oss.str());
+}
+
+static bool expect_guard(const std::vector<uint8_t>& buffer, size_t size, const std::string& what)
+{
+    return expect(std::all_of(buffer.begin() + size, buffer.end(), [](uint8_t byte) { return byte == GuardByte; }),
+                  what + ": written past the end");
+}
+
+static std::vector<uint8_t> read_file(const std::string& filePath)
+{
+    std::ifstream ifs(filePath, std::ifstream::binary);
+    if (!ifs)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Opening " << filePath << " failed.");
+
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+}
+
+static std::vector<uint8_t> to_bytes(const std::ostringstream& oss)
+{
+    const std::string str = oss.str();
+    return std::vector<uint8_t>(str.begin(), str.end());
+}
+
+// throws std::invalid_argument if args.cpp doesn't accept the combination
+static ConversionOptions get_options(int16_t bitsPerPixel, int16_t bytesPerChunk, int paletteType, int16_t paletteBits)
+{
+    std::vector<std::string> args = { "-bpp", std::to_string(bitsPerPixel), "-bpc", std::to_string(bytesPerChunk) };
+
+    if (bitsPerPixel <= 8) {
+        args.insert(args.end(), { "-pal", std::to_string(paletteBits) });
+        if (paletteType == StePalette)
+            args.push_back("-st");
+        else if (paletteType == TtPalette)
+            args.push_back("-tt");
+    }
+
+    args.push_back("difftest.png");
+
+    return parse_arguments(args).front().targets.front().options;
+}
+
+static std::string get_format_name(const ConversionOptions& options)
+{
+    static const char* paletteNames[] = { "", "st", "tt", "falcon" };
+
+    std::ostringstream oss;
+    oss << "bpp " << options.bitsPerPixel << " bpc " << options.bytesPerChunk;
+    if (options.paletteBits)
+        oss << " " << paletteNames[get_palette_type(options)] << "." << options.paletteBits;
+
+    return oss.str();
+}
+
+// every combination of bits per pixel, bytes per chunk, palette type and palette bits args.cpp accepts
+// (and there is an encoder for)
+static std::vector<Format> get_formats()
+{
+    std::vector<Format> formats;
+    std::set<std::tuple<int16_t, int16_t, int, int16_t>> seen;
+
+    for (int16_t bitsPerPixel : { 1, 2, 4, 6, 8, 16, 24, 32 }) {
+        for (int16_t bytesPerChunk : { 0, -1, 1, 2, 3, 4 }) {
+            for (int paletteType : { StePalette, TtPalette, FalconPalette }) {
+                for (int16_t paletteBits : { 9, 12, 18, 24 }) {
+                    ConversionOptions options;
+                    try {
+                        options = get_options(bitsPerPixel, bytesPerChunk, paletteType, paletteBits);
+                        get_encoder(options.bitsPerPixel, options.bytesPerChunk);
+                    }
+                    catch (std::invalid_argument&) {
+                        continue;
+                    }
+
+                    const int type = get_palette_type(options);
+                    if (seen.insert({ options.bitsPerPixel, options.bytesPerChunk, type, options.paletteBits }).second)
+                        formats.push_back({ options, type, get_format_name(options) });
+                }
+            }
+        }
+    }
+
+    return formats;
+}
+
+// random bitmap in 'format'
+struct Bitmap {
+    size_t                      width;
+    size_t                      height;
+    std::vector<PixelPacket>    pixelPackets;
+    std::vector<IndexPacket>    indexPackets;
+    std::vector<PaletteColor>   colors;     // fewer than 1 << bitsPerPixel sometimes
+};
+
+static Bitmap make_bitmap(const ConversionOptions& options)
+{
+    Bitmap bitmap;
+    std::tie(bitmap.width, bitmap.height) = random_size();
+
+    const size_t pixels = bitmap.width * bitmap.height;
+
+    if (options.bitsPerPixel <= 8) {
+        for (size_t i = 0; i < pixels; ++i)
+            bitmap.indexPackets.push_back(random_index(options.bitsPerPixel));
+
+        const size_t paletteSize = size_t(1) << options.bitsPerPixel;
+        bitmap.colors.resize(random_number(0, 3) ? paletteSize : random_number(1, paletteSize));
+        for (PaletteColor& color : bitmap.colors)
+            color = random_palette_color();
+    }
+
+    // the encoders get both (like from GraphicsMagick)
+    for (size_t i = 0; i < pixels; ++i)
+        bitmap.pixelPackets.push_back(random_pixel_packet());
+    bitmap.indexPackets.resize(pixels);
+
+    return bitmap;
+}
+
+// the whole UIMG file, the bitmap encoded by the reference
+static std::vector<uint8_t> make_uimg(const Format& format, const Bitmap& bitmap)
+{
+    const ConversionOptions& options = format.options;
+
+    std::vector<uint8_t> data;
+    {
+        std::ostringstream oss;
+        save_uimg_header(oss, options, bitmap.width, bitmap.height);
+        data = to_bytes(oss);
+    }
+
+    if (options.paletteBits)
+        reference_save_palette(format.paletteType, options.paletteBits, bitmap.colors, 1 << options.bitsPerPixel, data);
+
+    reference_encode(bitmap.pixelPackets.data(), bitmap.indexPackets.data(), bitmap.width * bitmap.height,
+                     options.bitsPerPixel, options.bytesPerChunk, data);
+
+    return data;
+}
+
+static std::string describe(const std::string& what, const Format& format, size_t width, size_t height)
+{
+    std::ostringstream oss;
+    oss << what << " (" << format.name << ", " << width << "x" << height << ")";
+    return oss.str();
+}
+
+// every encoder, whole bitmaps and in bands of rows as the thread pool splits them
+static void test_encoders(const std::vector<Format>& formats, size_t iterations)
+{
+    std::set<std::pair<int16_t, int16_t>> tested;
+
+    for (const Format& format : formats) {
+        const ConversionOptions& options = format.options;
+        if (!tested.insert({ options.bitsPerPixel, options.bytesPerChunk }).second)
+            continue;
+
+        const EncodeFunc encode = get_encoder(options.bitsPerPixel, options.bytesPerChunk);
+
+        for (size_t iteration = 0; iteration < iterations; ++iteration) {
+            const Bitmap bitmap = make_bitmap(options);
+            const size_t width = bitmap.width;
+            const size_t height = bitmap.height;
+
+            std::vector<uint8_t> expected;
+            reference_encode(bitmap.pixelPackets.data(), bitmap.indexPackets.data(), width * height,
+                             options.bitsPerPixel, options.bytesPerChunk, expected);
+
+            const size_t size = get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, width, height);
+            expect(size == expected.size(), describe("encoded size", format, width, height));
+
+            std::vector<uint8_t> buffer(size + GuardSize, GuardByte);
+            encode(bitmap.pixelPackets.data(), bitmap.indexPackets.data(), width, height, buffer.data());
+            expect_bytes(buffer.data(), expected, describe("encode", format, width, height));
+            expect_guard(buffer, size, describe("encode", format, width, height));
+
+            // any number of rows at any row
+            std::fill(buffer.begin(), buffer.end(), GuardByte);
+            const size_t bandHeight = random_number(0, 1) ? EncodeGrain : random_number(1, height);
+            for (size_t y = 0; y < height; y += bandHeight) {
+                const size_t rows = std::min(bandHeight, height - y);
+                encode(bitmap.pixelPackets.data() + y * width, bitmap.indexPackets.data() + y * width, width, rows,
+                       buffer.data() + get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, width, y));
+            }
+            expect_bytes(buffer.data(), expected, describe("encode in bands of " + std::to_string(bandHeight) + " rows", format, width, height));
+            expect_guard(buffer, size, describe("encode in bands", format, width, height));
+        }
+    }
+}
+
+// both directions from and into unaligned buffers, through the dispatcher and every kernel
+// this CPU supports
+static void test_c2p(size_t iterations)
+{
+    std::vector<C2pKernel> c2pKernels = get_c2p_kernels();
+    std::vector<C2pKernel> p2cKernels = get_p2c_kernels();
+    c2pKernels.insert(c2pKernels.begin(), { "dispatch", chunky_to_planar });
+    p2cKernels.insert(p2cKernels.begin(), { "dispatch", planar_to_chunky });
+
+    for (int planes = 1; planes <= 8; ++planes) {
+        for (size_t iteration = 0; iteration < iterations; ++iteration) {
+            const size_t pixels = 16 * random_number(1, 200);
+            const size_t planarSize = pixels / 8 * planes;
+            const size_t sourceOffset = random_number(0, 15);
+            const size_t destinationOffset = random_number(0, 15);
+
+            std::ostringstream what;
+            what << planes << " planes, " << pixels << " pixels, offsets " << sourceOffset << "/" << destinationOffset;
+
+            if (planes != 3 && planes != 5 && planes != 7) {
+                std::vector<uint8_t> chunky(sourceOffset + pixels);
+                for (size_t i = 0; i < pixels; ++i)
+                    chunky[sourceOffset + i] = random_index(planes);
+
+                std::vector<uint8_t> expected;
+                reference_c2p(chunky.data() + sourceOffset, pixels, planes, expected);
+
+                for (const C2pKernel& kernel : c2pKernels) {
+                    std::vector<uint8_t> planar(destinationOffset + planarSize + GuardSize, GuardByte);
+                    kernel.func(chunky.data() + sourceOffset, pixels, planes, planar.data() + destinationOffset);
+                    expect_bytes(planar.data() + destinationOffset, expected, std::string("c2p ") + kernel.name + ", " + what.str());
+                    expect_guard(planar, destinationOffset + planarSize, std::string("c2p ") + kernel.name + ", " + what.str());
+                }
+            }
+
+            std::vector<uint8_t> planar(sourceOffset + planarSize);
+            for (uint8_t& byte : planar)
+                byte = random_number(0, 255);
+
+            std::vector<uint8_t> expected;
+            reference_p2c(planar.data() + sourceOffset, pixels, planes, expected);
+
+            for (const C2pKernel& kernel : p2cKernels) {
+                std::vector<uint8_t> chunky(destinationOffset + pixels + GuardSize, GuardByte);
+                kernel.func(planar.data() + sourceOffset, pixels, planes, chunky.data() + destinationOffset);
+                expect_bytes(chunky.data() + destinationOffset, expected, std::string("p2c ") + kernel.name + ", " + what.str());
+                expect_guard(chunky, destinationOffset + pixels, std::string("p2c ") + kernel.name + ", " + what.str());
+            }
+        }
+    }
+}
+
+// every register value and every channel value of every palette type and size
+static void test_palettes(const std::vector<Format>& formats, size_t iterations)
+{
+    for (int paletteType : { StePalette, TtPalette, FalconPalette }) {
+        // meaningful bits only, the Falcon's unused byte is random
+        const uint32_t values = paletteType == FalconPalette ? (1u << 24) : (1u << 16);
+        size_t mismatches = 0;
+
+        for (uint32_t i = 0; i < values; ++i) {
+            const uint32_t value = paletteType == FalconPalette
+                ? ((i & 0xffff00) << 8) | (random_number(0, 255) << 8) | (i & 0xff)
+                : i;
+
+            const PaletteColor expected = reference_palette_color(paletteType, value);
+            const PaletteColor actual = decode_palette_entry(paletteType, value);
+
+            if (expected.r != actual.r || expected.g != actual.g || expected.b != actual.b) {
+                if (mismatches++ == 0) {
+                    std::ostringstream oss;
+                    oss << "decode palette type " << paletteType << " entry 0x" << std::hex << value;
+                    expect(false, oss.str());
+                }
+            }
+        }
+        expect(mismatches == 0, "decode palette type " + std::to_string(paletteType) + ": " + std::to_string(mismatches) + " mismatches");
+    }
+
+    std::set<std::pair<int, int16_t>> tested;
+
+    for (const Format& format : formats) {
+        const ConversionOptions& options = format.options;
+        if (!options.paletteBits || !tested.insert({ format.paletteType, options.paletteBits }).second)
+            continue;
+
+        for (size_t channel = 0; channel < 3; ++channel) {
+            for (int value = 0; value < 256; ++value) {
+                PaletteColor color = random_palette_color();
+                (channel == 0 ? color.r : channel == 1 ? color.g : color.b) = value;
+
+                std::ostringstream what;
+                what << "encode palette entry (" << format.name << ", " << int(color.r) << "/" << int(color.g) << "/" << int(color.b) << ")";
+                expect(encode_palette_entry(format.paletteType, options.paletteBits, color) == reference_palette_entry(format.paletteType, options.paletteBits, color),
+                       what.str());
+            }
+        }
+
+        for (size_t iteration = 0; iteration < iterations; ++iteration) {
+            const size_t paletteSize = size_t(1) << random_number(1, 8);
+            std::vector<PaletteColor> colors(random_number(0, paletteSize));
+            for (PaletteColor& color : colors)
+                color = random_palette_color();
+
+            std::vector<uint8_t> expected;
+            reference_save_palette(format.paletteType, options.paletteBits, colors, paletteSize, expected);
+
+            std::ostringstream oss;
+            save_uimg_palette(oss, options, colors, paletteSize);
+            const std::vector<uint8_t> actual = to_bytes(oss);
+
+            const std::string what = "save palette (" + format.name + ", " + std::to_string(colors.size()) + "/" + std::to_string(paletteSize) + " colours)";
+            if (expect(actual.size() == expected.size(), what + ": size"))
+                expect_bytes(actual.data(), expected, what);
+        }
+    }
+}
+
+// UimgView, decode_indexes() and load_uimg() against reference_load_uimg()
+static void test_decoding(const std::vector<uint8_t>& data, const std::string& what)
+{
+    ReferenceImage expected;
+    try {
+        expected = reference_load_uimg(data);
+    }
+    catch (std::exception& ex) {
+        expect(false, what + ": " + ex.what());
+        return;
+    }
+
+    const UimgView view(data.data(), data.size());
+    const size_t width = expected.width;
+    const size_t height = expected.height;
+    const size_t pixels = width * height;
+
+    if (!expect(view.width() == width && view.height() == height && view.bitsPerPixel() == expected.bitsPerPixel
+                    && view.bytesPerChunk() == expected.bytesPerChunk && view.paletteType() == expected.paletteType,
+                what + ": header"))
+        return;
+
+    for (size_t i = 0; i < expected.palette.size(); ++i) {
+        const PaletteColor color = view.paletteColor(i);
+        if (!expect(color.r == expected.palette[i].r && color.g == expected.palette[i].g && color.b == expected.palette[i].b,
+                    what + ": palette colour " + std::to_string(i)))
+            break;
+    }
+
+    Image image = load_uimg(view);
+    const PixelPacket* pPixelPackets = image.getConstPixels(0, 0, width, height);
+    const IndexPacket* pIndexPackets = image.getConstIndexes();
+
+    if (expected.bitsPerPixel <= 8) {
+        std::vector<uint8_t> indexes(pixels + GuardSize, GuardByte);
+        decode_indexes(view, indexes.data());
+        expect_bytes(indexes.data(), expected.indexes, what + ": decode_indexes");
+        expect_guard(indexes, pixels, what + ": decode_indexes");
+
+        for (size_t i = 0; i < 16; ++i) {
+            const size_t x = random_number(0, width - 1);
+            const size_t y = random_number(0, height - 1);
+            if (!expect(view.pixel(x, y) == expected.indexes[y * width + x], what + ": pixel(" + std::to_string(x) + ", " + std::to_string(y) + ")"))
+                break;
+        }
+
+        for (size_t i = 0; i < expected.palette.size(); ++i) {
+            const Color color = image.colorMap(i);
+            constexpr size_t shift = QuantumDepth - 8;
+
+            if (!expect(color.redQuantum() == Quantum(expected.palette[i].r << shift)
+                            && color.greenQuantum() == Quantum(expected.palette[i].g << shift)
+                            && color.blueQuantum() == Quantum(expected.palette[i].b << shift),
+                        what + ": load_uimg colour map entry " + std::to_string(i)))
+                break;
+        }
+
+        expect(std::equal(expected.indexes.begin(), expected.indexes.end(), pIndexPackets), what + ": load_uimg indexes");
+    } else {
+        for (size_t i = 0; i < 16; ++i) {
+            const size_t x = random_number(0, width - 1);
+            const size_t y = random_number(0, height - 1);
+            const PixelPacket& pixelPacket = expected.pixels[y * width + x];
+
+            // the chunk value again
+            uint32_t chunk;
+            if (expected.bitsPerPixel == 16)
+                chunk = ((pixelPacket.red >> (QuantumDepth - 5)) << 11) | ((pixelPacket.green >> (QuantumDepth - 6)) << 5) | (pixelPacket.blue >> (QuantumDepth - 5));
+            else
+                chunk = (uint32_t(pixelPacket.opacity) << 24) | ((pixelPacket.red >> (QuantumDepth - 8)) << 16) | ((pixelPacket.green >> (QuantumDepth - 8)) << 8) | (pixelPacket.blue >> (QuantumDepth - 8));
+
+            if (!expect(view.pixel(x, y) == chunk, what + ": pixel(" + std::to_string(x) + ", " + std::to_string(y) + ")"))
+                break;
+        }
+
+        for (size_t i = 0; i < pixels; ++i) {
+            const PixelPacket& a = pPixelPackets[i];
+            const PixelPacket& b = expected.pixels[i];
+
+            if (a.red != b.red || a.green != b.green || a.blue != b.blue || a.opacity != b.opacity) {
+                expect(false, what + ": load_uimg pixel " + std::to_string(i));
+                return;
+            }
+        }
+        expect(true, what + ": load_uimg pixels");
+    }
+}
+
+// what transcoding 'expected' into 'options' must give
+static std::vector<uint8_t> reference_transcode(const ReferenceImage& expected, const Format& format)
+{
+    const ConversionOptions& options = format.options;
+    const size_t pixels = size_t(expected.width) * expected.height;
+
+    std::vector<uint8_t> data;
+    {
+        std::ostringstream oss;
+        save_uimg_header(oss, options, expected.width, expected.height);
+        data = to_bytes(oss);
+    }
+
+    if (options.paletteBits)
+        reference_save_palette(format.paletteType, options.paletteBits, expected.palette, 1 << options.bitsPerPixel, data);
+
+    std::vector<IndexPacket> indexPackets(expected.indexes.begin(), expected.indexes.end());
+    std::vector<PixelPacket> pixelPackets = expected.pixels;
+
+    if (expected.bitsPerPixel <= 8 && options.bitsPerPixel > 8) {
+        pixelPackets.resize(pixels);
+        for (size_t i = 0; i < pixels; ++i) {
+            const PaletteColor& color = expected.palette[expected.indexes[i]];
+            pixelPackets[i].red = color.r << (QuantumDepth - 8);
+            pixelPackets[i].green = color.g << (QuantumDepth - 8);
+            pixelPackets[i].blue = color.b << (QuantumDepth - 8);
+            pixelPackets[i].opacity = 0;
+        }
+    }
+
+    reference_encode(pixelPackets.data(), indexPackets.data(), pixels, options.bitsPerPixel, options.bytesPerChunk, data);
+
+    return data;
+}
+
+static void test_transcoding(const std::vector<uint8_t>& data, const Format& target, const fs::path& outputPath, const std::string& what)
+{
+    const UimgView view(data.data(), data.size());
+    if (!can_transcode(view, target.options))
+        return;
+
+    transcode(view, { outputPath, target.options });
+
+    const std::vector<uint8_t> expected = reference_transcode(reference_load_uimg(data), target);
+    const std::vector<uint8_t> actual = read_file(outputPath);
+
+    const std::string description = what + " => " + target.name;
+    if (expect(actual.size() == expected.size(), description + ": size"))
+        expect_bytes(actual.data(), expected, description);
+}
+
+// random UIMG files in every format decoded and transcoded into a few others
+static void test_uimg(const std::vector<Format>& formats, size_t iterations, const fs::path& outputPath)
+{
+    for (const Format& format : formats) {
+        for (size_t iteration = 0; iteration < iterations; ++iteration) {
+            const Bitmap bitmap = make_bitmap(format.options);
+            const std::vector<uint8_t> data = make_uimg(format, bitmap);
+            const std::string what = describe("UIMG", format, bitmap.width, bitmap.height);
+
+            test_decoding(data, what);
+
+            // the reference itself: the indexes must survive the round trip
+            if (format.options.bitsPerPixel <= 8) {
+                const ReferenceImage image = reference_load_uimg(data);
+                expect(std::equal(image.indexes.begin(), image.indexes.end(), bitmap.indexPackets.begin()), what + ": reference round trip");
+            }
+
+            test_transcoding(data, format, outputPath, what);
+            for (size_t i = 0; i < 3; ++i)
+                test_transcoding(data, formats[random_number(0, formats.size() - 1)], outputPath, what);
+        }
+    }
+}
+
+// every UIMG file: decoding, encoding it again and transcoding it into its own format must give its bitmap and palette
+static void test_golden_files(const std::vector<std::string>& directories, const fs::path& outputPath)
+{
+    std::vector<fs::path> filePaths;
+    for (const std::string& directory : directories) {
+        for (const fs::directory_entry& entry : fs::recursive_directory_iterator(directory)) {
+            if (entry.is_regular_file() && is_uimg(entry.path()))
+                filePaths.push_back(entry.path());
+        }
+    }
+    std::sort(filePaths.begin(), filePaths.end());
+
+    for (const fs::path& filePath : filePaths) {
+        const std::vector<uint8_t> data = read_file(filePath);
+        const std::string what = filePath.string();
+
+        test_decoding(data, what);
+
+        const UimgView view(data.data(), data.size());
+        const int16_t bitsPerPixel = view.bitsPerPixel();
+        const int16_t bytesPerChunk = view.bytesPerChunk();
+        const size_t pixels = size_t(view.width()) * view.height();
+
+        // as many palette bits as the register has, the missing ones are zero
+        const int16_t paletteBits = view.paletteType() == FalconPalette ? 24 : view.paletteType() ? 12 : 0;
+
+        if (paletteBits) {
+            for (size_t i = 0; i < view.paletteSize(); ++i) {
+                if (!expect(encode_palette_entry(view.paletteType(), paletteBits, view.paletteColor(i)) == view.paletteEntry(i),
+                            what + ": palette entry " + std::to_string(i)))
+                    break;
+            }
+        }
+
+        Image image = load_uimg(view);
+        const PixelPacket* pPixelPackets = image.getConstPixels(0, 0, view.width(), view.height());
+        const IndexPacket* pIndexPackets = image.getConstIndexes();
+
+        const std::vector<uint8_t> bitmap(view.bitmap().begin(), view.bitmap().end());
+        std::vector<uint8_t> buffer(get_encoded_size(bitsPerPixel, bytesPerChunk, view.width(), view.height()) + GuardSize, GuardByte);
+
+        get_encoder(bitsPerPixel, bytesPerChunk)(pPixelPackets, pIndexPackets, view.width(), view.height(), buffer.data());
+        expect_bytes(buffer.data(), bitmap, what + ": encode");
+
+        std::vector<uint8_t> expected;
+        reference_encode(pPixelPackets, pIndexPackets, pixels, bitsPerPixel, bytesPerChunk, expected);
+        expect_bytes(expected.data(), bitmap, what + ": reference encode");
+
+        ConversionOptions options;
+        try {
+            options = get_options(bitsPerPixel, bytesPerChunk, view.paletteType(), paletteBits);
+        }
+        catch (std::invalid_argument& ex) {
+            expect(false, what + ": " + ex.what());
+            continue;
+        }
+
+        if (expect(can_transcode(view, options), what + ": can_transcode")) {
+            transcode(view, { outputPath, options });
+
+            // the same file except for the version
+            const std::vector<uint8_t> transcoded = read_file(outputPath);
+            std::vector<uint8_t> actual = transcoded;
+            if (expect(actual.size() == data.size(), what + ": transcode size")) {
+                std::copy(data.begin() + 4, data.begin() + 6, actual.begin() + 4);
+                expect_bytes(actual.data(), data, what + ": transcode");
+            }
+
+            // in place, i.e. into the mapped source file itself (like 'uconvert x.bp8')
+            {
+                const UimgView self(outputPath.string());
+                transcode(self, { outputPath, options });
+            }
+            expect(read_file(outputPath) == transcoded, what + ": transcode in place");
+        }
+    }
+
+    std::cout << "golden files: " << filePaths.size() << std::endl;
+}
+
+static size_t parse_number(const std::string& arg, const std::string& value)
+{
+    size_t pos = 0;
+    long number = -1;
+
+    try {
+        number = std::stol(value, &pos);
+    }
+    catch (std::exception&) {
+    }
+
+    if (pos != value.size() || number < 0)
+        throw_oss<std::invalid_argument>(std::ostringstream() << "Invalid value for " << arg << ": '" << value << "'.");
+
+    return number;
+}
+
+static void print_usage(const char* argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [-seed <n>] [-iterations <n>] [DIR...]" << std::endl
+              << std::endl
+              << "Compares the encoders, c2p, palette conversion, UIMG decoding and transcoding with their" << std::endl
+              << "reference implementations on random bitmaps in all formats and on the UIMG files in DIRs." << std::endl;
+
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    const std::vector<std::string> args(argv + 1, argv + argc);
+
+    size_t seed = std::random_device()();
+    size_t iterations = DefaultIterations;
+    std::vector<std::string> directories;
+
+    try {
+        for (size_t i = 0; i < args.size(); ++i) {
+            const std::string& arg = args[i];
+
+            // first non-option => it's a directory and so is everything after it
+            if (arg.empty() || arg[0] != '-') {
+                directories.assign(args.begin() + i, args.end());
+                break;
+            }
+
+            if (i + 1 == args.size())
+                print_usage(argv[0]);
+
+            const std::string& value = args[++i];
+
+            if (arg == "-seed")
+                seed = parse_number(arg, value);
+            else if (arg == "-iterations")
+                iterations = parse_number(arg, value);
+            else
+                print_usage(argv[0]);
+        }
+
+        InitializeMagick(argv[0]);
+
+        std::cout << "seed: " << seed << std::endl;
+        rng.seed(seed);
+
+        const std::vector<Format> formats = get_formats();
+        const fs::path outputPath = fs::temp_directory_path() / ("uconvert-difftest-" + std::to_string(getpid()) + ".uimg");
+
+        test_encoders(formats, iterations);
+        test_c2p(iterations);
+        test_palettes(formats, iterations);
+        test_uimg(formats, iterations, outputPath);
+        test_golden_files(directories, outputPath);
+
+        std::error_code ec;
+        fs::remove(outputPath, ec);
+
+        std::cout << "formats: " << formats.size() << ", checks: " << checks << ", failures: " << failures << std::endl;
+    }
+    catch(std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,490 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "dither.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define DITHER_X86
+#include <emmintrin.h>
+#endif
+
+// GraphicsMagick's Q16 PixelPacket on a little endian machine: blue, green, red, opacity
+constexpr bool fastPixelPackets =
+    QuantumDepth == 16 && sizeof(Magick::PixelPacket) == 8
+    && offsetof(Magick::PixelPacket, blue) == 0 && offsetof(Magick::PixelPacket, green) == 2
+    && offsetof(Magick::PixelPacket, red) == 4 && offsetof(Magick::PixelPacket, opacity) == 6;
+
+constexpr int MatrixBits = 6;
+constexpr size_t MatrixSize = size_t(1) << MatrixBits;     // in both directions
+constexpr size_t MatrixArea = MatrixSize * MatrixSize;
+// number of rows processed by one thread at once
+constexpr size_t DitherGrain = 16;
+// rows of diffused errors kept at once (i.e. at most this many rows are diffused in parallel)
+constexpr size_t DiffusionRows = 64;
+// columns on both sides of the error rows (the kernels reach two pixels sideways)
+constexpr size_t DiffusionMargin = 2;
+// a row being diffused tells the one below how far it is after this many pixels
+constexpr size_t DiffusionBlock = 32;
+
+// thresholds 0 - 255, every level used equally often (all 256 of them in the blue noise
+// matrix, only the 64 multiples of 4 in the Bayer one)
+using ThresholdMatrix = std::array<uint8_t, MatrixArea>;
+
+// the recursive 2x2 pattern, i.e. bit reversed interleaving of x ^ y and y (8x8, tiled); its
+// 64 levels scaled to 0, 4, ..., 252
+static ThresholdMatrix make_bayer_matrix()
+{
+    ThresholdMatrix matrix;
+
+    for (size_t y = 0; y < MatrixSize; ++y) {
+        for (size_t x = 0; x < MatrixSize; ++x) {
+            uint32_t value = 0;
+            for (int i = 0; i < 3; ++i)
+                value = (value << 2) | ((((x ^ y) >> i) & 1) << 1) | ((y >> i) & 1);
+
+            matrix[y * MatrixSize + x] = value << 2;
+        }
+    }
+
+    return matrix;
+}
+
+// binary pattern with a gaussian 'energy' of every pixel, i.e. how crowded its neighbourhood
+// is (wrapping around, so the matrix can be tiled)
+class BinaryPattern {
+public:
+    BinaryPattern()
+        : m_ones(MatrixArea)
+        , m_energy(MatrixArea)
+    {
+        constexpr double sigma = 1.5;
+
+        for (int dy = -KernelRadius; dy <= KernelRadius; ++dy) {
+            for (int dx = -KernelRadius; dx <= KernelRadius; ++dx)
+                m_kernel[(dy + KernelRadius) * KernelSize + dx + KernelRadius] = float(std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma)));
+        }
+    }
+
+    bool is_one(size_t i) const { return m_ones[i]; }
+
+    void set(size_t i, bool one)
+    {
+        m_ones[i] = one;
+
+        const float sign = one ? 1.0f : -1.0f;
+        const size_t x = i % MatrixSize;
+        const size_t y = i / MatrixSize;
+        for (int dy = -KernelRadius; dy <= KernelRadius; ++dy) {
+            for (int dx = -KernelRadius; dx <= KernelRadius; ++dx) {
+                const size_t j = ((y + dy) & (MatrixSize - 1)) * MatrixSize + ((x + dx) & (MatrixSize - 1));
+                m_energy[j] += sign * m_kernel[(dy + KernelRadius) * KernelSize + dx + KernelRadius];
+            }
+        }
+    }
+
+    // the one with the highest energy (the lowest index if more)
+    size_t tightest_cluster() const { return find(true, [](float a, float b) { return a > b; }); }
+    // the zero with the lowest energy (the lowest index if more)
+    size_t largest_void() const { return find(false, [](float a, float b) { return a < b; }); }
+
+private:
+    static constexpr int KernelRadius = 6;
+    static constexpr int KernelSize = 2 * KernelRadius + 1;
+
+    template<typename Better>
+    size_t find(bool one, Better better) const
+    {
+        size_t best = MatrixArea;
+        for (size_t i = 0; i < MatrixArea; ++i) {
+            if (m_ones[i] == one && (best == MatrixArea || better(m_energy[i], m_energy[best])))
+                best = i;
+        }
+        return best;
+    }
+
+    std::vector<bool>                           m_ones;
+    std::vector<float>                          m_energy;
+    std::array<float, KernelSize * KernelSize>  m_kernel;
+};
+
+// void-and-cluster (Ulichney): an evenly spread initial pattern is ranked by taking its
+// tightest clusters out and then by filling the largest voids until there are only ones
+static ThresholdMatrix make_blue_noise_matrix()
+{
+    BinaryPattern initial;
+    std::mt19937 rng(1);
+
+    size_t ones = 0;
+    while (ones < MatrixArea / 10) {
+        const size_t i = rng() % MatrixArea;
+        if (!initial.is_one(i)) {
+            initial.set(i, true);
+            ++ones;
+        }
+    }
+
+    // move the tightest cluster into the largest void until it's the same pixel
+    for (size_t i = 0; i < MatrixArea; ++i) {
+        const size_t cluster = initial.tightest_cluster();
+        initial.set(cluster, false);
+
+        const size_t largestVoid = initial.largest_void();
+        initial.set(largestVoid, true);
+
+        if (largestVoid == cluster)
+            break;
+    }
+
+    std::array<uint16_t, MatrixArea> ranks;
+
+    BinaryPattern pattern = initial;
+    for (size_t rank = ones; rank-- > 0;) {
+        const size_t cluster = pattern.tightest_cluster();
+        pattern.set(cluster, false);
+        ranks[cluster] = rank;
+    }
+
+    pattern = initial;
+    for (size_t rank = ones; rank < MatrixArea; ++rank) {
+        const size_t largestVoid = pattern.largest_void();
+        pattern.set(largestVoid, true);
+        ranks[largestVoid] = rank;
+    }
+
+    ThresholdMatrix matrix;
+    for (size_t i = 0; i < MatrixArea; ++i)
+        matrix[i] = ranks[i] * 256 / MatrixArea;
+
+    return matrix;
+}
+
+// built on first use
+static const ThresholdMatrix& get_threshold_matrix(OrderedDither orderedDither)
+{
+    if (orderedDither == OrderedDither::Bayer) {
+        static const ThresholdMatrix bayerMatrix = make_bayer_matrix();
+        return bayerMatrix;
+    } else {
+        static const ThresholdMatrix blueNoiseMatrix = make_blue_noise_matrix();
+        return blueNoiseMatrix;
+    }
+}
+
+// 8-bit 'value' reduced to the 'bits' most significant bits: the next level up if the
+// remainder is above the threshold, i.e. with a probability of remainder / level distance
+static inline uint8_t dither_channel(uint8_t value, int bits, uint8_t threshold)
+{
+    const int mask = (0xff << (8 - bits)) & 0xff;
+    const int lower = value & mask;
+    const int remainder = value & ~mask;
+
+    return remainder > (threshold >> bits) ? std::min(lower + (0x100 >> bits), mask) : lower;
+}
+
+static inline Magick::Quantum dither_quantum(Magick::Quantum quantum, int bits, uint8_t threshold)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    return dither_channel(quantum >> shift, bits, threshold) * (MaxRGB / 255);
+}
+
+ChannelBits get_hardware_bits(const ConversionOptions& options)
+{
+    if (options.bitsPerPixel == 16)
+        return { 5, 6, 5 };
+
+    if (options.bitsPerPixel > 0 && options.bitsPerPixel <= 8 && options.paletteBits) {
+        const int bits = options.paletteBits / 3;
+        return { bits, bits, bits };
+    }
+
+    return { 8, 8, 8 };
+}
+
+bool is_dithering_ordered(const ConversionOptions& options)
+{
+    const ChannelBits bits = get_hardware_bits(options);
+    return options.orderedDither != OrderedDither::None && (bits.r < 8 || bits.g < 8 || bits.b < 8);
+}
+
+void dither_ordered(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    const ChannelBits bits = get_hardware_bits(options);
+    const ThresholdMatrix& matrix = get_threshold_matrix(options.orderedDither);
+
+    // the pixels are changed, not the colormap
+    if (image.classType() == Magick::PseudoClass)
+        image.classType(Magick::DirectClass);
+
+    const size_t columns = image.columns();
+    const size_t rows = image.rows();
+    Magick::PixelPacket* pPixelPackets = image.getPixels(0, 0, columns, rows);
+
+#ifdef DITHER_X86
+    // thresholds already shifted for every channel (the opacity lane never goes up),
+    // in memory order of PixelPackets
+    std::vector<int16_t> thresholdLanes(MatrixArea * 4);
+    for (size_t i = 0; i < MatrixArea; ++i) {
+        thresholdLanes[i * 4 + 0] = matrix[i] >> bits.b;
+        thresholdLanes[i * 4 + 1] = matrix[i] >> bits.g;
+        thresholdLanes[i * 4 + 2] = matrix[i] >> bits.r;
+        thresholdLanes[i * 4 + 3] = 0x7fff;
+    }
+
+    const auto level_mask = [](int bits) { return short((0xff << (8 - bits)) & 0xff); };
+    const __m128i masks = _mm_setr_epi16(
+        level_mask(bits.b), level_mask(bits.g), level_mask(bits.r), 0,
+        level_mask(bits.b), level_mask(bits.g), level_mask(bits.r), 0);
+    const __m128i remainderMasks = _mm_andnot_si128(masks, _mm_set1_epi16(0xff));
+    const __m128i steps = _mm_setr_epi16(
+        0x100 >> bits.b, 0x100 >> bits.g, 0x100 >> bits.r, 0,
+        0x100 >> bits.b, 0x100 >> bits.g, 0x100 >> bits.r, 0);
+    const __m128i opacities = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+#endif
+
+    threadPool.parallel_for(rows, DitherGrain, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y) {
+            Magick::PixelPacket* pRow = &pPixelPackets[y * columns];
+            const uint8_t* pThresholds = &matrix[(y % MatrixSize) * MatrixSize];
+            size_t x = 0;
+
+#ifdef DITHER_X86
+            if constexpr (fastPixelPackets) {
+                const int16_t* pThresholdLanes = &thresholdLanes[(y % MatrixSize) * MatrixSize * 4];
+
+                for (; x + 2 <= columns; x += 2) {
+                    __m128i* pPair = reinterpret_cast<__m128i*>(&pRow[x]);
+                    const __m128i pixels = _mm_loadu_si128(pPair);
+
+                    const __m128i values = _mm_srli_epi16(pixels, 8);
+                    const __m128i lower = _mm_and_si128(values, masks);
+                    const __m128i up = _mm_cmpgt_epi16(_mm_and_si128(values, remainderMasks),
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pThresholdLanes[(x % MatrixSize) * 4])));
+                    const __m128i dithered = _mm_min_epi16(_mm_add_epi16(lower, _mm_and_si128(up, steps)), masks);
+
+                    // 0xAB -> 0xABAB
+                    const __m128i quantums = _mm_or_si128(_mm_slli_epi16(dithered, 8), dithered);
+                    _mm_storeu_si128(pPair, _mm_or_si128(_mm_and_si128(opacities, pixels), _mm_andnot_si128(opacities, quantums)));
+                }
+            }
+#endif
+
+            for (; x < columns; ++x) {
+                Magick::PixelPacket& pixelPacket = pRow[x];
+                const uint8_t threshold = pThresholds[x % MatrixSize];
+
+                pixelPacket.red   = dither_quantum(pixelPacket.red,   bits.r, threshold);
+                pixelPacket.green = dither_quantum(pixelPacket.green, bits.g, threshold);
+                pixelPacket.blue  = dither_quantum(pixelPacket.blue,  bits.b, threshold);
+            }
+        }
+    });
+
+    image.syncPixels();
+}
+
+// the error of a pixel times 'weight' goes to the pixel at [dx, dy]
+struct DiffusionWeight {
+    int dx, dy, weight;
+};
+
+// the weights add up to 1 << shift (or less, Atkinson's spreads only 3/4 of the error)
+struct DiffusionKernel {
+    int                             shift;
+    std::vector<DiffusionWeight>    weights;
+};
+
+static const DiffusionKernel& get_diffusion_kernel(ErrorDiffusion errorDiffusion)
+{
+    static const DiffusionKernel floydSteinberg { 4, { { 1, 0, 7 }, { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 } } };
+    static const DiffusionKernel atkinson { 3, { { 1, 0, 1 }, { 2, 0, 1 }, { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 }, { 0, 2, 1 } } };
+    static const DiffusionKernel sierraLite { 2, { { 1, 0, 2 }, { -1, 1, 1 }, { 0, 1, 1 } } };
+
+    switch (errorDiffusion) {
+        case ErrorDiffusion::Atkinson:
+            return atkinson;
+        case ErrorDiffusion::SierraLite:
+            return sierraLite;
+        default:
+            return floydSteinberg;
+    }
+}
+
+// 'quantize(i, r, g, b)' replaces the error adjusted colour (0 - 255) of the i-th pixel by its
+// output colour and stores it; one row per task, every row waits for the one above to be two
+// pixels ahead (the kernels reach one pixel left on the rows below)
+template<typename Quantize>
+static void diffuse(const Magick::PixelPacket* pPixelPackets, size_t columns, size_t rows, ErrorDiffusion errorDiffusion,
+                    ThreadPool& threadPool, Quantize quantize)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    const DiffusionKernel& kernel = get_diffusion_kernel(errorDiffusion);
+    const int32_t half = 1 << (kernel.shift - 1);
+
+    size_t maxDy = 0;
+    for (const DiffusionWeight& weight : kernel.weights)
+        maxDy = std::max<size_t>(maxDy, weight.dy);
+
+    // errors (times the divisor) from the rows above, per channel; cleared when read so every
+    // row can be reused DiffusionRows rows later
+    const size_t stride = (columns + 2 * DiffusionMargin) * 3;
+    std::vector<int32_t> errorRows(DiffusionRows * stride);
+
+    // y * (columns + 1) + number of finished pixels of row y (growing even if a row is reused)
+    std::vector<std::atomic<size_t>> progress(DiffusionRows);
+    for (std::atomic<size_t>& rowProgress : progress)
+        rowProgress.store(0);
+
+    // returns the number of finished pixels of row 'y' (at least 'count')
+    const auto wait_for = [&](size_t y, size_t count) {
+        const size_t base = y * (columns + 1);
+        for (;;) {
+            const size_t value = progress[y % DiffusionRows].load(std::memory_order_acquire);
+            if (value >= base + count)
+                return value - base;
+
+            std::this_thread::yield();
+        }
+    };
+
+    // rows are claimed in order, so the ones waited for are always being diffused already
+    threadPool.parallel_for(rows, 1, [&](size_t begin, size_t end) {
+        // errors from the pixels on the left
+        std::vector<int32_t> rowErrors(stride);
+
+        for (size_t y = begin; y < end; ++y) {
+            // the error rows this one writes to must have been read by their previous rows
+            if (y + maxDy >= DiffusionRows)
+                wait_for(y + maxDy - DiffusionRows, columns);
+
+            std::fill(rowErrors.begin(), rowErrors.end(), 0);
+            int32_t* pErrors = &errorRows[(y % DiffusionRows) * stride];
+            size_t finishedAbove = y > 0 ? 0 : columns;
+
+            for (size_t x = 0; x < columns; ++x) {
+                const size_t needed = std::min(x + 2, columns);
+                if (finishedAbove < needed)
+                    finishedAbove = wait_for(y - 1, needed);
+
+                const size_t i = y * columns + x;
+                const size_t e = (x + DiffusionMargin) * 3;
+                const int source[3] = {
+                    pPixelPackets[i].red >> shift, pPixelPackets[i].green >> shift, pPixelPackets[i].blue >> shift
+                };
+
+                int adjusted[3];
+                for (int c = 0; c < 3; ++c) {
+                    const int32_t error = pErrors[e + c] + rowErrors[e + c];
+                    pErrors[e + c] = 0;
+                    adjusted[c] = std::clamp(source[c] + ((error + half) >> kernel.shift), 0, 255);
+                }
+
+                int output[3] = { adjusted[0], adjusted[1], adjusted[2] };
+                quantize(i, output[0], output[1], output[2]);
+
+                for (const DiffusionWeight& weight : kernel.weights) {
+                    int32_t* pTarget;
+                    if (weight.dy == 0)
+                        pTarget = &rowErrors[(x + weight.dx + DiffusionMargin) * 3];
+                    else if (y + weight.dy < rows)
+                        pTarget = &errorRows[((y + weight.dy) % DiffusionRows) * stride + (x + weight.dx + DiffusionMargin) * 3];
+                    else
+                        continue;
+
+                    for (int c = 0; c < 3; ++c)
+                        pTarget[c] += (adjusted[c] - output[c]) * weight.weight;
+                }
+
+                if ((x + 1) % DiffusionBlock == 0 || x + 1 == columns)
+                    progress[y % DiffusionRows].store(y * (columns + 1) + x + 1, std::memory_order_release);
+            }
+        }
+    });
+}
+
+// the closer one of the two levels of 'bits' around 'value'
+static inline int closest_level(int value, int bits)
+{
+    const int mask = (0xff << (8 - bits)) & 0xff;
+    const int lower = value & mask;
+
+    return 2 * (value - lower) >= (0x100 >> bits) ? std::min(lower + (0x100 >> bits), mask) : lower;
+}
+
+bool is_diffusing_error(const ConversionOptions& options)
+{
+    return options.errorDiffusion != ErrorDiffusion::None
+        && ((options.bitsPerPixel > 0 && options.bitsPerPixel <= 8) || options.bitsPerPixel == 16);
+}
+
+void diffuse_error(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    const ChannelBits bits = get_hardware_bits(options);
+
+    // the pixels are changed, not the colormap
+    if (image.classType() == Magick::PseudoClass)
+        image.classType(Magick::DirectClass);
+
+    const size_t columns = image.columns();
+    const size_t rows = image.rows();
+    Magick::PixelPacket* pPixelPackets = image.getPixels(0, 0, columns, rows);
+
+    diffuse(pPixelPackets, columns, rows, options.errorDiffusion, threadPool, [&](size_t i, int& r, int& g, int& b) {
+        r = closest_level(r, bits.r);
+        g = closest_level(g, bits.g);
+        b = closest_level(b, bits.b);
+
+        pPixelPackets[i].red   = r * (MaxRGB / 255);
+        pPixelPackets[i].green = g * (MaxRGB / 255);
+        pPixelPackets[i].blue  = b * (MaxRGB / 255);
+    });
+
+    image.syncPixels();
+}
+
+std::vector<uint8_t> diffuse_error(const Magick::Image& image, const InverseColormap& inverseColormap, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    const size_t columns = image.columns();
+    const size_t rows = image.rows();
+    std::vector<uint8_t> indexes(columns * rows);
+
+    diffuse(image.getConstPixels(0, 0, columns, rows), columns, rows, options.errorDiffusion, threadPool, [&](size_t i, int& r, int& g, int& b) {
+        const uint8_t index = inverseColormap.nearest(r, g, b);
+        indexes[i] = index;
+
+        const PaletteColor& color = inverseColormap.palette()[index];
+        r = color.r;
+        g = color.g;
+        b = color.b;
+    });
+
+    return indexes;
+}
@@ -0,0 +1,62 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+#include "args.h"
+#include "quantize.h"
+#include "threadpool.h"
+
+// bits per channel the output can show: 5/6/5 for 16 bpp, paletteBits / 3 for 1 - 8 bpp
+// (the colour space the palette is built in) and 8 otherwise
+struct ChannelBits {
+    int r, g, b;
+};
+ChannelBits get_hardware_bits(const ConversionOptions& options);
+
+// true if dither_ordered() changes anything for the given options
+bool is_dithering_ordered(const ConversionOptions& options);
+
+// reduces every channel of 'image' to get_hardware_bits() using a 64x64 threshold matrix
+// (options.orderedDither) instead of truncating, i.e. every pixel is rounded up or down
+// with a probability given by its distance from the two closest levels; opacity is kept
+// and the rows are processed in parallel, so the result doesn't depend on the thread count
+void dither_ordered(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool);
+
+// true if the output is made by diffuse_error() for the given options (16 bpp or 1 - 8 bpp)
+bool is_diffusing_error(const ConversionOptions& options);
+
+// error diffusion (options.errorDiffusion): the difference between every pixel and its output
+// colour is spread to the pixels right of and below it. The rows run in parallel as a wavefront
+// (every row a few pixels behind the one above) and the errors are summed in integers, so the
+// result is the same as of a serial pass regardless of the number of threads
+
+// every channel of 'image' is reduced to the closest level of get_hardware_bits() (for 16 bpp)
+void diffuse_error(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool);
+// onto the inverse colormap's palette, returns the palette index of every pixel
+std::vector<uint8_t> diffuse_error(const Magick::Image& image, const InverseColormap& inverseColormap, const ConversionOptions& options, ThreadPool& threadPool);
+
+#endif // DITHER_H
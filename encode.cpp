@@ -0,0 +1,257 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "encode.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define ENCODE_X86
+#include <emmintrin.h>
+#endif
+
+#include "c2p.h"
+#include "helpers.h"
+
+using namespace Magick;
+
+// GraphicsMagick's Q16 PixelPacket on a little endian machine: blue, green, red, opacity
+constexpr bool fastPixelPackets =
+    QuantumDepth == 16 && sizeof(PixelPacket) == 8
+    && offsetof(PixelPacket, blue) == 0 && offsetof(PixelPacket, green) == 2
+    && offsetof(PixelPacket, red) == 4 && offsetof(PixelPacket, opacity) == 6;
+
+// same order as in allowedValues (args.cpp)
+constexpr std::array<int16_t, 8> bitsPerPixelValues  = { 1, 2, 4, 6, 8, 16, 24, 32 };
+constexpr std::array<int16_t, 6> bytesPerChunkValues = { -1, 0, 1, 2, 3, 4 };
+
+template<int16_t BitsPerPixel>
+static void encode_planar(const PixelPacket*, const IndexPacket* pIndexPackets, size_t columns, size_t rows, uint8_t* pBuffer)
+{
+    // IndexPacket is as wide as Quantum, the c2p kernel wants bytes
+    std::vector<uint8_t> chunky(columns);
+
+    const size_t rowSize = (columns * BitsPerPixel) / 8;
+
+    for (size_t y = 0; y < rows; ++y, pIndexPackets += columns, pBuffer += rowSize) {
+        std::copy(pIndexPackets, pIndexPackets + columns, chunky.begin());
+        chunky_to_planar(chunky.data(), columns, BitsPerPixel, pBuffer);
+    }
+}
+
+template<int16_t BitsPerPixel>
+static void encode_packed(const PixelPacket*, const IndexPacket* pIndexPackets, size_t columns, size_t rows, uint8_t* pBuffer)
+{
+    constexpr size_t pixelsPerChunk = 8 / BitsPerPixel;
+
+    for (const IndexPacket* pIndexPacketsEnd = pIndexPackets + columns * rows;
+         pIndexPackets != pIndexPacketsEnd; pIndexPackets += pixelsPerChunk)
+    {
+        uint8_t chunk = 0;
+        for (size_t i = 0; i < pixelsPerChunk; ++i) {
+            chunk = (chunk << BitsPerPixel) | pIndexPackets[i];
+        }
+
+        *pBuffer++ = chunk;
+    }
+}
+
+template<int16_t BitsPerPixel>
+static inline uint32_t chunk_value(const PixelPacket& pixelPacket)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    if constexpr (BitsPerPixel == 16) {
+        const uint8_t r = (pixelPacket.red   >> shift) >> (8 - 5);
+        const uint8_t g = (pixelPacket.green >> shift) >> (8 - 6);
+        const uint8_t b = (pixelPacket.blue  >> shift) >> (8 - 5);
+        return (r << 11) | (g << 5) | b;
+    } else if constexpr (BitsPerPixel == 24) {
+        const uint8_t r = pixelPacket.red   >> shift;
+        const uint8_t g = pixelPacket.green >> shift;
+        const uint8_t b = pixelPacket.blue  >> shift;
+        return (r << 16) | (g << 8) | b;    // RGB (no opacity)
+    } else {
+        static_assert(BitsPerPixel == 32, "Unsupported number of bits per pixel");
+
+        const uint8_t a = pixelPacket.opacity >> shift;
+        const uint8_t r = pixelPacket.red     >> shift;
+        const uint8_t g = pixelPacket.green   >> shift;
+        const uint8_t b = pixelPacket.blue    >> shift;
+        return (uint32_t(a) << 24) | (r << 16) | (g << 8) | b;    // ARGB
+    }
+}
+
+#ifdef ENCODE_X86
+// the same as chunk_value() in big endian for as many whole groups of 8 (16 bpp) or 4 (24 and
+// 32 bpp) pixels as there are in 'count'; returns the number of pixels done
+template<int16_t BitsPerPixel>
+static size_t encode_truecolor_sse2(const PixelPacket* pPixelPackets, size_t count, uint8_t* pBuffer)
+{
+    const __m128i* pPairs = reinterpret_cast<const __m128i*>(pPixelPackets);   // two pixels each
+    __m128i* pOutput = reinterpret_cast<__m128i*>(pBuffer);
+    size_t i = 0;
+
+    if constexpr (BitsPerPixel == 16) {
+        const __m128i redMask = _mm_set1_epi32(0xf800);
+        const __m128i greenMask = _mm_set1_epi32(0x07e0);
+        const __m128i blueMask = _mm_set1_epi32(0x001f);
+
+        // dword 0 of a pixel is blue | green << 16, dword 1 red | opacity << 16; the result
+        // ends up in dword 0 (and 2) as a (sign extended) 16-bit value
+        const auto rgb565 = [&](__m128i pair) {
+            const __m128i rgb = _mm_or_si128(_mm_and_si128(_mm_srli_si128(pair, 4), redMask),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(pair, 21), greenMask), _mm_and_si128(_mm_srli_epi32(pair, 11), blueMask)));
+            return _mm_srai_epi32(_mm_slli_epi32(_mm_shuffle_epi32(rgb, _MM_SHUFFLE(3, 1, 2, 0)), 16), 16);
+        };
+
+        for (; i + 8 <= count; i += 8, pPairs += 4) {
+            const __m128i first = _mm_unpacklo_epi64(rgb565(_mm_loadu_si128(&pPairs[0])), rgb565(_mm_loadu_si128(&pPairs[1])));
+            const __m128i second = _mm_unpacklo_epi64(rgb565(_mm_loadu_si128(&pPairs[2])), rgb565(_mm_loadu_si128(&pPairs[3])));
+            const __m128i words = _mm_packs_epi32(first, second);
+
+            // big endian
+            _mm_storeu_si128(pOutput++, _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8)));
+        }
+    } else if constexpr (BitsPerPixel == 24) {
+        const __m128i lowDwords = _mm_set_epi32(0, 0x00ffffff, 0, 0x00ffffff);
+        const __m128i highDwords = _mm_set_epi32(0x00ffffff, 0, 0x00ffffff, 0);
+        const __m128i lowQword = _mm_set_epi32(0, 0, -1, -1);
+
+        for (; i + 4 <= count; i += 4, pPairs += 2) {
+            // red, green, blue, opacity
+            const __m128i first = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_loadu_si128(&pPairs[0]), _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+            const __m128i second = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_loadu_si128(&pPairs[1]), _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+            const __m128i bytes = _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8));
+
+            // without opacity: 6 bytes in every qword, then 12 in a row
+            const __m128i qwords = _mm_or_si128(_mm_and_si128(bytes, lowDwords), _mm_srli_epi64(_mm_and_si128(bytes, highDwords), 8));
+            const __m128i packed = _mm_or_si128(_mm_and_si128(qwords, lowQword), _mm_srli_si128(_mm_andnot_si128(lowQword, qwords), 2));
+
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(pBuffer), packed);
+            const int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+            std::memcpy(pBuffer + 8, &last, 4);
+            pBuffer += 12;
+        }
+    } else {
+        static_assert(BitsPerPixel == 32, "Unsupported number of bits per pixel");
+
+        for (; i + 4 <= count; i += 4, pPairs += 2) {
+            // opacity, red, green, blue
+            const __m128i first = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_loadu_si128(&pPairs[0]), _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+            const __m128i second = _mm_shufflehi_epi16(_mm_shufflelo_epi16(_mm_loadu_si128(&pPairs[1]), _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+
+            _mm_storeu_si128(pOutput++, _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8)));
+        }
+    }
+
+    return i;
+}
+#endif
+
+template<int16_t BitsPerPixel, int16_t BytesPerChunk>
+static void encode_chunky(const PixelPacket* pPixelPackets, const IndexPacket* pIndexPackets, size_t columns, size_t rows, uint8_t* pBuffer)
+{
+    size_t i = 0;
+
+#ifdef ENCODE_X86
+    // native chunk sizes only (wider chunks are just zero extended below)
+    if constexpr (fastPixelPackets && BitsPerPixel > 8 && BitsPerPixel / 8 == BytesPerChunk) {
+        i = encode_truecolor_sse2<BitsPerPixel>(pPixelPackets, columns * rows, pBuffer);
+        pBuffer += i * BytesPerChunk;
+    }
+#endif
+
+    for (; i < columns * rows; ++i) {
+        uint32_t chunk;
+        if constexpr (BitsPerPixel <= 8)
+            chunk = pIndexPackets[i];
+        else
+            chunk = chunk_value<BitsPerPixel>(pPixelPackets[i]);
+
+        // go from MSB to LSB
+        for (int j = BytesPerChunk - 1; j >= 0; --j) {
+            *pBuffer++ = chunk >> (j * 8);
+        }
+    }
+}
+
+template<int16_t BitsPerPixel, int16_t BytesPerChunk>
+constexpr EncodeFunc make_encoder()
+{
+    if constexpr (BytesPerChunk == -1 && BitsPerPixel < 8 && BitsPerPixel != 6)
+        return encode_packed<BitsPerPixel>;
+    else if constexpr (BytesPerChunk == -1 && BitsPerPixel >= 8)
+        return make_encoder<BitsPerPixel, BitsPerPixel / 8>();  // see parse_arguments()
+    else if constexpr (BytesPerChunk == 0 && BitsPerPixel <= 8)
+        return encode_planar<BitsPerPixel>;
+    else if constexpr (BytesPerChunk > 0 && BitsPerPixel / 8 <= BytesPerChunk)
+        return encode_chunky<BitsPerPixel, BytesPerChunk>;
+    else
+        return nullptr;
+}
+
+template<size_t BppIndex, size_t... BpcIndices>
+constexpr std::array<EncodeFunc, sizeof...(BpcIndices)> make_encoder_row(std::index_sequence<BpcIndices...>)
+{
+    return { make_encoder<bitsPerPixelValues[BppIndex], bytesPerChunkValues[BpcIndices]>()... };
+}
+
+template<size_t... BppIndices>
+constexpr auto make_encoder_table(std::index_sequence<BppIndices...>)
+{
+    return std::array<std::array<EncodeFunc, bytesPerChunkValues.size()>, sizeof...(BppIndices)> {
+        make_encoder_row<BppIndices>(std::make_index_sequence<bytesPerChunkValues.size()>())...
+    };
+}
+
+// [bpp][bpc] => encoder (or nullptr if the combination is not allowed)
+constexpr auto encoderTable = make_encoder_table(std::make_index_sequence<bitsPerPixelValues.size()>());
+
+EncodeFunc get_encoder(int16_t bitsPerPixel, int16_t bytesPerChunk)
+{
+    const auto bppIt = std::find(bitsPerPixelValues.begin(), bitsPerPixelValues.end(), bitsPerPixel);
+    const auto bpcIt = std::find(bytesPerChunkValues.begin(), bytesPerChunkValues.end(), bytesPerChunk);
+
+    EncodeFunc encoder = nullptr;
+    if (bppIt != bitsPerPixelValues.end() && bpcIt != bytesPerChunkValues.end())
+        encoder = encoderTable[bppIt - bitsPerPixelValues.begin()][bpcIt - bytesPerChunkValues.begin()];
+
+    if (!encoder) {
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected combination of bits per pixel and bytes per chunk: " << bitsPerPixel << "/" << bytesPerChunk
+        );
+    }
+
+    return encoder;
+}
+
+size_t get_encoded_size(int16_t bitsPerPixel, int16_t bytesPerChunk, size_t columns, size_t rows)
+{
+    if (bytesPerChunk > 0)
+        return columns * rows * bytesPerChunk;
+    else
+        return (columns * rows * bitsPerPixel) / 8;  // this includes packed chunky pixels, too
+}
@@ -0,0 +1,42 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+// number of rows encoded by one thread at once
+constexpr size_t EncodeGrain = 16;
+
+// encodes 'rows' consecutive rows of 'columns' pixels into 'pBuffer' (which must be
+// at least get_encoded_size() big); pIndexPackets is used only for bpp <= 8
+using EncodeFunc = void (*)(const Magick::PixelPacket* pPixelPackets, const Magick::IndexPacket* pIndexPackets,
+                            size_t columns, size_t rows, uint8_t* pBuffer);
+
+// throws std::invalid_argument for combinations not allowed by args.cpp
+EncodeFunc get_encoder(int16_t bitsPerPixel, int16_t bytesPerChunk);
+
+size_t get_encoded_size(int16_t bitsPerPixel, int16_t bytesPerChunk, size_t columns, size_t rows);
+
+#endif // ENCODE_H
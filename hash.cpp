@@ -0,0 +1,167 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hash.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t Prime3 = 0x165667B19E3779F9ull;
+constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ull;
+constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// little endian regardless of the host
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t mix_round(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * Prime2, 31) * Prime1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t value)
+{
+    return (acc ^ mix_round(0, value)) * Prime1 + Prime4;
+}
+
+Hasher::Hasher(uint64_t seed)
+    : m_state { seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1 }
+    , m_seed(seed)
+{
+}
+
+void Hasher::update(const void* pData, size_t size)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(pData);
+    const uint8_t* pEnd = p + size;
+
+    m_totalSize += size;
+
+    if (m_bufferSize + size < sizeof(m_buffer)) {
+        std::memcpy(m_buffer + m_bufferSize, p, size);
+        m_bufferSize += size;
+        return;
+    }
+
+    if (m_bufferSize) {
+        const size_t fill = sizeof(m_buffer) - m_bufferSize;
+        std::memcpy(m_buffer + m_bufferSize, p, fill);
+        p += fill;
+
+        for (int i = 0; i < 4; ++i)
+            m_state[i] = mix_round(m_state[i], read64(m_buffer + i * 8));
+        m_bufferSize = 0;
+    }
+
+    for (; p + 32 <= pEnd; p += 32) {
+        m_state[0] = mix_round(m_state[0], read64(p));
+        m_state[1] = mix_round(m_state[1], read64(p + 8));
+        m_state[2] = mix_round(m_state[2], read64(p + 16));
+        m_state[3] = mix_round(m_state[3], read64(p + 24));
+    }
+
+    m_bufferSize = pEnd - p;
+    std::memcpy(m_buffer, p, m_bufferSize);
+}
+
+uint64_t Hasher::digest() const
+{
+    uint64_t hash;
+
+    if (m_totalSize >= 32) {
+        hash = rotl(m_state[0], 1) + rotl(m_state[1], 7) + rotl(m_state[2], 12) + rotl(m_state[3], 18);
+        for (int i = 0; i < 4; ++i)
+            hash = merge_round(hash, m_state[i]);
+    } else {
+        hash = m_seed + Prime5;
+    }
+
+    hash += m_totalSize;
+
+    const uint8_t* p = m_buffer;
+    const uint8_t* pEnd = m_buffer + m_bufferSize;
+
+    for (; p + 8 <= pEnd; p += 8)
+        hash = rotl(hash ^ mix_round(0, read64(p)), 27) * Prime1 + Prime4;
+
+    if (p + 4 <= pEnd) {
+        hash = rotl(hash ^ (read32(p) * Prime1), 23) * Prime2 + Prime3;
+        p += 4;
+    }
+
+    for (; p < pEnd; ++p)
+        hash = rotl(hash ^ (*p * Prime5), 11) * Prime1;
+
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+uint64_t hash_file(const std::string& filePath)
+{
+    std::ifstream ifs(filePath, std::ifstream::binary);
+    if (!ifs)
+        throw std::runtime_error("Opening " + filePath + " failed.");
+
+    Hasher hasher;
+    std::vector<char> buffer(1 << 20);
+
+    while (ifs) {
+        ifs.read(buffer.data(), buffer.size());
+        hasher.update(buffer.data(), ifs.gcount());
+    }
+
+    if (ifs.bad())
+        throw std::runtime_error("Reading " + filePath + " failed.");
+
+    return hasher.digest();
+}
+
+std::string to_hex(uint64_t value)
+{
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return oss.str();
+}
@@ -0,0 +1,49 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// streaming 64-bit XXH64 hash (not cryptographic, just a fast content fingerprint)
+class Hasher {
+public:
+    explicit Hasher(uint64_t seed = 0);
+
+    void update(const void* pData, size_t size);
+    uint64_t digest() const;
+
+private:
+    uint64_t    m_state[4];
+    uint8_t     m_buffer[32];   // unprocessed tail of the input
+    size_t      m_bufferSize = 0;
+    uint64_t    m_totalSize = 0;
+    uint64_t    m_seed;
+};
+
+// throws std::runtime_error if the file can't be read
+uint64_t hash_file(const std::string& filePath);
+
+std::string to_hex(uint64_t value);
+
+#endif // HASH_H
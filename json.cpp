@@ -0,0 +1,326 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "json.h"
+
+#include <iomanip>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+
+std::string json_string(const std::string& str)
+{
+    std::ostringstream oss;
+
+    oss << '"';
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\')
+            oss << '\\' << c;
+        else if (c < 0x20)
+            oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+        else
+            oss << c;
+    }
+    oss << '"';
+
+    return oss.str();
+}
+
+const JsonValue* JsonValue::find(const std::string& key) const
+{
+    for (const auto& [name, value] : object) {
+        if (name == key)
+            return &value;
+    }
+
+    return nullptr;
+}
+
+// deeper documents are rejected before they could exhaust the stack
+static const int MaxDepth = 64;
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : m_text(text) {}
+
+    JsonValue parse()
+    {
+        JsonValue value = parse_value();
+
+        skip_whitespace();
+        if (m_position != m_text.size())
+            fail("unexpected characters after the value");
+
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what) const
+    {
+        std::ostringstream oss;
+        oss << "Invalid JSON at offset " << m_position << ": " << what << ".";
+        throw std::invalid_argument(oss.str());
+    }
+
+    void skip_whitespace()
+    {
+        while (m_position < m_text.size() && (m_text[m_position] == ' ' || m_text[m_position] == '\t'
+                                              || m_text[m_position] == '\n' || m_text[m_position] == '\r'))
+            ++m_position;
+    }
+
+    char peek()
+    {
+        skip_whitespace();
+        if (m_position == m_text.size())
+            fail("unexpected end");
+        return m_text[m_position];
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c)
+            fail("unexpected character");
+        ++m_position;
+    }
+
+    size_t skip_digits()
+    {
+        const size_t begin = m_position;
+        while (m_position < m_text.size() && m_text[m_position] >= '0' && m_text[m_position] <= '9')
+            ++m_position;
+        return m_position - begin;
+    }
+
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, converted independently of the locale
+    double parse_number()
+    {
+        const size_t begin = m_position;
+
+        if (m_text[m_position] == '-')
+            ++m_position;
+
+        if (m_position < m_text.size() && m_text[m_position] == '0')
+            ++m_position;
+        else if (!skip_digits())
+            fail("invalid number");
+
+        if (m_position < m_text.size() && m_text[m_position] == '.') {
+            ++m_position;
+            if (!skip_digits())
+                fail("invalid number");
+        }
+
+        if (m_position < m_text.size() && (m_text[m_position] == 'e' || m_text[m_position] == 'E')) {
+            ++m_position;
+            if (m_position < m_text.size() && (m_text[m_position] == '+' || m_text[m_position] == '-'))
+                ++m_position;
+            if (!skip_digits())
+                fail("invalid number");
+        }
+
+        std::istringstream iss(m_text.substr(begin, m_position - begin));
+        iss.imbue(std::locale::classic());
+
+        double number = 0.0;
+        iss >> number;
+        return number;
+    }
+
+    bool consume(const char* literal)
+    {
+        const std::string str(literal);
+        if (m_text.compare(m_position, str.size(), str) != 0)
+            return false;
+
+        m_position += str.size();
+        return true;
+    }
+
+    // UTF-8 of \uXXXX (surrogate pairs included)
+    void append_escaped_code_point(std::string& str)
+    {
+        auto read_hex = [this]() {
+            if (m_text.size() - m_position < 4)
+                fail("incomplete \\u escape");
+
+            unsigned int code = 0;
+            for (int i = 0; i < 4; ++i) {
+                const char c = m_text[m_position++];
+                code <<= 4;
+                if (c >= '0' && c <= '9')
+                    code |= c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    code |= c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    code |= c - 'A' + 10;
+                else
+                    fail("invalid \\u escape");
+            }
+            return code;
+        };
+
+        unsigned int code = read_hex();
+        if (code >= 0xd800 && code < 0xdc00) {
+            if (!consume("\\u"))
+                fail("unpaired surrogate");
+
+            const unsigned int low = read_hex();
+            if (low < 0xdc00 || low >= 0xe000)
+                fail("unpaired surrogate");
+
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+        }
+
+        if (code < 0x80) {
+            str += char(code);
+        } else if (code < 0x800) {
+            str += char(0xc0 | (code >> 6));
+            str += char(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            str += char(0xe0 | (code >> 12));
+            str += char(0x80 | ((code >> 6) & 0x3f));
+            str += char(0x80 | (code & 0x3f));
+        } else {
+            str += char(0xf0 | (code >> 18));
+            str += char(0x80 | ((code >> 12) & 0x3f));
+            str += char(0x80 | ((code >> 6) & 0x3f));
+            str += char(0x80 | (code & 0x3f));
+        }
+    }
+
+    std::string parse_string()
+    {
+        expect('"');
+
+        std::string str;
+        for (;;) {
+            if (m_position == m_text.size())
+                fail("unterminated string");
+
+            const char c = m_text[m_position++];
+            if (c == '"')
+                break;
+
+            if (static_cast<unsigned char>(c) < 0x20)
+                fail("control character in string");
+
+            if (c != '\\') {
+                str += c;
+                continue;
+            }
+
+            if (m_position == m_text.size())
+                fail("unterminated string");
+
+            switch (m_text[m_position++]) {
+            case '"':  str += '"';  break;
+            case '\\': str += '\\'; break;
+            case '/':  str += '/';  break;
+            case 'b':  str += '\b'; break;
+            case 'f':  str += '\f'; break;
+            case 'n':  str += '\n'; break;
+            case 'r':  str += '\r'; break;
+            case 't':  str += '\t'; break;
+            case 'u':  append_escaped_code_point(str); break;
+            default:
+                fail("invalid escape");
+            }
+        }
+
+        return str;
+    }
+
+    JsonValue parse_value(int depth = 0)
+    {
+        JsonValue value;
+
+        if (depth == MaxDepth)
+            fail("too deeply nested");
+
+        const char c = peek();
+
+        if (c == '{') {
+            value.type = JsonValue::Type::Object;
+            ++m_position;
+
+            if (peek() == '}') {
+                ++m_position;
+            } else {
+                for (;;) {
+                    std::string key = parse_string();
+                    expect(':');
+                    value.object.emplace_back(std::move(key), parse_value(depth + 1));
+
+                    if (peek() == '}') {
+                        ++m_position;
+                        break;
+                    }
+                    expect(',');
+                }
+            }
+        } else if (c == '[') {
+            value.type = JsonValue::Type::Array;
+            ++m_position;
+
+            if (peek() == ']') {
+                ++m_position;
+            } else {
+                for (;;) {
+                    value.array.push_back(parse_value(depth + 1));
+
+                    if (peek() == ']') {
+                        ++m_position;
+                        break;
+                    }
+                    expect(',');
+                }
+            }
+        } else if (c == '"') {
+            value.type = JsonValue::Type::String;
+            value.string = parse_string();
+        } else if (consume("true")) {
+            value.type = JsonValue::Type::Boolean;
+            value.boolean = true;
+        } else if (consume("false")) {
+            value.type = JsonValue::Type::Boolean;
+        } else if (consume("null")) {
+            value.type = JsonValue::Type::Null;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            const size_t begin = m_position;
+
+            value.type = JsonValue::Type::Number;
+            value.number = parse_number();
+            value.text = m_text.substr(begin, m_position - begin);
+        } else {
+            fail("unexpected character");
+        }
+
+        return value;
+    }
+
+    const std::string&  m_text;
+    size_t              m_position = 0;
+};
+
+JsonValue parse_json(const std::string& text)
+{
+    return JsonParser(text).parse();
+}
@@ -0,0 +1,58 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// just enough JSON for '-stats json', the benchmark's output and the '-serve' requests
+
+// quoted and escaped
+std::string json_string(const std::string& str);
+
+struct JsonValue {
+    enum class Type {
+        Null,
+        Boolean,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Type                                            type = Type::Null;
+    bool                                            boolean = false;
+    double                                          number = 0.0;
+    std::string                                     string;
+    std::vector<JsonValue>                          array;
+    std::vector<std::pair<std::string, JsonValue>>  object;     // in the original order
+    std::string                                     text;       // a number as it was in the source (empty otherwise)
+
+    // nullptr if not an object or without 'key'
+    const JsonValue* find(const std::string& key) const;
+};
+
+// throws std::invalid_argument if 'text' is not one complete JSON value
+JsonValue parse_json(const std::string& text);
+
+#endif // JSON_H
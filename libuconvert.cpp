@@ -0,0 +1,144 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "libuconvert.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "convert.h"
+#include "threadpool.h"
+
+struct uconvert_context {
+    ThreadPool  threadPool;
+
+    explicit uconvert_context(unsigned int threads) : threadPool(threads) {}
+};
+
+struct uconvert_options {
+    ConversionOptions   options;
+    std::string         extension;
+};
+
+static void set_error(char** error, const char* message)
+{
+    if (error)
+        *error = strdup(message);
+}
+
+// calls 'func', returns 0 or -1 (with the exception's message in *error)
+template<typename F>
+static int call(char** error, F func)
+{
+    try {
+        func();
+        return 0;
+    }
+    catch (std::exception& ex) {
+        set_error(error, ex.what());
+    }
+    catch (...) {
+        set_error(error, "Unknown error.");
+    }
+
+    return -1;
+}
+
+uconvert_context* uconvert_context_create(unsigned int threads, char** error)
+{
+    uconvert_context* context = nullptr;
+    call(error, [&] { context = new uconvert_context(threads); });
+    return context;
+}
+
+void uconvert_context_destroy(uconvert_context* context)
+{
+    delete context;
+}
+
+uconvert_options* uconvert_options_create(int argc, const char* const* argv, char** error)
+{
+    uconvert_options* options = nullptr;
+
+    call(error, [&] {
+        // parsed as if converting one FILE
+        std::vector<std::string> args(argv, argv + argc);
+        args.push_back("libuconvert");
+
+        const std::vector<Job> jobs = parse_arguments(args);
+        if (jobs.size() != 1 || jobs.front().targets.size() != 1)
+            throw std::invalid_argument("Only options (without FILEs and -emit) are accepted.");
+
+        const ConversionOptions& conversionOptions = jobs.front().targets.front().options;
+        if (conversionOptions.sharedPalette || !conversionOptions.paletteFilename.empty())
+            throw std::invalid_argument("-sharedpal and -palout need more FILEs at once.");
+
+        options = new uconvert_options { conversionOptions, get_uimg_filename_ext(conversionOptions) };
+    });
+
+    return options;
+}
+
+void uconvert_options_destroy(uconvert_options* options)
+{
+    delete options;
+}
+
+const char* uconvert_options_extension(const uconvert_options* options)
+{
+    return options->extension.c_str();
+}
+
+int uconvert_convert_file(uconvert_context* context, const uconvert_options* options,
+                          const char* inputFilename, const char* outputFilename, char** error)
+{
+    return call(error, [&] {
+        std::ostringstream messages;
+        convert(Job { inputFilename, { Target { outputFilename, options->options } } }, context->threadPool, messages, messages);
+    });
+}
+
+int uconvert_convert_memory(uconvert_context* context, const uconvert_options* options,
+                            const void* input, size_t inputSize, void** output, size_t* outputSize, char** error)
+{
+    return call(error, [&] {
+        std::ostringstream messages;
+        const std::vector<uint8_t> uimg = convert_memory(static_cast<const uint8_t*>(input), inputSize, options->options,
+                                                         context->threadPool, messages, messages);
+
+        void* p = std::malloc(uimg.size());
+        if (!p)
+            throw std::bad_alloc();
+
+        std::memcpy(p, uimg.data(), uimg.size());
+        *output = p;
+        *outputSize = uimg.size();
+    });
+}
+
+void uconvert_free(void* p)
+{
+    std::free(p);
+}
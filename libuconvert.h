@@ -0,0 +1,64 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LIBUCONVERT_H
+#define LIBUCONVERT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C API of libuconvert (see convert.h for the C++ one). All functions are reentrant: any number
+ * of conversions can run concurrently, with the same or different contexts and options. Functions
+ * returning int return 0 on success and -1 on failure; if 'error' is not NULL, *error is then set
+ * to a message which must be freed with uconvert_free(). Progress messages are discarded.
+ */
+
+/* thread pool used for encoding, resizing and quantizing; 'threads' = 0 means one per hardware thread */
+typedef struct uconvert_context uconvert_context;
+/* options of one output format */
+typedef struct uconvert_options uconvert_options;
+
+uconvert_context* uconvert_context_create(unsigned int threads, char** error);
+void uconvert_context_destroy(uconvert_context* context);
+
+/* options as on the command line, without FILEs, '-emit', '-batch' and '-out', e.g. { "-bpp", "4", "-st" } */
+uconvert_options* uconvert_options_create(int argc, const char* const* argv, char** error);
+void uconvert_options_destroy(uconvert_options* options);
+/* extension of the UIMG output file, e.g. ".bp4"; valid as long as 'options' */
+const char* uconvert_options_extension(const uconvert_options* options);
+
+/* any bitmap GraphicsMagick reads (or UIMG) into UIMG (or anything else, by the output file's extension) */
+int uconvert_convert_file(uconvert_context* context, const uconvert_options* options,
+                          const char* inputFilename, const char* outputFilename, char** error);
+/* any bitmap GraphicsMagick reads (or UIMG) in memory into UIMG in *output (free with uconvert_free()) */
+int uconvert_convert_memory(uconvert_context* context, const uconvert_options* options,
+                            const void* input, size_t inputSize, void** output, size_t* outputSize, char** error);
+
+void uconvert_free(void* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBUCONVERT_H */
@@ -0,0 +1,176 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "manifest.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <system_error>
+
+#include "hash.h"
+#include "version.h"
+
+namespace fs = std::filesystem;
+
+constexpr const char* ManifestExtension = ".manifest";
+constexpr const char* ManifestId = "uconvert-manifest 3";
+
+struct FileStamp {
+    uintmax_t   size;
+    int64_t     time;   // in file_time_type's native units
+};
+
+static std::optional<FileStamp> get_file_stamp(const std::string& filePath)
+{
+    std::error_code ec;
+
+    const uintmax_t size = fs::file_size(filePath, ec);
+    if (ec)
+        return std::nullopt;
+
+    const fs::file_time_type time = fs::last_write_time(filePath, ec);
+    if (ec)
+        return std::nullopt;
+
+    return FileStamp { size, static_cast<int64_t>(time.time_since_epoch().count()) };
+}
+
+// content hash of the fixed palette (see '-usepal'), '-' if there is none and an empty
+// string if it can't be read
+static std::string get_palette_line(const ConversionOptions& options)
+{
+    if (options.fixedPaletteFilename.empty())
+        return "palette -";
+
+    try {
+        return "palette " + to_hex(hash_file(options.fixedPaletteFilename));
+    }
+    catch (std::exception&) {
+        return "";
+    }
+}
+
+static std::string get_version_line()
+{
+    std::ostringstream oss;
+    oss << "version " << std::hex << std::setw(4) << std::setfill('0') << VERSION;
+    return oss.str();
+}
+
+bool is_up_to_date(const std::string& inputFilename, const Target& target, std::optional<uint64_t>& sourceHash)
+{
+    std::ifstream ifs(target.outputFilename + ManifestExtension);
+    if (!ifs)
+        return false;
+
+    std::string id, version, source, options, palette, dependencies, output;
+    if (!std::getline(ifs, id) || !std::getline(ifs, version) || !std::getline(ifs, source)
+            || !std::getline(ifs, options) || !std::getline(ifs, palette) || !std::getline(ifs, dependencies)
+            || !std::getline(ifs, output))
+        return false;
+
+    if (id != ManifestId || version != get_version_line() || options != "options " + get_options_signature(target.options))
+        return false;
+
+    // somebody could have deleted or overwritten it
+    const std::optional<FileStamp> outputStamp = get_file_stamp(target.outputFilename);
+    if (!outputStamp || output != "output " + std::to_string(outputStamp->size))
+        return false;
+
+    // the fixed palette's (see '-usepal') content is compared every time, its time stamp says
+    // nothing after 'cp -p', a checkout or rsync
+    if (palette != get_palette_line(target.options))
+        return false;
+
+    const std::optional<FileStamp> sourceStamp = get_file_stamp(inputFilename);
+    if (!sourceStamp)
+        return false;
+
+    std::istringstream iss(source);
+    std::string keyword, hash;
+    FileStamp recordedStamp;
+    if (!(iss >> keyword >> recordedStamp.size >> recordedStamp.time >> hash) || keyword != "source")
+        return false;
+
+    // fast path: unchanged size and time stamp, i.e. the recorded hash is still valid
+    if (recordedStamp.size == sourceStamp->size && recordedStamp.time == sourceStamp->time) {
+        try {
+            sourceHash = std::stoull(hash, nullptr, 16);
+        }
+        catch (std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // touched or re-exported but maybe with the same content
+    if (!sourceHash)
+        sourceHash = hash_file(inputFilename);
+
+    if (hash != to_hex(*sourceHash))
+        return false;
+
+    // so the next check takes the fast path again
+    write_manifest(inputFilename, target, *sourceHash, dependencies.substr(dependencies.find(' ') + 1));
+    return true;
+}
+
+bool has_dependencies(const Target& target, const std::string& dependencies)
+{
+    std::ifstream ifs(target.outputFilename + ManifestExtension);
+
+    std::string line;
+    for (int i = 0; i < 6 && std::getline(ifs, line); ++i) {
+        if (i == 5)
+            return line == "depends " + dependencies;
+    }
+
+    return false;
+}
+
+void write_manifest(const std::string& inputFilename, const Target& target, uint64_t sourceHash, const std::string& dependencies)
+{
+    const std::optional<FileStamp> sourceStamp = get_file_stamp(inputFilename);
+    const std::optional<FileStamp> outputStamp = get_file_stamp(target.outputFilename);
+    const std::string palette = get_palette_line(target.options);
+    if (!sourceStamp || !outputStamp || palette.empty())
+        return;
+
+    const std::string path = target.outputFilename + ManifestExtension;
+    const std::string tempPath = path + ".tmp";
+
+    std::ofstream ofs(tempPath);
+    ofs << ManifestId << std::endl
+        << get_version_line() << std::endl
+        << "source " << sourceStamp->size << " " << sourceStamp->time << " " << to_hex(sourceHash) << std::endl
+        << "options " << get_options_signature(target.options) << std::endl
+        << palette << std::endl
+        << "depends " << dependencies << std::endl
+        << "output " << outputStamp->size << std::endl;
+    ofs.close();
+
+    std::error_code ec;
+    if (ofs)
+        fs::rename(tempPath, path, ec);
+    if (!ofs || ec)
+        fs::remove(tempPath, ec);
+}
@@ -0,0 +1,46 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "args.h"
+
+// every output has a sidecar manifest (<output>.manifest) recording what it has been made of:
+// the source (size, time stamp and content hash), the options, the fixed palette's content hash,
+// anything else the output depends on and the uconvert version
+
+// true if the output exists and its manifest matches (except for the dependencies); the source is
+// hashed (into 'sourceHash') only if its size or time stamp doesn't match, otherwise 'sourceHash'
+// is the recorded one
+bool is_up_to_date(const std::string& inputFilename, const Target& target, std::optional<uint64_t>& sourceHash);
+
+// true if the output's manifest records 'dependencies' (as given to write_manifest())
+bool has_dependencies(const Target& target, const std::string& dependencies);
+
+// 'dependencies' is anything else the output is made of (e.g. the other frames, see '-sharedpal');
+// never throws (a missing manifest just means the output is converted again next time)
+void write_manifest(const std::string& inputFilename, const Target& target, uint64_t sourceHash, const std::string& dependencies = "-");
+
+#endif // MANIFEST_H
@@ -0,0 +1,187 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "palette.h"
+
+#include <stdexcept>
+
+#include "helpers.h"
+
+static PaletteColor decode_ste(uint32_t value)
+{
+    StePaletteEntry palEntry = {};
+    palEntry.wrapper.value = value;
+
+    // 3+1 bits per channel
+    return {
+        static_cast<uint8_t>(((palEntry.r321 << 1) | palEntry.r0) << 4),
+        static_cast<uint8_t>(((palEntry.g321 << 1) | palEntry.g0) << 4),
+        static_cast<uint8_t>(((palEntry.b321 << 1) | palEntry.b0) << 4)
+    };
+}
+
+static PaletteColor decode_tt(uint32_t value)
+{
+    TtPaletteEntry palEntry = {};
+    palEntry.wrapper.value = value;
+
+    // 4 bits per channel
+    return {
+        static_cast<uint8_t>(palEntry.r3210 << 4),
+        static_cast<uint8_t>(palEntry.g3210 << 4),
+        static_cast<uint8_t>(palEntry.b3210 << 4)
+    };
+}
+
+static PaletteColor decode_falcon(uint32_t value)
+{
+    FalconPaletteEntry palEntry = {};
+    palEntry.wrapper.value = value;
+
+    // 6+2 bits per channel
+    return {
+        static_cast<uint8_t>((palEntry.r765432 << 2) | palEntry.r10),
+        static_cast<uint8_t>((palEntry.g765432 << 2) | palEntry.g10),
+        static_cast<uint8_t>((palEntry.b765432 << 2) | palEntry.b10)
+    };
+}
+
+// r, g, b have 'paletteBits'/3 significant bits
+static uint32_t encode_ste(int16_t paletteBits, uint8_t r, uint8_t g, uint8_t b)
+{
+    StePaletteEntry palEntry = {};
+
+    switch (paletteBits) {
+    case 12:
+        palEntry.r0 = r & 0x01;
+        palEntry.g0 = g & 0x01;
+        palEntry.b0 = b & 0x01;
+        [[fallthrough]];
+    case 9:
+        // shift by 0 (9-bit ST) or 1 (12-bit STE) bits
+        palEntry.r321 = r >> ((paletteBits - 9)/3);
+        palEntry.g321 = g >> ((paletteBits - 9)/3);
+        palEntry.b321 = b >> ((paletteBits - 9)/3);
+        break;
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of palette bits: " << paletteBits
+        );
+    }
+
+    return palEntry.wrapper.value;
+}
+
+static uint32_t encode_tt(int16_t paletteBits, uint8_t r, uint8_t g, uint8_t b)
+{
+    TtPaletteEntry palEntry = {};
+
+    switch (paletteBits) {
+    case 12:
+    case 9:
+        // shift by 1 (9-bit ST) or 0 (12-bit STE) bits
+        palEntry.r3210 = r << (4 - paletteBits/3);
+        palEntry.g3210 = g << (4 - paletteBits/3);
+        palEntry.b3210 = b << (4 - paletteBits/3);
+        break;
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of palette bits: " << paletteBits
+        );
+    }
+
+    return palEntry.wrapper.value;
+}
+
+static uint32_t encode_falcon(int16_t paletteBits, uint8_t r, uint8_t g, uint8_t b)
+{
+    FalconPaletteEntry palEntry = {};
+
+    switch (paletteBits) {
+    case 24:
+        palEntry.r10 = r & 0x03;
+        palEntry.g10 = g & 0x03;
+        palEntry.b10 = b & 0x03;
+        [[fallthrough]];
+    case 18:
+        // shift by 0 (18-bit) or 2 (24-bit) bits
+        palEntry.r765432 = r >> ((paletteBits - 18)/3);
+        palEntry.g765432 = g >> ((paletteBits - 18)/3);
+        palEntry.b765432 = b >> ((paletteBits - 18)/3);
+        break;
+    case 12:
+    case 9:
+        // no need to handle the 18- vs. 24-bit difference
+        // as the bottom two bits are always zero
+        palEntry.r765432 = r << (6 - paletteBits/3);
+        palEntry.g765432 = g << (6 - paletteBits/3);
+        palEntry.b765432 = b << (6 - paletteBits/3);
+        break;
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of palette bits: " << paletteBits
+        );
+    }
+
+    return palEntry.wrapper.value;
+}
+
+struct PaletteFormat {
+    size_t          entrySize;
+    PaletteColor    (*decode)(uint32_t value);
+    uint32_t        (*encode)(int16_t paletteBits, uint8_t r, uint8_t g, uint8_t b);
+};
+
+// indexed by palette type
+static const PaletteFormat paletteFormats[] = {
+    { 0, nullptr,       nullptr       },    // no palette
+    { 2, decode_ste,    encode_ste    },
+    { 2, decode_tt,     encode_tt     },
+    { 4, decode_falcon, encode_falcon }
+};
+
+static const PaletteFormat& get_palette_format(int paletteType)
+{
+    if (paletteType < StePalette || paletteType > FalconPalette) {
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected palette type: " << paletteType
+        );
+    }
+
+    return paletteFormats[paletteType];
+}
+
+size_t get_palette_entry_size(int paletteType)
+{
+    return get_palette_format(paletteType).entrySize;
+}
+
+PaletteColor decode_palette_entry(int paletteType, uint32_t value)
+{
+    return get_palette_format(paletteType).decode(value);
+}
+
+uint32_t encode_palette_entry(int paletteType, int16_t paletteBits, const PaletteColor& color)
+{
+    // keep only as many top bits as the palette has
+    const int shift = 8 - paletteBits/3;
+
+    return get_palette_format(paletteType).encode(paletteBits, color.r >> shift, color.g >> shift, color.b >> shift);
+}
@@ -21,6 +21,7 @@
 #ifndef PALETTE_H
 #define PALETTE_H
 
+#include <cstddef>
 #include <cstdint>
 
 #include "bitfield.h"
@@ -55,4 +56,22 @@ BEGIN_BITFIELD_TYPE(StePaletteEntry, uint16_t)
     ADD_BITFIELD_MEMBER(b321,    0, 3)
 END_BITFIELD_TYPE()
 
+// palette types as stored in the UIMG flags
+constexpr int StePalette    = 0b01;
+constexpr int TtPalette     = 0b10;
+constexpr int FalconPalette = 0b11;
+
+// 8 bits per channel
+struct PaletteColor {
+    uint8_t r, g, b;
+};
+
+// 2 (ST/E, TT) or 4 (Falcon) bytes
+size_t get_palette_entry_size(int paletteType);
+// register value => colour (bits the register doesn't have are zero)
+PaletteColor decode_palette_entry(int paletteType, uint32_t value);
+// colour => register value with 'paletteBits' significant bits (throws std::invalid_argument
+// for a number of bits the palette type doesn't support)
+uint32_t encode_palette_entry(int paletteType, int16_t paletteBits, const PaletteColor& color);
+
 #endif // PALETTE_H
@@ -0,0 +1,617 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "quantize.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "uimg.h"
+#include "dither.h"
+#include "helpers.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define QUANTIZE_X86
+#include <emmintrin.h>
+#endif
+
+// at most this many pixels are used for building the palette (bigger bitmaps are sampled)
+constexpr size_t SampleCount = 1 << 18;
+// k-means works with colour cells of at most this many bits per channel
+constexpr int CellBits = 5;
+constexpr size_t MaxIterations = 16;
+// number of pixels or cells processed by one thread at once; fixed so the
+// partial sums (and therefore the result) don't depend on the thread count
+constexpr size_t QuantizeGrain = 4096;
+// direct-mapped cache of colours already mapped to the palette (per task)
+constexpr int ColorCacheBits = 10;
+constexpr size_t ColorCacheSize = size_t(1) << ColorCacheBits;
+
+struct Color {
+    float r, g, b;
+};
+
+// sums in the histogram, means while clustering
+using Cell = ColorHistogram::Cell;
+
+// palette as structure of arrays, padded with far away entries to a multiple of 4 (SIMD width)
+class ColorTable {
+public:
+    explicit ColorTable(const std::vector<Color>& colors)
+        : m_size(colors.size())
+    {
+        const size_t paddedSize = (m_size + 3) & ~size_t(3);
+        m_r.resize(paddedSize, 1e6f);
+        m_g.resize(paddedSize, 1e6f);
+        m_b.resize(paddedSize, 1e6f);
+
+        for (size_t i = 0; i < m_size; ++i) {
+            m_r[i] = colors[i].r;
+            m_g[i] = colors[i].g;
+            m_b[i] = colors[i].b;
+        }
+    }
+
+    // index of the closest colour (the lowest one if more are equally close)
+    size_t nearest(float r, float g, float b) const
+    {
+        float bestDistance = FLT_MAX;
+        size_t best = 0;
+
+#ifdef QUANTIZE_X86
+        const __m128 vr = _mm_set1_ps(r);
+        const __m128 vg = _mm_set1_ps(g);
+        const __m128 vb = _mm_set1_ps(b);
+        const __m128i four = _mm_set1_epi32(4);
+
+        __m128 bestDistances = _mm_set1_ps(FLT_MAX);
+        __m128i bestIndexes = _mm_setzero_si128();
+        __m128i indexes = _mm_setr_epi32(0, 1, 2, 3);
+
+        for (size_t i = 0; i < m_r.size(); i += 4) {
+            const __m128 dr = _mm_sub_ps(_mm_loadu_ps(&m_r[i]), vr);
+            const __m128 dg = _mm_sub_ps(_mm_loadu_ps(&m_g[i]), vg);
+            const __m128 db = _mm_sub_ps(_mm_loadu_ps(&m_b[i]), vb);
+            const __m128 distances = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+            // every lane keeps its first closest entry
+            const __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distances, bestDistances));
+            bestDistances = _mm_min_ps(distances, bestDistances);
+            bestIndexes = _mm_or_si128(_mm_and_si128(closer, indexes), _mm_andnot_si128(closer, bestIndexes));
+            indexes = _mm_add_epi32(indexes, four);
+        }
+
+        alignas(16) float laneDistances[4];
+        alignas(16) int32_t laneIndexes[4];
+        _mm_store_ps(laneDistances, bestDistances);
+        _mm_store_si128(reinterpret_cast<__m128i*>(laneIndexes), bestIndexes);
+
+        for (int lane = 0; lane < 4; ++lane) {
+            const size_t index = laneIndexes[lane];
+            if (laneDistances[lane] < bestDistance || (laneDistances[lane] == bestDistance && index < best)) {
+                bestDistance = laneDistances[lane];
+                best = index;
+            }
+        }
+#else
+        for (size_t i = 0; i < m_size; ++i) {
+            const float dr = m_r[i] - r;
+            const float dg = m_g[i] - g;
+            const float db = m_b[i] - b;
+            const float distance = (dr * dr + dg * dg) + db * db;
+
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = i;
+            }
+        }
+#endif
+
+        return best;
+    }
+
+private:
+    size_t              m_size;
+    std::vector<float>  m_r;
+    std::vector<float>  m_g;
+    std::vector<float>  m_b;
+};
+
+static double squared_distance(const Cell& cell, const Color& color)
+{
+    const double dr = cell.r - color.r;
+    const double dg = cell.g - color.g;
+    const double db = cell.b - color.b;
+    return dr * dr + dg * dg + db * db;
+}
+
+// uniformly distributed in [0, 'limit'), the same on every platform (unlike std::*_distribution)
+static double random_double(std::mt19937& rng, double limit)
+{
+    return rng() / 4294967296.0 * limit;
+}
+
+// k-means++: every next centroid is picked with a probability proportional to its weighted
+// squared distance from the closest centroid picked so far
+static std::vector<Color> pick_centroids(const std::vector<Cell>& cells, size_t count, std::mt19937& rng, ThreadPool& threadPool)
+{
+    std::vector<Color> centroids;
+    std::vector<double> distances(cells.size(), DBL_MAX);
+    std::vector<double> weights(cells.size());
+
+    for (size_t i = 0; i < cells.size(); ++i)
+        weights[i] = cells[i].weight;
+
+    while (centroids.size() < count) {
+        double total = 0;
+        for (double weight : weights)
+            total += weight;
+
+        // all the remaining cells are centroids already
+        if (total == 0)
+            break;
+
+        const double target = random_double(rng, total);
+        size_t picked = 0;
+        double sum = 0;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (weights[i] == 0)
+                continue;
+
+            picked = i;
+            sum += weights[i];
+            if (sum > target)
+                break;
+        }
+
+        const Color centroid { float(cells[picked].r), float(cells[picked].g), float(cells[picked].b) };
+        centroids.push_back(centroid);
+
+        threadPool.parallel_for(cells.size(), QuantizeGrain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                distances[i] = std::min(distances[i], squared_distance(cells[i], centroid));
+                weights[i] = cells[i].weight * distances[i];
+            }
+        });
+    }
+
+    return centroids;
+}
+
+// Lloyd's iterations
+static void refine_centroids(const std::vector<Cell>& cells, std::vector<Color>& centroids, ThreadPool& threadPool)
+{
+    const size_t chunks = (cells.size() + QuantizeGrain - 1) / QuantizeGrain;
+    std::vector<uint32_t> assignments(cells.size(), UINT32_MAX);
+
+    for (size_t iteration = 0; iteration < MaxIterations; ++iteration) {
+        const ColorTable table(centroids);
+        std::vector<std::vector<Cell>> partialSums(chunks, std::vector<Cell>(centroids.size()));
+        std::atomic<size_t> changes { 0 };
+
+        threadPool.parallel_for(cells.size(), QuantizeGrain, [&](size_t begin, size_t end) {
+            std::vector<Cell>& sums = partialSums[begin / QuantizeGrain];
+            size_t chunkChanges = 0;
+
+            for (size_t i = begin; i < end; ++i) {
+                const Cell& cell = cells[i];
+                const uint32_t nearest = table.nearest(cell.r, cell.g, cell.b);
+
+                if (assignments[i] != nearest) {
+                    assignments[i] = nearest;
+                    chunkChanges++;
+                }
+
+                sums[nearest].r += cell.r * cell.weight;
+                sums[nearest].g += cell.g * cell.weight;
+                sums[nearest].b += cell.b * cell.weight;
+                sums[nearest].weight += cell.weight;
+            }
+
+            changes += chunkChanges;
+        });
+
+        if (changes == 0)
+            break;
+
+        for (size_t j = 0; j < centroids.size(); ++j) {
+            // always in the same order
+            Cell sum;
+            for (const std::vector<Cell>& sums : partialSums) {
+                sum.r += sums[j].r;
+                sum.g += sums[j].g;
+                sum.b += sums[j].b;
+                sum.weight += sums[j].weight;
+            }
+
+            // an empty cluster keeps its centroid
+            if (sum.weight > 0)
+                centroids[j] = { float(sum.r / sum.weight), float(sum.g / sum.weight), float(sum.b / sum.weight) };
+        }
+    }
+}
+
+// top 'bits' bits of every channel as 0xRRGGBB
+static uint32_t reduce_color(const Magick::PixelPacket& pixelPacket, uint8_t mask)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    return (uint32_t((pixelPacket.red >> shift) & mask) << 16)
+        | (uint32_t((pixelPacket.green >> shift) & mask) << 8)
+        | uint32_t((pixelPacket.blue >> shift) & mask);
+}
+
+static int get_channel_bits(const ConversionOptions& options)
+{
+    return options.paletteBits ? options.paletteBits / 3 : 8;
+}
+
+ColorHistogram::ColorHistogram(const ConversionOptions& options)
+    : m_bits(get_channel_bits(options))
+    , m_cellBits(std::min(m_bits, CellBits))
+    , m_seed(options.seed)
+    , m_cells(size_t(1) << (3 * m_cellBits))
+{
+}
+
+void ColorHistogram::add(const Magick::Image& image)
+{
+    const size_t pixels = size_t(image.columns()) * image.rows();
+    const uint8_t mask = 0xff << (8 - m_bits);
+    const Magick::PixelPacket* pPixelPackets = image.getConstPixels(0, 0, image.columns(), image.rows());
+
+    std::mt19937 rng(m_seed);
+    std::vector<uint32_t> colors(std::min(pixels, SampleCount));
+    m_sampled |= pixels > SampleCount;
+
+    for (size_t i = 0; i < colors.size(); ++i) {
+        const size_t index = pixels > SampleCount ? ((uint64_t(rng()) << 32) | rng()) % pixels : i;
+        const uint32_t color = reduce_color(pPixelPackets[index], mask);
+        colors[i] = color;
+
+        const uint8_t r = color >> 16;
+        const uint8_t g = color >> 8;
+        const uint8_t b = color;
+
+        Cell& cell = m_cells[((r >> (8 - m_cellBits)) << (2 * m_cellBits)) | ((g >> (8 - m_cellBits)) << m_cellBits) | (b >> (8 - m_cellBits))];
+        cell.r += r;
+        cell.g += g;
+        cell.b += b;
+        cell.weight++;
+    }
+
+    std::sort(colors.begin(), colors.end());
+    colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
+
+    std::vector<uint32_t> merged;
+    std::set_union(m_colors.begin(), m_colors.end(), colors.begin(), colors.end(), std::back_inserter(merged));
+    m_colors.swap(merged);
+}
+
+void ColorHistogram::add(const ColorHistogram& other)
+{
+    for (size_t i = 0; i < m_cells.size(); ++i) {
+        m_cells[i].r += other.m_cells[i].r;
+        m_cells[i].g += other.m_cells[i].g;
+        m_cells[i].b += other.m_cells[i].b;
+        m_cells[i].weight += other.m_cells[i].weight;
+    }
+    m_sampled |= other.m_sampled;
+
+    std::vector<uint32_t> merged;
+    std::set_union(m_colors.begin(), m_colors.end(), other.m_colors.begin(), other.m_colors.end(), std::back_inserter(merged));
+    m_colors.swap(merged);
+}
+
+std::vector<PaletteColor> ColorHistogram::build_palette(size_t paletteSize, ThreadPool& threadPool) const
+{
+    std::vector<PaletteColor> palette;
+
+    // nothing to do
+    if (m_colors.size() <= paletteSize) {
+        for (uint32_t color : m_colors)
+            palette.push_back({ uint8_t(color >> 16), uint8_t(color >> 8), uint8_t(color) });
+        return palette;
+    }
+
+    std::vector<Cell> cells;
+    for (const Cell& cell : m_cells) {
+        if (cell.weight > 0)
+            cells.push_back({ cell.r / cell.weight, cell.g / cell.weight, cell.b / cell.weight, cell.weight });
+    }
+
+    std::mt19937 rng(m_seed);
+    std::vector<Color> centroids = pick_centroids(cells, paletteSize, rng, threadPool);
+    refine_centroids(cells, centroids, threadPool);
+
+    // the closest colour the target palette can show
+    const int step = 1 << (8 - m_bits);
+    auto closest = [step](float value) {
+        return uint8_t(std::min<long>(std::lround(value / step), (256 / step) - 1) * step);
+    };
+
+    for (const Color& centroid : centroids)
+        palette.push_back({ closest(centroid.r), closest(centroid.g), closest(centroid.b) });
+
+    return palette;
+}
+
+std::vector<PaletteColor> get_palette(const Magick::Image& image)
+{
+    std::vector<PaletteColor> colors(image.colorMapSize());
+
+    for (size_t i = 0; i < colors.size(); ++i) {
+        const Magick::Color color = image.colorMap(i);
+
+        constexpr size_t shift = QuantumDepth - 8;
+        colors[i].r = color.redQuantum()   >> shift;
+        colors[i].g = color.greenQuantum() >> shift;
+        colors[i].b = color.blueQuantum()  >> shift;
+    }
+
+    return colors;
+}
+
+// replaces 'image' with a PseudoClass image using 'palette'; 'map_range(pPixelPackets, pIndexPackets, begin, end)'
+// stores the palette index of every pixel in a range of the (whole) images, called from several threads at once
+template<typename MapRange>
+static void remap_pixels(Magick::Image& image, const std::vector<PaletteColor>& palette, ThreadPool& threadPool, MapRange map_range)
+{
+    const size_t columns = image.columns();
+    const size_t rows = image.rows();
+    const Magick::PixelPacket* pPixelPackets = image.getConstPixels(0, 0, columns, rows);
+
+    Magick::Image remapped({static_cast<unsigned int>(columns), static_cast<unsigned int>(rows)}, {0, 0, 0});
+    remapped.classType(Magick::PseudoClass);
+    remapped.type(Magick::PaletteType);
+    remapped.colorMapSize(palette.size());
+
+    std::vector<Magick::PixelPacket> palettePixelPackets(palette.size());
+    for (size_t i = 0; i < palette.size(); ++i) {
+        constexpr size_t shift = QuantumDepth - 8;
+
+        Magick::PixelPacket& pixelPacket = palettePixelPackets[i];
+        pixelPacket.red     = palette[i].r << shift;
+        pixelPacket.green   = palette[i].g << shift;
+        pixelPacket.blue    = palette[i].b << shift;
+        pixelPacket.opacity = 0;
+
+        Magick::Color color;
+        color.redQuantum(   pixelPacket.red   );
+        color.greenQuantum( pixelPacket.green );
+        color.blueQuantum(  pixelPacket.blue  );
+        remapped.colorMap(i, color);
+    }
+
+    Magick::PixelPacket* pRemappedPixelPackets = remapped.getPixels(0, 0, columns, rows);
+    Magick::IndexPacket* pRemappedIndexPackets = remapped.getIndexes();
+
+    threadPool.parallel_for(columns * rows, QuantizeGrain, [&](size_t begin, size_t end) {
+        map_range(pPixelPackets, pRemappedIndexPackets, begin, end);
+
+        for (size_t i = begin; i < end; ++i)
+            pRemappedPixelPackets[i] = palettePixelPackets[pRemappedIndexPackets[i]];
+    });
+
+    remapped.syncPixels();
+    image = remapped;
+}
+
+// replaces 'image' with a PseudoClass image using 'palette' and the given palette indexes
+static void remap_pixels(Magick::Image& image, const std::vector<PaletteColor>& palette, const std::vector<uint8_t>& indexes, ThreadPool& threadPool)
+{
+    remap_pixels(image, palette, threadPool, [&](const Magick::PixelPacket*, Magick::IndexPacket* pIndexPackets, size_t begin, size_t end) {
+        std::copy(&indexes[begin], &indexes[end], &pIndexPackets[begin]);
+    });
+}
+
+PaletteMapper::PaletteMapper(const std::vector<PaletteColor>& palette, const ConversionOptions& options)
+    : m_palette(palette)
+    , m_mask(0xff << (8 - get_channel_bits(options)))
+{
+    std::vector<Color> colors(palette.size());
+    for (size_t i = 0; i < palette.size(); ++i)
+        colors[i] = { float(palette[i].r), float(palette[i].g), float(palette[i].b) };
+
+    m_table = std::make_shared<const ColorTable>(colors);
+}
+
+PaletteMapper::PaletteMapper(std::shared_ptr<const InverseColormap> inverseColormap)
+    : m_palette(inverseColormap->palette())
+    , m_inverseColormap(std::move(inverseColormap))
+{
+}
+
+void PaletteMapper::map(const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t count, ThreadPool& threadPool) const
+{
+    threadPool.parallel_for(count, QuantizeGrain, [&](size_t begin, size_t end) {
+        map_range(pPixelPackets + begin, pIndexPackets + begin, end - begin);
+    });
+}
+
+void PaletteMapper::map_range(const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t count) const
+{
+    if (m_inverseColormap) {
+        for (size_t i = 0; i < count; ++i)
+            pIndexPackets[i] = m_inverseColormap->nearest(pPixelPackets[i]);
+        return;
+    }
+
+    // recently seen colours (most bitmaps have far fewer colours than pixels)
+    std::array<uint32_t, ColorCacheSize> cachedColors;
+    std::array<uint16_t, ColorCacheSize> cachedIndexes;
+    cachedColors.fill(UINT32_MAX);
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t color = reduce_color(pPixelPackets[i], m_mask);
+        const size_t slot = (color * 2654435761u) >> (32 - ColorCacheBits);
+
+        if (cachedColors[slot] != color) {
+            cachedColors[slot] = color;
+            cachedIndexes[slot] = m_table->nearest(uint8_t(color >> 16), uint8_t(color >> 8), uint8_t(color));
+        }
+
+        pIndexPackets[i] = cachedIndexes[slot];
+    }
+}
+
+void remap_image(Magick::Image& image, const std::vector<PaletteColor>& palette, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    if (is_diffusing_error(options)) {
+        const InverseColormap inverseColormap(palette, options, threadPool);
+        remap_pixels(image, palette, diffuse_error(image, inverseColormap, options, threadPool), threadPool);
+        return;
+    }
+
+    const PaletteMapper mapper(palette, options);
+
+    remap_pixels(image, palette, threadPool, [&](const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t begin, size_t end) {
+        mapper.map_range(pPixelPackets + begin, pIndexPackets + begin, end - begin);
+    });
+}
+
+InverseColormap::InverseColormap(const std::vector<PaletteColor>& palette, const ConversionOptions& options, ThreadPool& threadPool)
+    : m_palette(palette)
+    , m_bits(std::min(get_channel_bits(options), InverseColormapBits))
+    , m_table(size_t(1) << (3 * m_bits))
+{
+    std::vector<Color> colors(palette.size());
+    for (size_t i = 0; i < palette.size(); ++i)
+        colors[i] = { float(palette[i].r), float(palette[i].g), float(palette[i].b) };
+
+    const ColorTable table(colors);
+
+    // every cell stands for the target palette's colours inside it, represented by their middle
+    // one (i.e. exactly the one colour if the table isn't coarser than the target palette)
+    const int channelBits = get_channel_bits(options);
+    const int offset = ((1 << (8 - m_bits)) - (1 << (8 - channelBits))) / 2;
+    const size_t levels = size_t(1) << m_bits;
+
+    threadPool.parallel_for(m_table.size(), QuantizeGrain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const float r = ((i >> (2 * m_bits)) << (8 - m_bits)) + offset;
+            const float g = (((i >> m_bits) & (levels - 1)) << (8 - m_bits)) + offset;
+            const float b = ((i & (levels - 1)) << (8 - m_bits)) + offset;
+
+            m_table[i] = table.nearest(r, g, b);
+        }
+    });
+}
+
+void remap_image(Magick::Image& image, const InverseColormap& inverseColormap, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    if (is_diffusing_error(options)) {
+        remap_pixels(image, inverseColormap.palette(), diffuse_error(image, inverseColormap, options, threadPool), threadPool);
+        return;
+    }
+
+    remap_pixels(image, inverseColormap.palette(), threadPool, [&](const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            pIndexPackets[i] = inverseColormap.nearest(pPixelPackets[i]);
+    });
+}
+
+static std::shared_ptr<const InverseColormap> read_inverse_colormap(const std::string& filename, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    const UimgView view(filename);
+
+    if (view.paletteSize() == 0)
+        throw_oss<std::invalid_argument>(std::ostringstream() << "File " << filename << " has no palette.");
+
+    std::vector<PaletteColor> palette(view.paletteSize());
+    for (size_t i = 0; i < palette.size(); ++i)
+        palette[i] = view.paletteColor(i);
+
+    return std::make_shared<const InverseColormap>(palette, options, threadPool);
+}
+
+std::shared_ptr<const InverseColormap> load_inverse_colormap(const std::string& filename, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    using Key = std::pair<std::string, int16_t>;
+    using Future = std::shared_future<std::shared_ptr<const InverseColormap>>;
+
+    static std::mutex mutex;
+    static std::map<Key, Future> inverseColormaps;
+
+    const Key key { filename, options.paletteBits };
+    std::promise<std::shared_ptr<const InverseColormap>> promise;
+    Future future;
+    bool building = false;
+
+    // only the lookup is locked; the first caller builds the map, the others with the same
+    // palette wait for it and conversions with other palettes aren't held up at all
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = inverseColormaps.find(key);
+        if (it == inverseColormaps.end()) {
+            it = inverseColormaps.emplace(key, promise.get_future().share()).first;
+            building = true;
+        }
+        future = it->second;
+    }
+
+    if (building) {
+        try {
+            promise.set_value(read_inverse_colormap(filename, options, threadPool));
+        } catch (...) {
+            // the waiting ones fail as well but the next call tries again
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inverseColormaps.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    const std::shared_ptr<const InverseColormap> inverseColormap = future.get();
+
+    // on every call, the map is shared by conversions into different bpp
+    const size_t paletteSize = inverseColormap->palette().size();
+    if (paletteSize > (size_t(1) << options.bitsPerPixel))
+        throw_oss<std::invalid_argument>(std::ostringstream() << "Palette in " << filename << " has " << paletteSize
+            << " colours, " << options.bitsPerPixel << " bpp allows only " << (1 << options.bitsPerPixel) << ".");
+
+    return inverseColormap;
+}
+
+ColorHistogram quantize_native(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    ColorHistogram histogram(options);
+    histogram.add(image);
+
+    remap_image(image, histogram.build_palette(size_t(1) << options.bitsPerPixel, threadPool), options, threadPool);
+
+    return histogram;
+}
@@ -0,0 +1,144 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+#include "args.h"
+#include "palette.h"
+#include "threadpool.h"
+
+// colours of one or more images reduced to the target palette's colour space (paletteBits),
+// i.e. only colours the target palette can show; big images are sampled
+class ColorHistogram {
+public:
+    // all pixels of similar colour
+    struct Cell {
+        double r = 0, g = 0, b = 0;     // sums
+        double weight = 0;              // number of pixels
+    };
+
+    explicit ColorHistogram(const ConversionOptions& options);
+
+    void add(const Magick::Image& image);
+    void add(const ColorHistogram& other);
+
+    // of the sample only if a bitmap was too big to be added pixel by pixel, i.e. a lower bound
+    size_t distinct_colors() const { return m_colors.size(); }
+    bool sampled() const { return m_sampled; }
+
+    // at most 'paletteSize' colours (k-means), every one of them exactly representable in the
+    // target palette; depends only on the added images (in order) and the seed, not on the
+    // number of threads
+    std::vector<PaletteColor> build_palette(size_t paletteSize, ThreadPool& threadPool) const;
+
+private:
+    int                     m_bits;         // per channel
+    int                     m_cellBits;     // per channel
+    int16_t                 m_seed;
+    bool                    m_sampled = false;
+    std::vector<uint32_t>   m_colors;       // distinct 0xRRGGBB values, sorted
+    std::vector<Cell>       m_cells;
+};
+
+// colour map of a PseudoClass image in 8 bits per channel
+std::vector<PaletteColor> get_palette(const Magick::Image& image);
+
+// replaces 'image' with a PseudoClass image using 'palette' (closest colour for every pixel
+// or error diffusion, see options.errorDiffusion)
+void remap_image(Magick::Image& image, const std::vector<PaletteColor>& palette, const ConversionOptions& options, ThreadPool& threadPool);
+
+// nearest colour of a fixed palette for every colour of the target palette's colour space
+// (paletteBits), searched once so that remapping costs one lookup per pixel; with more than
+// InverseColormapBits per channel (24-bit palette), the cells are coarser than the colour space
+class InverseColormap {
+public:
+    static constexpr int InverseColormapBits = 6;
+
+    InverseColormap(const std::vector<PaletteColor>& palette, const ConversionOptions& options, ThreadPool& threadPool);
+
+    const std::vector<PaletteColor>& palette() const { return m_palette; }
+
+    uint8_t nearest(uint8_t r, uint8_t g, uint8_t b) const
+    {
+        const int cellShift = 8 - m_bits;
+
+        return m_table[(size_t(r >> cellShift) << (2 * m_bits)) | (size_t(g >> cellShift) << m_bits) | size_t(b >> cellShift)];
+    }
+
+    uint8_t nearest(const Magick::PixelPacket& pixelPacket) const
+    {
+        constexpr size_t shift = QuantumDepth - 8;
+
+        return nearest(pixelPacket.red >> shift, pixelPacket.green >> shift, pixelPacket.blue >> shift);
+    }
+
+private:
+    std::vector<PaletteColor>   m_palette;
+    int                         m_bits;         // per channel
+    std::vector<uint8_t>        m_table;        // palette indexes, red is the most significant
+};
+
+// replaces 'image' with a PseudoClass image using the inverse colormap's palette (with error
+// diffusion if options.errorDiffusion is set)
+void remap_image(Magick::Image& image, const InverseColormap& inverseColormap, const ConversionOptions& options, ThreadPool& threadPool);
+
+class ColorTable;
+
+// maps pixels to palette indexes exactly like remap_image() without error diffusion, any range
+// at a time (e.g. a band of rows, see '-band'), so the remapped image needn't exist as a whole
+class PaletteMapper {
+public:
+    // closest colour of 'palette' (to the pixel reduced to the target palette's colour space)
+    PaletteMapper(const std::vector<PaletteColor>& palette, const ConversionOptions& options);
+    // nearest colour of the inverse colormap
+    explicit PaletteMapper(std::shared_ptr<const InverseColormap> inverseColormap);
+
+    const std::vector<PaletteColor>& palette() const { return m_palette; }
+
+    // 'count' pixels, in parallel
+    void map(const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t count, ThreadPool& threadPool) const;
+    // 'count' pixels on the calling thread
+    void map_range(const Magick::PixelPacket* pPixelPackets, Magick::IndexPacket* pIndexPackets, size_t count) const;
+
+private:
+    std::vector<PaletteColor>               m_palette;
+    uint8_t                                 m_mask = 0;
+    std::shared_ptr<const ColorTable>       m_table;            // either the palette...
+    std::shared_ptr<const InverseColormap>  m_inverseColormap;  // ... or its inverse colormap
+};
+
+// palette of a UIMG file (palette only, as saved by '-palout', or with a bitmap) with its inverse
+// colormap; built only once per file and target palette for all the conversions in the process
+std::shared_ptr<const InverseColormap> load_inverse_colormap(const std::string& filename, const ConversionOptions& options, ThreadPool& threadPool);
+
+// both of the first two for a single image, i.e. a palette of at most 1 << bitsPerPixel colours;
+// returns the histogram the palette was built from
+ColorHistogram quantize_native(Magick::Image& image, const ConversionOptions& options, ThreadPool& threadPool);
+
+#endif // QUANTIZE_H
@@ -0,0 +1,513 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "reference.h"
+
+#include <cassert>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include "helpers.h"
+
+using namespace Magick;
+
+// The loops below are the baseline's c2p(), copy_buffer(), copy_packed_buffer(), save_palette()
+// (uconvert.cpp) and load_uimg() (uimg.cpp) as they were, only with the option globals turned
+// into parameters, Magick::Image into plain arrays and std::ofstream / std::ifstream into byte
+// vectors. Two changes to the format were deliberate since, and reference_encode() /
+// reference_load_uimg() apply them on top of the baseline result as expected deltas:
+//
+//  1. a 3-byte chunk is three bytes: the baseline used uint32_t and so wrote four for anything
+//     but 24 bpp (whose leading byte it skipped), i.e. one leading zero byte too many
+//  2. 24 bpp in a 4-byte chunk is 0RGB: the baseline skipped the leading byte there, too, and
+//     wrote RGB
+//
+// and, as a chunk may be wider than its value, a value is in the chunk's least significant
+// bytes when reading it back (the baseline went by the chunk width alone: an index in two
+// bytes was taken for RGB565 etc.).
+
+void reference_c2p(const uint8_t* pIndexes, size_t pixels, int bitsPerPixel, std::vector<uint8_t>& buffer)
+{
+    const uint8_t* pIndexPackets = pIndexes;
+
+    for (const uint8_t* pIndexPacketsEnd = pIndexPackets + pixels;
+         pIndexPackets != pIndexPacketsEnd; pIndexPackets += 16)
+    {
+        std::vector<uint16_t> planes(bitsPerPixel); // 16 pixels = 16 bits x bit depth
+
+        for (size_t i = 0; i < 16; ++i) {
+            uint8_t paletteIndex = pIndexPackets[i];
+
+            for (int j = 0; j < bitsPerPixel; ++j) {
+                planes[j] |= ((paletteIndex >> j) & 1) << (15 - i);
+            }
+        }
+
+        for (int i = 0; i < bitsPerPixel; ++i) {
+            buffer.push_back(planes[i] >> 8);    // MSB
+            buffer.push_back(planes[i]);         // LSB
+        }
+    }
+}
+
+// the planar case of load_uimg()
+void reference_p2c(const uint8_t* pPlanar, size_t pixels, int bitsPerPixel, std::vector<uint8_t>& indexes)
+{
+    for (size_t pixel = 0; pixel < pixels; pixel += 16) {
+        std::vector<uint16_t> planes(bitsPerPixel);  // 16 pixels = 16 bits x bit depth
+        for (size_t i = 0; i < planes.size(); ++i) {
+            uint16_t plane = 0;
+            plane |= *pPlanar++;
+            plane <<= 8;
+            plane |= *pPlanar++;
+            planes[i] = plane;
+        }
+
+        for (size_t i = 0; i < 16; ++i) {
+            uint8_t index = 0;
+
+            for (size_t j = 0; j < size_t(bitsPerPixel); ++j) {
+                index |= ((planes[j] >> (15 - i)) & 1) << j;
+            }
+
+            indexes.push_back(index);
+        }
+    }
+}
+
+template<typename T>
+static void copy_buffer(std::vector<uint8_t>& buffer, const PixelPacket* pPixelPackets, const IndexPacket* pIndexPackets,
+                        size_t pixels, int16_t bitsPerPixel)
+{
+    T chunk = 0;
+
+    for (const PixelPacket* pPixelPacketsEnd = pPixelPackets + pixels;
+         pPixelPackets != pPixelPacketsEnd; pPixelPackets++)
+    {
+        switch (bitsPerPixel) {
+        case 1:
+        case 2:
+        case 4:
+        case 6:
+        case 8: {
+            chunk = *pIndexPackets++;
+        } break;
+
+        case 16: {
+            constexpr size_t shift = QuantumDepth - 8;
+
+            const uint8_t r = (pPixelPackets->red   >> shift) >> (8 - 5);
+            const uint8_t g = (pPixelPackets->green >> shift) >> (8 - 6);
+            const uint8_t b = (pPixelPackets->blue  >> shift) >> (8 - 5);
+            chunk = (r << 11) | (g << 5) | b;
+        } break;
+
+        case 24:
+        case 32: {
+            constexpr size_t shift = QuantumDepth - 8;
+
+            const uint8_t a = pPixelPackets->opacity >> shift;
+            const uint8_t r = pPixelPackets->red     >> shift;
+            const uint8_t g = pPixelPackets->green   >> shift;
+            const uint8_t b = pPixelPackets->blue    >> shift;
+            chunk = (a << 24) | (r << 16) | (g << 8) | b;    // ARGB
+        } break;
+
+        default:
+            throw_oss<std::invalid_argument>(std::ostringstream()
+                << "Unexpected number of bit per pixel: " << bitsPerPixel
+            );
+        }
+
+        int shift = (sizeof(T) - 1) * 8;    // go from MSB to LSB
+        while (shift >= 0) {
+            // quick hack to skip opacity
+            if (bitsPerPixel != 24 || shift != int((sizeof(T) - 1) * 8)) {
+                buffer.push_back(chunk >> shift);
+            }
+            shift -= 8;
+        };
+    }
+}
+
+static void copy_packed_buffer(std::vector<uint8_t>& buffer, const IndexPacket* pIndexPackets, size_t pixels, int16_t bitsPerPixel)
+{
+    const size_t pixelsPerChunk = 8 / bitsPerPixel;
+
+    for (const IndexPacket* pIndexPacketsEnd = pIndexPackets + pixels;
+         pIndexPackets != pIndexPacketsEnd;)
+    {
+        uint8_t chunk = 0;
+        for (size_t i = 0; i < pixelsPerChunk - 1; ++i) {
+            assert(*pIndexPackets < (1 << bitsPerPixel));
+            chunk += *pIndexPackets++;
+            chunk <<= bitsPerPixel;
+        }
+        assert(*pIndexPackets < (1 << bitsPerPixel));
+        chunk += *pIndexPackets++;
+
+        buffer.push_back(chunk);
+    }
+}
+
+void reference_encode(const PixelPacket* pPixelPackets, const IndexPacket* pIndexPackets, size_t pixels,
+                      int16_t bitsPerPixel, int16_t bytesPerChunk, std::vector<uint8_t>& buffer)
+{
+    // packed 8+ bpp is the same as chunky (the baseline's args.cpp turned it into bpp/8 bytes per chunk)
+    if (bytesPerChunk == -1 && bitsPerPixel >= 8)
+        bytesPerChunk = bitsPerPixel / 8;
+
+    std::vector<uint8_t> atariImage;
+
+    if (!bytesPerChunk) {
+        std::vector<uint8_t> indexes(pIndexPackets, pIndexPackets + pixels);
+        reference_c2p(indexes.data(), pixels, bitsPerPixel, atariImage);
+    } else if (bytesPerChunk == 1) {
+        copy_buffer<uint8_t>(atariImage, pPixelPackets, pIndexPackets, pixels, bitsPerPixel);
+    } else if (bytesPerChunk == 2) {
+        copy_buffer<uint16_t>(atariImage, pPixelPackets, pIndexPackets, pixels, bitsPerPixel);
+    } else if (bytesPerChunk == 3) {
+        copy_buffer<uint32_t>(atariImage, pPixelPackets, pIndexPackets, pixels, bitsPerPixel);
+    } else if (bytesPerChunk == 4) {
+        copy_buffer<uint32_t>(atariImage, pPixelPackets, pIndexPackets, pixels, bitsPerPixel);
+    } else if (bytesPerChunk == -1) {
+        copy_packed_buffer(atariImage, pIndexPackets, pixels, bitsPerPixel);
+    } else {
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of bytes per chunk: " << bytesPerChunk
+        );
+    }
+
+    if (bytesPerChunk == 3 && bitsPerPixel != 24) {
+        // expected delta 1: drop the leading (zero) byte of every four
+        for (size_t i = 0; i < atariImage.size(); i += 4) {
+            if (atariImage[i] != 0)
+                throw std::logic_error("Unexpected non-zero byte in a 3-byte chunk.");
+            buffer.insert(buffer.end(), atariImage.begin() + i + 1, atariImage.begin() + i + 4);
+        }
+    } else if (bytesPerChunk == 4 && bitsPerPixel == 24) {
+        // expected delta 2: RGB -> 0RGB
+        for (size_t i = 0; i < atariImage.size(); i += 3) {
+            buffer.push_back(0);
+            buffer.insert(buffer.end(), atariImage.begin() + i, atariImage.begin() + i + 3);
+        }
+    } else {
+        buffer.insert(buffer.end(), atariImage.begin(), atariImage.end());
+    }
+}
+
+template<typename T>
+static void save_palette(std::vector<uint8_t>& buffer, const std::vector<PaletteColor>& colors, int16_t paletteBits, const size_t paletteSize)
+{
+    std::vector<T> pal(paletteSize);
+
+    for (size_t i = 0; i < colors.size(); ++i) {
+        const PaletteColor& color = colors[i];
+
+        const uint8_t r = color.r >> (8 - paletteBits/3);
+        const uint8_t g = color.g >> (8 - paletteBits/3);
+        const uint8_t b = color.b >> (8 - paletteBits/3);
+
+        if constexpr (std::is_same_v<T, FalconPaletteEntry>) {
+            switch (paletteBits) {
+            case 24:
+                pal[i].r10 = r & 0x03;
+                pal[i].g10 = g & 0x03;
+                pal[i].b10 = b & 0x03;
+                [[fallthrough]];
+            case 18:
+                // shift by 0 (18-bit) or 2 (24-bit) bits
+                pal[i].r765432 = r >> ((paletteBits - 18)/3);
+                pal[i].g765432 = g >> ((paletteBits - 18)/3);
+                pal[i].b765432 = b >> ((paletteBits - 18)/3);
+                break;
+            case 12:
+            case 9:
+                // no need to handle the 18- vs. 24-bit difference
+                // as the bottom two bits are always zero
+                pal[i].r765432 = r << (6 - paletteBits/3);
+                pal[i].g765432 = g << (6 - paletteBits/3);
+                pal[i].b765432 = b << (6 - paletteBits/3);
+                break;
+            default:
+                throw_oss<std::invalid_argument>(std::ostringstream()
+                    << "Unexpected number of palette bits: " << paletteBits
+                );
+            }
+        } else if constexpr (std::is_same_v<T, TtPaletteEntry>) {
+            switch (paletteBits) {
+            case 12:
+            case 9:
+                // shift by 1 (9-bit ST) or 0 (12-bit STE) bits
+                pal[i].r3210 = r << (4 - paletteBits/3);
+                pal[i].g3210 = g << (4 - paletteBits/3);
+                pal[i].b3210 = b << (4 - paletteBits/3);
+                break;
+            default:
+                throw_oss<std::invalid_argument>(std::ostringstream()
+                    << "Unexpected number of palette bits: " << paletteBits
+                );
+            }
+        } else if constexpr (std::is_same_v<T, StePaletteEntry>) {
+            switch (paletteBits) {
+            case 12:
+                pal[i].r0 = r & 0x01;
+                pal[i].g0 = g & 0x01;
+                pal[i].b0 = b & 0x01;
+                [[fallthrough]];
+            case 9:
+                // shift by 0 (9-bit ST) or 1 (12-bit STE) bits
+                pal[i].r321 = r >> ((paletteBits - 9)/3);
+                pal[i].g321 = g >> ((paletteBits - 9)/3);
+                pal[i].b321 = b >> ((paletteBits - 9)/3);
+                break;
+            default:
+                throw_oss<std::invalid_argument>(std::ostringstream()
+                    << "Unexpected number of palette bits: " << paletteBits
+                );
+            }
+        } else
+            static_assert(bool_value<false, T>::value, "Unsupported palette type");
+    }
+
+    for (const auto& pal_entry : pal) {
+        if constexpr (std::is_same_v<T, FalconPaletteEntry>) {
+            buffer.push_back(pal_entry.wrapper.value >> 24); // MSB
+            buffer.push_back(pal_entry.wrapper.value >> 16);
+            buffer.push_back(pal_entry.wrapper.value >>  8);
+            buffer.push_back(pal_entry.wrapper.value);   // LSB
+        } else if constexpr (std::is_same_v<T, TtPaletteEntry> || std::is_same_v<T, StePaletteEntry>) {
+            buffer.push_back(pal_entry.wrapper.value >> 8);  // MSB
+            buffer.push_back(pal_entry.wrapper.value);   // LSB
+        } else
+            static_assert(bool_value<false, T>::value, "Unsupported palette type");
+    }
+}
+
+void reference_save_palette(int paletteType, int16_t paletteBits, const std::vector<PaletteColor>& colors, size_t paletteSize,
+                            std::vector<uint8_t>& buffer)
+{
+    if (colors.size() > paletteSize)
+        throw std::invalid_argument("More colours than palette entries.");
+
+    switch (paletteType) {
+    case StePalette:
+        save_palette<StePaletteEntry>(buffer, colors, paletteBits, paletteSize);
+        break;
+    case TtPalette:
+        save_palette<TtPaletteEntry>(buffer, colors, paletteBits, paletteSize);
+        break;
+    case FalconPalette:
+        save_palette<FalconPaletteEntry>(buffer, colors, paletteBits, paletteSize);
+        break;
+    default:
+        throw std::invalid_argument("Unexpected palette type.");
+    }
+}
+
+uint32_t reference_palette_entry(int paletteType, int16_t paletteBits, const PaletteColor& color)
+{
+    std::vector<uint8_t> buffer;
+    reference_save_palette(paletteType, paletteBits, { color }, 1, buffer);
+
+    uint32_t value = 0;
+    for (uint8_t byte : buffer)
+        value = (value << 8) | byte;
+    return value;
+}
+
+// the palette cases of load_uimg(), 8 bits per channel instead of QuantumDepth
+PaletteColor reference_palette_color(int paletteType, uint32_t value)
+{
+    switch (paletteType) {
+    case StePalette: {
+        // ST/E compatible palette
+        StePaletteEntry palEntry = {};
+        palEntry.wrapper.value = value;
+
+        constexpr size_t shift = 8 - (3+1);  // 3+1 bits per channel
+        return {
+            uint8_t( ((palEntry.r321 << 1) | palEntry.r0) << shift ),
+            uint8_t( ((palEntry.g321 << 1) | palEntry.g0) << shift ),
+            uint8_t( ((palEntry.b321 << 1) | palEntry.b0) << shift )
+        };
+    }
+
+    case TtPalette: {
+        // TT compatible palette
+        TtPaletteEntry palEntry = {};
+        palEntry.wrapper.value = value;
+
+        constexpr size_t shift = 8 - 4;  // 4 bits per channel
+        return { uint8_t( palEntry.r3210 << shift ), uint8_t( palEntry.g3210 << shift ), uint8_t( palEntry.b3210 << shift ) };
+    }
+
+    case FalconPalette: {
+        // Falcon compatible palette
+        FalconPaletteEntry palEntry = {};
+        palEntry.wrapper.value = value;
+
+        // 8 bits per channel
+        return {
+            uint8_t( (palEntry.r765432 << 2) | palEntry.r10 ),
+            uint8_t( (palEntry.g765432 << 2) | palEntry.g10 ),
+            uint8_t( (palEntry.b765432 << 2) | palEntry.b10 )
+        };
+    }
+
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected palette type: " << paletteType
+        );
+        return {};
+    }
+}
+
+// reads big endian values, throws at the end of the data
+class Reader {
+public:
+    explicit Reader(const std::vector<uint8_t>& data) : m_data(data) {}
+
+    uint8_t get()
+    {
+        if (m_position == m_data.size())
+            throw std::runtime_error("Unexpected end of UIMG file.");
+        return m_data[m_position++];
+    }
+
+    uint16_t get16()
+    {
+        const uint16_t value = get() << 8;
+        return value | get();
+    }
+
+private:
+    const std::vector<uint8_t>& m_data;
+    size_t                      m_position = 0;
+};
+
+ReferenceImage reference_load_uimg(const std::vector<uint8_t>& data)
+{
+    Reader ifs(data);
+    ReferenceImage image;
+
+    if (ifs.get() != 'U' || ifs.get() != 'I' || ifs.get() != 'M' || ifs.get() != 'G')
+        throw std::runtime_error("Not a UIMG file.");
+
+    ifs.get16();    // version
+    image.paletteType = ifs.get16() & 0b11;
+    image.bitsPerPixel = ifs.get();
+    image.bytesPerChunk = int8_t(ifs.get());
+    image.width = ifs.get16();
+    image.height = ifs.get16();
+
+    const size_t pixels = size_t(image.width) * image.height;
+
+    if (image.bitsPerPixel > 8 && image.bytesPerChunk < image.bitsPerPixel / 8) {
+        throw_oss<std::runtime_error>(std::ostringstream()
+            << "Unexpected number of bytes per chunk: " << image.bytesPerChunk
+        );
+        return image;
+    }
+
+    if (image.bitsPerPixel <= 8) {
+        const size_t colorMapSize = size_t(1) << image.bitsPerPixel;
+
+        for (size_t i = 0; i < colorMapSize; ++i) {
+            uint32_t value = ifs.get16();
+            if (image.paletteType == FalconPalette)
+                value = (value << 16) | ifs.get16();
+
+            image.palette.push_back(reference_palette_color(image.paletteType, value));
+        }
+    }
+
+    // the chunk width the baseline decodes by
+    int16_t bytesPerChunk = image.bytesPerChunk;
+    int16_t bytesToSkip = 0;
+    if (image.bytesPerChunk >= 1) {
+        // expected delta: the value is in the least significant bytes of a wider chunk
+        bytesPerChunk = image.bitsPerPixel <= 8 ? 1 : image.bitsPerPixel / 8;
+        bytesToSkip = image.bytesPerChunk - bytesPerChunk;
+    }
+
+    while ((bytesPerChunk >= 2 && image.pixels.size() != pixels)
+           || (bytesPerChunk < 2 && image.indexes.size() != pixels)) {
+        for (int16_t i = 0; i < bytesToSkip; ++i)
+            ifs.get();
+
+        PixelPacket pixelPacket = {};
+
+        switch (bytesPerChunk) {
+        case 0: {
+            std::vector<uint8_t> planes(image.bitsPerPixel * 2);
+            for (uint8_t& plane : planes)
+                plane = ifs.get();
+
+            reference_p2c(planes.data(), 16, image.bitsPerPixel, image.indexes);
+            break;
+        }
+        case -1: {
+            uint8_t chunk = ifs.get();
+
+            int shift = 8 - image.bitsPerPixel;
+            while (shift >= 0) {
+                image.indexes.push_back((chunk >> shift) & ((1 << image.bitsPerPixel) - 1));
+                shift -= image.bitsPerPixel;
+            };
+            break;
+        }
+        case 1:
+            image.indexes.push_back(ifs.get());
+            break;
+
+        case 2: {
+            uint16_t rgb565 = 0;
+            rgb565 |= (ifs.get() << 8) & 0xff00;
+            rgb565 |= ifs.get() & 0x00ff;
+
+            pixelPacket.red   = ((rgb565 >> (6+5)) & 0x1f) << (QuantumDepth - 5);
+            pixelPacket.green = ((rgb565 >> 5)     & 0x3f) << (QuantumDepth - 6);
+            pixelPacket.blue  = (rgb565            & 0x1f) << (QuantumDepth - 5);
+
+            image.pixels.push_back(pixelPacket);
+            break;
+        }
+        case 4:
+            pixelPacket.opacity = ifs.get();
+            [[fallthrough]];
+        case 3:
+            pixelPacket.red   = ifs.get() << (QuantumDepth - 8);
+            pixelPacket.green = ifs.get() << (QuantumDepth - 8);
+            pixelPacket.blue  = ifs.get() << (QuantumDepth - 8);
+
+            image.pixels.push_back(pixelPacket);
+            break;
+
+        default:
+            throw_oss<std::runtime_error>(std::ostringstream()
+                << "Unexpected number of bytes per chunk: " << image.bytesPerChunk
+            );
+        }
+    }
+
+    return image;
+}
@@ -0,0 +1,71 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+#include "palette.h"
+
+// Straightforward, slow and obviously correct versions of the optimized kernels: the baseline's
+// c2p(), copy_buffer(), copy_packed_buffer(), save_palette() and load_uimg() loops kept verbatim
+// (just with the option globals as parameters and plain arrays instead of Magick::Image), plus
+// the deliberate format changes since applied explicitly on top (see reference.cpp); they define
+// the output bit for bit and are used only by difftest.cpp.
+
+// interleaved bitplanes: 'bitsPerPixel' big endian words per 16 pixels (only the lowest
+// 'bitsPerPixel' bits of every index are used)
+void reference_c2p(const uint8_t* pIndexes, size_t pixels, int bitsPerPixel, std::vector<uint8_t>& buffer);
+void reference_p2c(const uint8_t* pPlanar, size_t pixels, int bitsPerPixel, std::vector<uint8_t>& indexes);
+
+// appends the bitmap encoded for the given bpp / bpc (the same combinations as get_encoder()):
+// bitplanes, packed indexes or big endian chunks of 'bytesPerChunk' bytes (an index, RGB565,
+// RGB or ARGB in the least significant bytes)
+void reference_encode(const Magick::PixelPacket* pPixelPackets, const Magick::IndexPacket* pIndexPackets, size_t pixels,
+                      int16_t bitsPerPixel, int16_t bytesPerChunk, std::vector<uint8_t>& buffer);
+
+uint32_t reference_palette_entry(int paletteType, int16_t paletteBits, const PaletteColor& color);
+PaletteColor reference_palette_color(int paletteType, uint32_t value);
+// 'paletteSize' big endian entries, the ones after 'colors' are zero
+void reference_save_palette(int paletteType, int16_t paletteBits, const std::vector<PaletteColor>& colors, size_t paletteSize,
+                            std::vector<uint8_t>& buffer);
+
+// what load_uimg() makes of a UIMG file, in plain arrays
+struct ReferenceImage {
+    int16_t                             bitsPerPixel = 0;
+    int16_t                             bytesPerChunk = 0;
+    int                                 paletteType = 0;
+    uint16_t                            width = 0;
+    uint16_t                            height = 0;
+    std::vector<PaletteColor>           palette;        // 1 << bitsPerPixel colours (bpp <= 8)
+    std::vector<uint8_t>                indexes;        // bpp <= 8
+    std::vector<Magick::PixelPacket>    pixels;         // bpp > 8
+};
+
+// throws std::runtime_error if 'data' is not a complete UIMG file with a bitmap; truecolour chunks hold
+// the value in their least significant bytes
+ReferenceImage reference_load_uimg(const std::vector<uint8_t>& data);
+
+#endif // REFERENCE_H
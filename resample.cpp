@@ -0,0 +1,440 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "resample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define RESAMPLE_X86
+#include <emmintrin.h>
+#endif
+
+// GraphicsMagick's Q16 PixelPacket on a little endian machine: blue, green, red, opacity
+constexpr bool fastPixelPackets =
+    QuantumDepth == 16 && sizeof(Magick::PixelPacket) == 8
+    && offsetof(Magick::PixelPacket, blue) == 0 && offsetof(Magick::PixelPacket, green) == 2
+    && offsetof(Magick::PixelPacket, red) == 4 && offsetof(Magick::PixelPacket, opacity) == 6;
+
+// weights are fixed point numbers, 1.0 is 1 << WeightBits
+constexpr int WeightBits = 14;
+// number of rows processed by one thread at once
+constexpr size_t ResampleGrain = 8;
+
+constexpr double Pi = 3.14159265358979323846;
+
+// pixels are kept as 4 bytes in PixelPacket order (blue, green, red, opacity)
+constexpr size_t PixelSize = 4;
+
+struct Filter {
+    double support;             // the weight is zero outside of <-support, support>
+    double (*weight)(double x);
+};
+
+static double box_weight(double x)
+{
+    return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+}
+
+static double triangle_weight(double x)
+{
+    x = std::fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+// Keys' cubic convolution with a = -0.5 (Catmull-Rom)
+static double cubic_weight(double x)
+{
+    constexpr double a = -0.5;
+
+    x = std::fabs(x);
+    if (x < 1.0)
+        return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+    if (x < 2.0)
+        return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+    return 0.0;
+}
+
+static double sinc(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+
+    x *= Pi;
+    return std::sin(x) / x;
+}
+
+static double lanczos_weight(double x)
+{
+    return x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static Filter get_filter(Resampler resampler)
+{
+    switch (resampler) {
+        case Resampler::Bilinear:
+            return { 1.0, triangle_weight };
+        case Resampler::Bicubic:
+            return { 2.0, cubic_weight };
+        case Resampler::Lanczos:
+            return { 3.0, lanczos_weight };
+        default:
+            return { 0.5, box_weight };
+    }
+}
+
+// contributions of the source pixels to every output pixel along one axis
+struct Weights {
+    size_t                  taps;       // maximum number of source pixels per output pixel
+    std::vector<size_t>     firsts;     // first source pixel
+    std::vector<size_t>     counts;     // number of source pixels
+    std::vector<int16_t>    weights;    // 'taps' per output pixel, adding up to 1 << WeightBits
+};
+
+// the filter is stretched when downscaling so every source pixel contributes; the weights
+// outside of the source are left out (and the rest normalized)
+static Weights make_weights(size_t sourceSize, size_t size, const Filter& filter)
+{
+    const double scale = double(sourceSize) / size;
+    const double filterScale = std::max(scale, 1.0);
+    const double support = filter.support * filterScale;
+
+    Weights weights;
+    weights.taps = size_t(std::ceil(2.0 * support)) + 1;
+    weights.firsts.resize(size);
+    weights.counts.resize(size);
+    weights.weights.resize(size * weights.taps);
+
+    std::vector<double> values(weights.taps);
+
+    for (size_t i = 0; i < size; ++i) {
+        const double center = (i + 0.5) * scale;
+        const size_t first = size_t(std::max(center - support + 0.5, 0.0));
+        const size_t last = std::min(size_t(std::max(center + support + 0.5, 0.0)), sourceSize);
+
+        double sum = 0.0;
+        size_t count = 0;
+        for (size_t j = first; j < last && count < weights.taps; ++j) {
+            values[count] = filter.weight((j + 0.5 - center) / filterScale);
+            sum += values[count++];
+        }
+
+        // nothing within the support (can't happen with the filters above but just in case)
+        if (count == 0 || sum == 0.0) {
+            values[0] = sum = 1.0;
+            count = 1;
+        }
+
+        int16_t* pWeights = &weights.weights[i * weights.taps];
+        int total = 0;
+        size_t largest = 0;
+        for (size_t j = 0; j < count; ++j) {
+            pWeights[j] = int16_t(std::lround(values[j] / sum * (1 << WeightBits)));
+            total += pWeights[j];
+
+            if (pWeights[j] > pWeights[largest])
+                largest = j;
+        }
+        // rounding errors go to the biggest one
+        pWeights[largest] += (1 << WeightBits) - total;
+
+        weights.firsts[i] = std::min(first, sourceSize - 1);
+        weights.counts[i] = count;
+    }
+
+    return weights;
+}
+
+static inline uint8_t clamp_weighted_sum(int32_t sum)
+{
+    return std::clamp((sum + (1 << (WeightBits - 1))) >> WeightBits, 0, 255);
+}
+
+// 'pSource' row resampled into 'size' pixels of 'pRow'
+static void resample_row(const uint8_t* pSource, const Weights& weights, size_t size, uint8_t* pRow)
+{
+    for (size_t i = 0; i < size; ++i) {
+        const uint8_t* pPixels = &pSource[weights.firsts[i] * PixelSize];
+        const int16_t* pWeights = &weights.weights[i * weights.taps];
+        const size_t count = weights.counts[i];
+
+#ifdef RESAMPLE_X86
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sums = _mm_set1_epi32(1 << (WeightBits - 1));
+        size_t j = 0;
+
+        // two source pixels at once: [b0 b1 g0 g1 r0 r1 o0 o1] * [w0 w1 ...]
+        for (; j + 2 <= count; j += 2) {
+            const __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&pPixels[j * PixelSize])), zero);
+            const __m128i pairs = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+            const __m128i weightPair = _mm_set1_epi32(uint16_t(pWeights[j]) | (int32_t(pWeights[j + 1]) << 16));
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(pairs, weightPair));
+        }
+
+        if (j < count) {
+            int32_t pixel;
+            std::memcpy(&pixel, &pPixels[j * PixelSize], PixelSize);
+
+            const __m128i pairs = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(pairs, _mm_set1_epi32(uint16_t(pWeights[j]))));
+        }
+
+        const __m128i values = _mm_srai_epi32(sums, WeightBits);
+        const int32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(values, values), zero));
+        std::memcpy(&pRow[i * PixelSize], &pixel, PixelSize);
+#else
+        for (size_t c = 0; c < PixelSize; ++c) {
+            int32_t sum = 0;
+            for (size_t j = 0; j < count; ++j)
+                sum += pPixels[j * PixelSize + c] * pWeights[j];
+
+            pRow[i * PixelSize + c] = clamp_weighted_sum(sum);
+        }
+#endif
+    }
+}
+
+// 'size' bytes of rows 'ppRows' weighted into 'pRow'
+static void resample_column(const uint8_t* const* ppRows, const int16_t* pWeights, size_t count, size_t size, uint8_t* pRow)
+{
+    size_t i = 0;
+
+#ifdef RESAMPLE_X86
+    const __m128i zero = _mm_setzero_si128();
+
+    // 16 bytes of two rows at once: [a0 b0 a1 b1 ...] * [w0 w1 ...]
+    for (; i + 16 <= size; i += 16) {
+        __m128i sums[4];
+        for (__m128i& sum : sums)
+            sum = _mm_set1_epi32(1 << (WeightBits - 1));
+
+        for (size_t j = 0; j < count; j += 2) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ppRows[j][i]));
+            const __m128i b = j + 1 < count ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(&ppRows[j + 1][i])) : zero;
+            const __m128i weightPair = _mm_set1_epi32(uint16_t(pWeights[j]) | (j + 1 < count ? int32_t(pWeights[j + 1]) << 16 : 0));
+
+            const __m128i aLow = _mm_unpacklo_epi8(a, zero);
+            const __m128i bLow = _mm_unpacklo_epi8(b, zero);
+            const __m128i aHigh = _mm_unpackhi_epi8(a, zero);
+            const __m128i bHigh = _mm_unpackhi_epi8(b, zero);
+
+            sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), weightPair));
+            sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), weightPair));
+            sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), weightPair));
+            sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), weightPair));
+        }
+
+        const __m128i low = _mm_packs_epi32(_mm_srai_epi32(sums[0], WeightBits), _mm_srai_epi32(sums[1], WeightBits));
+        const __m128i high = _mm_packs_epi32(_mm_srai_epi32(sums[2], WeightBits), _mm_srai_epi32(sums[3], WeightBits));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&pRow[i]), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < size; ++i) {
+        int32_t sum = 0;
+        for (size_t j = 0; j < count; ++j)
+            sum += ppRows[j][i] * pWeights[j];
+
+        pRow[i] = clamp_weighted_sum(sum);
+    }
+}
+
+static bool is_integer_ratio(size_t sourceSize, size_t size)
+{
+    return sourceSize % size == 0 || size % sourceSize == 0;
+}
+
+// box filter with integer ratios: rounded averages of whole blocks (or copies when upscaling)
+static void resample_box(const uint8_t* pSource, size_t sourceColumns, size_t sourceRows,
+                         uint8_t* pResampled, size_t columns, size_t rows, ThreadPool& threadPool)
+{
+    const size_t blockWidth = std::max<size_t>(sourceColumns / columns, 1);
+    const size_t blockHeight = std::max<size_t>(sourceRows / rows, 1);
+    const size_t repeatX = std::max<size_t>(columns / sourceColumns, 1);
+    const size_t repeatY = std::max<size_t>(rows / sourceRows, 1);
+    const uint32_t area = blockWidth * blockHeight;
+
+    threadPool.parallel_for(rows, ResampleGrain, [&](size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y) {
+            uint8_t* pRow = &pResampled[y * columns * PixelSize];
+            const size_t sourceY = y / repeatY * blockHeight;
+
+            // the same as the row above
+            if (y > begin && y % repeatY != 0) {
+                std::memcpy(pRow, pRow - columns * PixelSize, columns * PixelSize);
+                continue;
+            }
+
+            if (area == 1) {
+                const uint8_t* pSourceRow = &pSource[sourceY * sourceColumns * PixelSize];
+                for (size_t x = 0; x < columns; x += repeatX) {
+                    for (size_t i = 0; i < repeatX; ++i)
+                        std::memcpy(&pRow[(x + i) * PixelSize], &pSourceRow[x / repeatX * PixelSize], PixelSize);
+                }
+                continue;
+            }
+
+            for (size_t x = 0; x < columns; ++x) {
+                const size_t sourceX = x / repeatX * blockWidth;
+
+                uint32_t sums[PixelSize] = {};
+                for (size_t by = 0; by < blockHeight; ++by) {
+                    const uint8_t* pPixel = &pSource[((sourceY + by) * sourceColumns + sourceX) * PixelSize];
+                    for (size_t bx = 0; bx < blockWidth * PixelSize; ++bx)
+                        sums[bx % PixelSize] += pPixel[bx];
+                }
+
+                for (size_t c = 0; c < PixelSize; ++c)
+                    pRow[x * PixelSize + c] = (sums[c] + area / 2) / area;
+            }
+        }
+    });
+}
+
+// 8 bits per channel
+static std::vector<uint8_t> get_pixels(const Magick::Image& image, ThreadPool& threadPool)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    const size_t count = image.columns() * image.rows();
+    const Magick::PixelPacket* pPixelPackets = image.getConstPixels(0, 0, image.columns(), image.rows());
+    std::vector<uint8_t> pixels(count * PixelSize);
+
+    threadPool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+        size_t i = begin;
+
+#ifdef RESAMPLE_X86
+        if constexpr (fastPixelPackets) {
+            for (; i + 4 <= end; i += 4) {
+                const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pPixelPackets[i]));
+                const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pPixelPackets[i + 2]));
+                const __m128i bytes = _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&pixels[i * PixelSize]), bytes);
+            }
+        }
+#endif
+
+        for (; i < end; ++i) {
+            pixels[i * PixelSize + 0] = pPixelPackets[i].blue    >> shift;
+            pixels[i * PixelSize + 1] = pPixelPackets[i].green   >> shift;
+            pixels[i * PixelSize + 2] = pPixelPackets[i].red     >> shift;
+            pixels[i * PixelSize + 3] = pPixelPackets[i].opacity >> shift;
+        }
+    });
+
+    return pixels;
+}
+
+static void set_pixels(Magick::Image& image, const std::vector<uint8_t>& pixels, ThreadPool& threadPool)
+{
+    const size_t count = image.columns() * image.rows();
+    Magick::PixelPacket* pPixelPackets = image.getPixels(0, 0, image.columns(), image.rows());
+
+    threadPool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+        size_t i = begin;
+
+#ifdef RESAMPLE_X86
+        if constexpr (fastPixelPackets) {
+            for (; i + 4 <= end; i += 4) {
+                // 0xAB -> 0xABAB
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pixels[i * PixelSize]));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&pPixelPackets[i]), _mm_unpacklo_epi8(bytes, bytes));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&pPixelPackets[i + 2]), _mm_unpackhi_epi8(bytes, bytes));
+            }
+        }
+#endif
+
+        for (; i < end; ++i) {
+            pPixelPackets[i].blue    = pixels[i * PixelSize + 0] * (MaxRGB / 255);
+            pPixelPackets[i].green   = pixels[i * PixelSize + 1] * (MaxRGB / 255);
+            pPixelPackets[i].red     = pixels[i * PixelSize + 2] * (MaxRGB / 255);
+            pPixelPackets[i].opacity = pixels[i * PixelSize + 3] * (MaxRGB / 255);
+        }
+    });
+
+    image.syncPixels();
+}
+
+void resample_image(Magick::Image& image, size_t width, size_t height, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    const size_t sourceColumns = image.columns();
+    const size_t sourceRows = image.rows();
+
+    const std::vector<uint8_t> source = get_pixels(image, threadPool);
+    std::vector<uint8_t> resampled(width * height * PixelSize);
+
+    if (options.resampler == Resampler::Box && is_integer_ratio(sourceColumns, width) && is_integer_ratio(sourceRows, height)) {
+        resample_box(source.data(), sourceColumns, sourceRows, resampled.data(), width, height, threadPool);
+    } else {
+        const Filter filter = get_filter(options.resampler);
+        const Weights horizontal = make_weights(sourceColumns, width, filter);
+        const Weights vertical = make_weights(sourceRows, height, filter);
+
+        // horizontally first (all source rows), then vertically
+        std::vector<uint8_t> intermediate(width * sourceRows * PixelSize);
+
+        threadPool.parallel_for(sourceRows, ResampleGrain, [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+                resample_row(&source[y * sourceColumns * PixelSize], horizontal, width, &intermediate[y * width * PixelSize]);
+        });
+
+        threadPool.parallel_for(height, ResampleGrain, [&](size_t begin, size_t end) {
+            std::vector<const uint8_t*> rows(vertical.taps);
+
+            for (size_t y = begin; y < end; ++y) {
+                const size_t count = vertical.counts[y];
+                for (size_t j = 0; j < count; ++j)
+                    rows[j] = &intermediate[(vertical.firsts[y] + j) * width * PixelSize];
+
+                resample_column(rows.data(), &vertical.weights[y * vertical.taps], count, width * PixelSize, &resampled[y * width * PixelSize]);
+            }
+        });
+    }
+
+    Magick::Image resampledImage({static_cast<unsigned int>(width), static_cast<unsigned int>(height)}, {0, 0, 0});
+    resampledImage.matte(image.matte());
+    set_pixels(resampledImage, resampled, threadPool);
+
+    image = resampledImage;
+}
+
+void resize_image(Magick::Image& image, size_t width, size_t height, const ConversionOptions& options, ThreadPool& threadPool)
+{
+    if (width != image.columns() || height != image.rows()) {
+        if (options.resampler != Resampler::GraphicsMagick) {
+            resample_image(image, width, height, options, threadPool);
+            return;
+        }
+
+        Magick::Geometry geometry;
+        geometry.width(static_cast<unsigned int>(width));
+        geometry.height(static_cast<unsigned int>(height));
+        geometry.aspect(true);
+
+        if (options.filter)
+            image.resize(geometry);
+        else
+            image.resize(geometry, Magick::FilterTypes::UndefinedFilter, 0.0);
+    }
+}
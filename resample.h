@@ -0,0 +1,41 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <cstddef>
+
+#include <GraphicsMagick/Magick++/Image.h>
+
+#include "args.h"
+#include "threadpool.h"
+
+// replaces 'image' with one of 'width' x 'height' pixels resampled by a separable filter
+// (options.resampler other than GraphicsMagick); works with 8 bits per channel (opacity
+// included), the rows are processed in parallel and the result doesn't depend on the number
+// of threads. Box filter with an integer ratio in both directions (e.g. 240x135 -> 1920x1080)
+// is exact: every output pixel is the rounded average of its source pixels (or a copy)
+void resample_image(Magick::Image& image, size_t width, size_t height, const ConversionOptions& options, ThreadPool& threadPool);
+
+// resamples 'image' (by GraphicsMagick or the built-in filter) unless it already is 'width' x 'height'
+void resize_image(Magick::Image& image, size_t width, size_t height, const ConversionOptions& options, ThreadPool& threadPool);
+
+#endif // RESAMPLE_H
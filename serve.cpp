@@ -0,0 +1,395 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "serve.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "convert.h"
+#include "helpers.h"
+#include "json.h"
+
+// FILE name standing for the request's "input" when parsing its "args"
+static const char* const InputPlaceholder = "input";
+
+static const char Base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string encode_base64(const std::vector<uint8_t>& data)
+{
+    std::string str;
+    str.reserve((data.size() + 2) / 3 * 4);
+
+    for (size_t i = 0; i < data.size(); i += 3) {
+        const size_t left = data.size() - i;
+        const uint32_t triple = (data[i] << 16) | (left > 1 ? data[i + 1] << 8 : 0) | (left > 2 ? data[i + 2] : 0);
+
+        str += Base64Alphabet[(triple >> 18) & 0x3f];
+        str += Base64Alphabet[(triple >> 12) & 0x3f];
+        str += left > 1 ? Base64Alphabet[(triple >> 6) & 0x3f] : '=';
+        str += left > 2 ? Base64Alphabet[triple & 0x3f] : '=';
+    }
+
+    return str;
+}
+
+static std::vector<uint8_t> decode_base64(const std::string& str)
+{
+    int8_t values[256];
+    std::memset(values, -1, sizeof(values));
+    for (int i = 0; i < 64; ++i)
+        values[static_cast<uint8_t>(Base64Alphabet[i])] = i;
+
+    std::vector<uint8_t> data;
+    data.reserve(str.size() / 4 * 3);
+
+    uint32_t bits = 0;
+    int bitCount = 0;
+    size_t padding = 0;
+
+    for (char c : str) {
+        if (c == '=') {
+            ++padding;
+            continue;
+        }
+
+        const int8_t value = values[static_cast<uint8_t>(c)];
+        if (value < 0 || padding)
+            throw std::invalid_argument("Invalid base64 data in \"input\".");
+
+        bits = (bits << 6) | value;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            data.push_back(bits >> bitCount);
+        }
+    }
+
+    if (padding > 2 || (str.size() % 4 != 0 && padding))
+        throw std::invalid_argument("Invalid base64 data in \"input\".");
+
+    return data;
+}
+
+// {"id": ..., "args": [...], "input": "<base64>"} => {"id": ..., "status": ..., ...}
+static std::string handle_request(const std::string& line, const std::vector<std::string>& commonArgs, ThreadPool& threadPool)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    std::string id = "null";
+    std::ostringstream result;      // the reply's fields after "status" (if successful)
+    std::ostringstream messages;
+    std::string error;
+
+    try {
+        const JsonValue request = parse_json(line);
+        if (request.type != JsonValue::Type::Object)
+            throw std::invalid_argument("A request must be a JSON object.");
+
+        // echoed re-serialised, never as the client wrote it
+        if (const JsonValue* pId = request.find("id")) {
+            if (pId->type == JsonValue::Type::String)
+                id = json_string(pId->string);
+            else if (pId->type == JsonValue::Type::Number)
+                id = pId->text;
+            else if (pId->type != JsonValue::Type::Null)
+                throw std::invalid_argument("\"id\" must be a string or a number.");
+        }
+
+        const JsonValue* pArgs = request.find("args");
+        if (!pArgs || pArgs->type != JsonValue::Type::Array)
+            throw std::invalid_argument("A request needs \"args\", an array of strings.");
+
+        // options from the command line apply to every request (and can be overridden there)
+        std::vector<std::string> args = commonArgs;
+        for (const JsonValue& arg : pArgs->array) {
+            if (arg.type != JsonValue::Type::String)
+                throw std::invalid_argument("A request needs \"args\", an array of strings.");
+            args.push_back(arg.string);
+        }
+
+        if (const JsonValue* pInput = request.find("input")) {
+            if (pInput->type != JsonValue::Type::String)
+                throw std::invalid_argument("\"input\" must be a base64 string.");
+
+            const std::vector<uint8_t> input = decode_base64(pInput->string);
+
+            args.push_back(InputPlaceholder);
+            const std::vector<Job> jobs = parse_arguments(args);
+            if (jobs.size() != 1 || jobs.front().targets.size() != 1)
+                throw std::invalid_argument("\"input\" can't be used together with FILEs and -emit.");
+
+            const std::vector<uint8_t> output = convert_memory(input.data(), input.size(), jobs.front().targets.front().options,
+                                                               threadPool, messages, messages);
+            result << ",\"output\":\"" << encode_base64(output) << "\"";
+        } else {
+            const std::vector<Job> jobs = parse_arguments(args);
+
+            for (const Job& job : jobs) {
+                for (const Target& target : job.targets) {
+                    if (is_stdio(job.inputFilename) || is_stdio(target.outputFilename))
+                        throw std::invalid_argument("stdin and stdout can't be used in a request (use \"input\").");
+                }
+            }
+
+            if (jobs.front().targets.front().options.sharedPalette) {
+                convert_frames(jobs, threadPool, messages);
+            } else {
+                for (const Job& job : jobs)
+                    convert(job, threadPool, messages, messages);
+            }
+
+            result << ",\"outputs\":[";
+            bool first = true;
+            for (const Job& job : jobs) {
+                for (const Target& target : job.targets) {
+                    result << (first ? "" : ",") << json_string(target.outputFilename);
+                    first = false;
+                }
+            }
+            result << "]";
+        }
+    }
+    catch (std::exception& ex) {
+        error = *ex.what() ? ex.what() : "Unknown error.";
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::ostringstream reply;
+    reply << "{\"id\":" << id
+          << ",\"status\":" << (error.empty() ? "\"ok\"" : "\"error\"")
+          << ",\"seconds\":" << elapsed.count();
+
+    if (error.empty())
+        reply << result.str();
+    else
+        reply << ",\"error\":" << json_string(error);
+
+    if (!messages.str().empty())
+        reply << ",\"messages\":" << json_string(messages.str());
+
+    reply << "}";
+
+    return reply.str();
+}
+
+static bool is_blank(const std::string& line)
+{
+    return line.find_first_not_of(" \t\r") == std::string::npos;
+}
+
+static bool write_all(int fd, const std::string& data)
+{
+    for (size_t written = 0; written < data.size();) {
+        // no SIGPIPE if the client is gone
+        const ssize_t size = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return false;
+
+        written += size;
+    }
+
+    return true;
+}
+
+// connected clients; their threads use the pool and the arguments so serve_socket() doesn't
+// return before all of them are gone
+struct Clients {
+    std::mutex              mutex;
+    std::condition_variable finished;
+    std::set<int>           fds;
+
+    void add(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fds.insert(fd);
+    }
+
+    void remove(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fds.erase(fd);
+        close(fd);
+        finished.notify_all();
+    }
+
+    // wakes up clients waiting for a request, the ones in the middle of a conversion finish it first
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (int fd : fds)
+            shutdown(fd, SHUT_RDWR);
+        finished.wait(lock, [this]() { return fds.empty(); });
+    }
+};
+
+// requests from one client, answered in order
+static void serve_client(int fd, const std::vector<std::string>& args, ThreadPool& threadPool, Clients& clients)
+{
+    std::string buffer;
+    size_t scanned = 0;     // no newline in buffer[0, scanned)
+    char chunk[64 * 1024];
+
+    for (;;) {
+        const ssize_t size = read(fd, chunk, sizeof(chunk));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+
+        buffer.append(chunk, size);
+
+        size_t begin = 0;
+        size_t end;
+        while ((end = buffer.find('\n', std::max(begin, scanned))) != std::string::npos) {
+            const std::string line = buffer.substr(begin, end - begin);
+            begin = end + 1;
+
+            if (!is_blank(line) && !write_all(fd, handle_request(line, args, threadPool) + "\n")) {
+                clients.remove(fd);
+                return;
+            }
+        }
+
+        buffer.erase(0, begin);
+        scanned = buffer.size();
+    }
+
+    clients.remove(fd);
+}
+
+// only a socket nobody listens on anymore (left over by a previous run) is removed
+static void remove_stale_socket(const sockaddr_un& address)
+{
+    struct stat st;
+    if (lstat(address.sun_path, &st) != 0) {
+        if (errno == ENOENT)
+            return;
+        throw_oss<std::runtime_error>(std::ostringstream() << "Checking " << address.sun_path << " failed: " << std::strerror(errno));
+    }
+
+    if (!S_ISSOCK(st.st_mode))
+        throw_oss<std::runtime_error>(std::ostringstream() << address.sun_path << " exists and is not a socket.");
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Creating socket failed: " << std::strerror(errno));
+
+    const bool connected = connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    const int connectErrno = errno;
+    close(fd);
+
+    if (connected)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Another server is listening on " << address.sun_path << ".");
+    if (connectErrno != ECONNREFUSED)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Checking " << address.sun_path << " failed: " << std::strerror(connectErrno));
+
+    unlink(address.sun_path);
+}
+
+static void serve_socket(const std::string& socketPath, const std::vector<std::string>& args, ThreadPool& threadPool)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(address.sun_path))
+        throw std::invalid_argument("Socket path " + socketPath + " is too long.");
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    remove_stale_socket(address);
+
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw_oss<std::runtime_error>(std::ostringstream() << "Creating socket failed: " << std::strerror(errno));
+
+    if (bind(listenFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+        const int bindErrno = errno;
+        close(listenFd);
+        throw_oss<std::runtime_error>(std::ostringstream() << "Listening on " << socketPath << " failed: " << std::strerror(bindErrno));
+    }
+
+    Clients clients;
+
+    try {
+        for (;;) {
+            const int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+
+                // out of descriptors or memory for now, some client will disconnect eventually
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+
+                throw_oss<std::runtime_error>(std::ostringstream() << "Accepting a connection failed: " << std::strerror(errno));
+            }
+
+            // every client has its own thread (waiting for requests), the conversions share the pool
+            clients.add(fd);
+            try {
+                std::thread(serve_client, fd, std::cref(args), std::ref(threadPool), std::ref(clients)).detach();
+            }
+            catch (std::system_error&) {
+                clients.remove(fd);
+            }
+        }
+    }
+    catch (...) {
+        close(listenFd);
+        clients.drain();
+        throw;
+    }
+}
+
+void serve(const std::string& socketPath, const std::vector<std::string>& args, ThreadPool& threadPool)
+{
+    if (socketPath != "-") {
+        serve_socket(socketPath, args, threadPool);
+        return;
+    }
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (!is_blank(line))
+            std::cout << handle_request(line, args, threadPool) << std::endl;
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <string>
+#include <vector>
+
+#include "threadpool.h"
+
+// '-serve': one JSON request per line, one JSON reply line to each; from stdin to stdout until the
+// end of input if 'socketPath' is "-", otherwise from clients of a Unix domain socket (served
+// concurrently) until killed. 'args' are the command line's options, applied to every request.
+void serve(const std::string& socketPath, const std::vector<std::string>& args, ThreadPool& threadPool);
+
+#endif // SERVE_H
@@ -0,0 +1,243 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stats.h"
+
+#include <array>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include "json.h"
+
+struct StageStats {
+    std::atomic<uint64_t>   count { 0 };
+    std::atomic<uint64_t>   wallTime { 0 };     // in ns
+    std::atomic<uint64_t>   cpuTime { 0 };      // in ns
+};
+
+struct FileStats {
+    std::atomic<uint64_t>   count { 0 };
+    std::atomic<uint64_t>   pixels { 0 };
+    std::atomic<uint64_t>   bytes { 0 };
+};
+
+struct QuantizeStats {
+    std::string filename;
+    int16_t     bitsPerPixel;
+    size_t      colorsBefore;
+    size_t      colorsAfter;
+};
+
+static const std::array<const char*, size_t(Stage::Count)> stageNames = {
+    "arguments", "magick", "read", "resize", "quantize", "encode", "write"
+};
+
+static std::array<StageStats, size_t(Stage::Count)> stageStats;
+static FileStats inputStats;
+static FileStats outputStats;
+static std::atomic<uint64_t> encodeBufferBytes { 0 };
+
+static std::mutex quantizeMutex;
+static std::vector<QuantizeStats> quantizeStats;
+
+// the calling thread's only, concurrent jobs run on other threads
+static uint64_t get_cpu_time()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// the stage the calling thread's CPU time goes to and since when
+static thread_local std::optional<Stage> currentStage;
+static thread_local uint64_t currentStageCpuStart;
+
+static void switch_stage(std::optional<Stage> stage)
+{
+    const uint64_t cpuTime = get_cpu_time();
+
+    if (currentStage)
+        stageStats[size_t(*currentStage)].cpuTime += cpuTime - currentStageCpuStart;
+
+    currentStage = stage;
+    currentStageCpuStart = cpuTime;
+}
+
+// in bytes
+static uint64_t get_peak_rss()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return uint64_t(usage.ru_maxrss) << 10;
+#endif
+}
+
+StageCpuTimer::StageCpuTimer(std::optional<Stage> stage)
+    : m_previous(currentStage)
+{
+    switch_stage(stage);
+}
+
+StageCpuTimer::~StageCpuTimer()
+{
+    switch_stage(m_previous);
+}
+
+std::optional<Stage> get_current_stage()
+{
+    return currentStage;
+}
+
+StageTimer::StageTimer(Stage stage)
+    : m_stage(stage)
+    , m_wallStart(std::chrono::steady_clock::now())
+    , m_cpuTimer(stage)
+{
+}
+
+StageTimer::~StageTimer()
+{
+    StageStats& stats = stageStats[size_t(m_stage)];
+
+    stats.count++;
+    stats.wallTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_wallStart).count();
+}
+
+void add_input_stats(size_t pixels, uint64_t bytes)
+{
+    inputStats.count++;
+    inputStats.pixels += pixels;
+    inputStats.bytes += bytes;
+}
+
+void add_output_stats(size_t pixels, uint64_t bytes)
+{
+    outputStats.count++;
+    outputStats.pixels += pixels;
+    outputStats.bytes += bytes;
+}
+
+void add_encode_buffer_stats(size_t bytes)
+{
+    encodeBufferBytes += bytes;
+}
+
+void add_quantize_stats(const std::string& filename, int16_t bitsPerPixel, size_t colorsBefore, size_t colorsAfter)
+{
+    std::lock_guard<std::mutex> lock(quantizeMutex);
+    quantizeStats.push_back({ filename, bitsPerPixel, colorsBefore, colorsAfter });
+}
+
+static void print_json(std::ostream& os)
+{
+    auto print_files = [&os](const char* name, const FileStats& stats) {
+        os << ",\"" << name << "\":{\"files\":" << stats.count << ",\"pixels\":" << stats.pixels << ",\"bytes\":" << stats.bytes << "}";
+    };
+
+    os << "{\"stages\":{";
+    for (size_t i = 0; i < stageStats.size(); ++i) {
+        const StageStats& stats = stageStats[i];
+
+        os << (i ? "," : "") << json_string(stageNames[i])
+           << ":{\"count\":" << stats.count
+           << ",\"wall_seconds\":" << stats.wallTime / 1e9
+           << ",\"cpu_seconds\":" << stats.cpuTime / 1e9 << "}";
+    }
+    os << "}";
+
+    print_files("input", inputStats);
+    print_files("output", outputStats);
+
+    os << ",\"encode_buffer_bytes\":" << encodeBufferBytes
+       << ",\"peak_rss_bytes\":" << get_peak_rss();
+
+    os << ",\"quantized\":[";
+    for (size_t i = 0; i < quantizeStats.size(); ++i) {
+        const QuantizeStats& stats = quantizeStats[i];
+
+        os << (i ? "," : "") << "{\"file\":" << json_string(stats.filename)
+           << ",\"bpp\":" << stats.bitsPerPixel
+           << ",\"colors_before\":" << stats.colorsBefore
+           << ",\"colors_after\":" << stats.colorsAfter << "}";
+    }
+    os << "]}" << std::endl;
+}
+
+static void print_text(std::ostream& os)
+{
+    auto print_files = [&os](const char* name, const FileStats& stats) {
+        os << std::left << std::setw(16) << name << std::right
+           << stats.count << " file(s), " << stats.pixels << " pixels, " << stats.bytes << " bytes" << std::endl;
+    };
+
+    os << std::left << std::setw(16) << "Stage" << std::right
+       << std::setw(8) << "count" << std::setw(12) << "wall [s]" << std::setw(12) << "CPU [s]" << std::endl;
+
+    os << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < stageStats.size(); ++i) {
+        const StageStats& stats = stageStats[i];
+
+        os << std::left << std::setw(16) << stageNames[i] << std::right
+           << std::setw(8) << stats.count
+           << std::setw(12) << stats.wallTime / 1e9
+           << std::setw(12) << stats.cpuTime / 1e9 << std::endl;
+    }
+
+    print_files("Input:", inputStats);
+    print_files("Output:", outputStats);
+
+    os << std::left << std::setw(16) << "Encode buffers:" << std::right << encodeBufferBytes << " bytes" << std::endl
+       << std::left << std::setw(16) << "Peak RSS:" << std::right << get_peak_rss() << " bytes" << std::endl;
+
+    for (const QuantizeStats& stats : quantizeStats) {
+        os << "Colours of " << stats.filename << " @" << stats.bitsPerPixel << ": ";
+        if (stats.colorsBefore)
+            os << stats.colorsBefore;
+        else
+            os << "?";
+        os << " -> " << stats.colorsAfter << std::endl;
+    }
+}
+
+void print_stats(std::ostream& os, StatsFormat format)
+{
+    std::lock_guard<std::mutex> lock(quantizeMutex);
+
+    // not to mess up the caller's formatting
+    std::ostringstream oss;
+
+    if (format == StatsFormat::Json)
+        print_json(oss);
+    else
+        print_text(oss);
+
+    os << oss.str() << std::flush;
+}
@@ -0,0 +1,89 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+
+#include "args.h"
+
+// stages of the whole process as reported by '-stats'
+enum class Stage {
+    Arguments,      // command line(s) and batch file
+    Magick,         // InitializeMagick()
+    Read,           // decoding, load_uimg() and the cache
+    Resize,
+    Quantize,       // dithering and remapping included
+    Encode,         // transcoding included
+    Write,
+    Count
+};
+
+// charges the CPU time the calling thread spends during its lifetime to 'stage' (none if empty)
+// instead of to the stage it was in; for work done on behalf of a stage on another thread (see
+// ThreadPool) and by StageTimer itself
+class StageCpuTimer {
+public:
+    explicit StageCpuTimer(std::optional<Stage> stage);
+    ~StageCpuTimer();
+
+    StageCpuTimer(const StageCpuTimer&) = delete;
+    StageCpuTimer& operator=(const StageCpuTimer&) = delete;
+
+private:
+    std::optional<Stage>    m_previous;
+};
+
+// the stage the calling thread's CPU time is charged to at the moment (if any)
+std::optional<Stage> get_current_stage();
+
+// adds the wall clock time of its lifetime to 'stage' and the CPU time of the calling thread (and
+// of the pool threads helping it with parallel_for()) but not of concurrent jobs
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage                                   m_stage;
+    std::chrono::steady_clock::time_point   m_wallStart;
+    StageCpuTimer                           m_cpuTimer;
+};
+
+// process-wide counters, always collected (they're cheap) and thread safe
+void add_input_stats(size_t pixels, uint64_t bytes);
+void add_output_stats(size_t pixels, uint64_t bytes);
+void add_encode_buffer_stats(size_t bytes);
+// 'colorsBefore' as counted by the quantizer (0 if not counted)
+void add_quantize_stats(const std::string& filename, int16_t bitsPerPixel, size_t colorsBefore, size_t colorsAfter);
+
+// everything collected so far and the peak RSS
+void print_stats(std::ostream& os, StatsFormat format);
+
+#endif // STATS_H
@@ -0,0 +1,241 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "threadpool.h"
+
+#include <algorithm>
+#include <exception>
+
+#include "stats.h"
+
+// which pool (and which of its queues) the current thread is a worker of
+static thread_local const ThreadPool* currentPool;
+static thread_local size_t currentQueueIndex;
+// number of tasks the current thread is in the middle of
+static thread_local size_t currentDepth;
+
+// counts a task in currentDepth for as long as it runs (exceptions included)
+struct DepthGuard {
+    DepthGuard() { currentDepth++; }
+    ~DepthGuard() { currentDepth--; }
+};
+
+ThreadPool::ThreadPool(unsigned int threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 0; i < threads; ++i)
+        m_queues.push_back(std::make_unique<Queue>());
+
+    for (unsigned int i = 1; i < threads; ++i)
+        m_workers.emplace_back(&ThreadPool::worker, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_condition.notify_all();
+
+    for (std::thread& thread : m_workers)
+        thread.join();
+}
+
+size_t ThreadPool::queue_index() const
+{
+    return currentPool == this ? currentQueueIndex : 0;
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    // a whole task charges its CPU time only to its own stages, not to the one of a thread
+    // running it while waiting
+    push({ [task = std::move(task)]() { StageCpuTimer timer(std::nullopt); task(); }, false });
+}
+
+void ThreadPool::push(Task task)
+{
+    Queue& queue = *m_queues[queue_index()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    m_pending++;
+
+    {
+        // make sure a worker about to sleep sees m_pending (and a waiter m_events)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_events++;
+    }
+    m_condition.notify_all();
+}
+
+bool ThreadPool::run_one(size_t index)
+{
+    // inside of a task only parallel_for() helpers are safe to run (a whole other
+    // task could keep this one from finishing for a long time)
+    const bool anyTask = currentDepth == 0;
+
+    std::function<void()> task;
+
+    // own queue first (newest task, its data is most likely still in cache)...
+    {
+        Queue& queue = *m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (auto it = queue.tasks.rbegin(); it != queue.tasks.rend(); ++it) {
+            if (anyTask || it->parallelFor) {
+                task = std::move(it->func);
+                queue.tasks.erase(std::next(it).base());
+                break;
+            }
+        }
+    }
+
+    // ... then steal the oldest (i.e. usually biggest) task from somebody else
+    for (size_t i = 1; !task && i < m_queues.size(); ++i) {
+        Queue& queue = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (auto it = queue.tasks.begin(); it != queue.tasks.end(); ++it) {
+            if (anyTask || it->parallelFor) {
+                task = std::move(it->func);
+                queue.tasks.erase(it);
+                break;
+            }
+        }
+    }
+
+    if (!task)
+        return false;
+
+    m_pending--;
+
+    {
+        DepthGuard guard;
+        task();
+    }
+
+    // somebody may be waiting for this one in wait_until()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_events++;
+    }
+    m_condition.notify_all();
+    return true;
+}
+
+void ThreadPool::worker(size_t index)
+{
+    currentPool = this;
+    currentQueueIndex = index;
+
+    for (;;) {
+        if (run_one(index))
+            continue;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] { return m_quit || m_pending > 0; });
+
+        if (m_quit)
+            return;
+    }
+}
+
+void ThreadPool::wait_until(const std::function<bool()>& done)
+{
+    const size_t index = queue_index();
+
+    for (;;) {
+        // taken before done() is checked, a task finishing afterwards changes it
+        size_t events;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            events = m_events;
+        }
+
+        if (done())
+            return;
+
+        if (!run_one(index)) {
+            // nothing to help with, wait for a task to finish (or a new one)
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this, events] { return m_events != events; });
+        }
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& func)
+{
+    grain = std::max<size_t>(grain, 1);
+    const size_t chunks = (count + grain - 1) / grain;
+
+    if (chunks <= 1 || m_workers.empty()) {
+        for (size_t begin = 0; begin < count; begin += grain)
+            func(begin, std::min(begin + grain, count));
+        return;
+    }
+
+    // shared with helpers which may start only after we have returned
+    struct State {
+        std::atomic<size_t>     next { 0 };
+        std::atomic<size_t>     done { 0 };
+        std::exception_ptr      exception;
+        std::mutex              mutex;
+    };
+    auto state = std::make_shared<State>();
+
+    // chunks are claimed dynamically so the ranges each thread gets don't matter for the result
+    auto run = [state, chunks, count, grain, &func]() {
+        size_t chunk;
+        while ((chunk = state->next++) < chunks) {
+            try {
+                const size_t begin = chunk * grain;
+                func(begin, std::min(begin + grain, count));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->exception)
+                    state->exception = std::current_exception();
+            }
+            state->done++;
+        }
+    };
+
+    // helpers work for the caller's stage (if any)
+    auto help = [run, stage = get_current_stage()]() {
+        StageCpuTimer timer(stage);
+        run();
+    };
+
+    const size_t helpers = std::min(chunks - 1, m_workers.size());
+    for (size_t i = 0; i < helpers; ++i)
+        push({ help, true });
+
+    {
+        DepthGuard guard;
+        run();
+    }
+
+    wait_until([&state, chunks] { return state->done == chunks; });
+
+    if (state->exception)
+        std::rethrow_exception(state->exception);
+}
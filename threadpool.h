@@ -0,0 +1,89 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing thread pool: every worker has its own task queue (newest task first),
+// idle workers steal the oldest tasks from the others; threads waiting for their
+// tasks (parallel_for(), wait_until()) run other tasks in the meantime so tasks
+// can safely wait for other tasks (but a thread waiting inside a task helps only
+// with parallel_for() work, never picks up another whole task)
+class ThreadPool {
+public:
+    // 0 = one thread per hardware thread; the calling thread counts as one of them
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned int threads() const { return m_workers.size() + 1; }
+
+    // queues a task (on the calling worker's own queue, if called from a worker); the task
+    // must not throw
+    void submit(std::function<void()> task);
+
+    // runs queued tasks until done() returns true (checked whenever a task has finished or has
+    // been queued, so done() must depend only on the pool's tasks)
+    void wait_until(const std::function<bool()>& done);
+
+    // calls func(begin, end) for disjoint ranges covering [0, count), each at most 'grain'
+    // items long; returns when all of them are done (rethrowing the first exception, if any)
+    void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& func);
+
+private:
+    struct Task {
+        std::function<void()>   func;
+        bool                    parallelFor;    // part of a parallel_for() call
+    };
+
+    struct Queue {
+        std::mutex              mutex;
+        std::deque<Task>        tasks;
+    };
+
+    size_t queue_index() const;
+    void push(Task task);
+    bool run_one(size_t index);
+    void worker(size_t index);
+
+    // [0] is shared by all non-worker threads, [i] belongs to worker i-1
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread>            m_workers;
+
+    std::atomic<size_t>                 m_pending { 0 };   // tasks in all queues
+    std::mutex                          m_mutex;
+    std::condition_variable             m_condition;
+    size_t                              m_events = 0;       // tasks queued or finished so far (under m_mutex)
+    bool                                m_quit = false;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,158 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "transcode.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "dither.h"
+#include "encode.h"
+#include "palette.h"
+
+bool can_transcode(const UimgView& view, const ConversionOptions& options)
+{
+    if (!view.bitsPerPixel() || !options.bitsPerPixel)
+        return false;
+
+    // the fixed palette (see '-usepal') needs remapping and dithering changes the pixels
+    if (!options.fixedPaletteFilename.empty() || is_dithering_ordered(options) || is_diffusing_error(options))
+        return false;
+
+    // the native quantizer always builds (and remaps to) its own palette, even if the colours fit
+    if (options.bitsPerPixel <= 8 && options.quantizer == Quantizer::Native)
+        return false;
+
+    if ((options.bitmapWidth != -1 && options.bitmapWidth != view.width())
+            || (options.bitmapHeight != -1 && options.bitmapHeight != view.height()))
+        return false;
+
+    if (view.bitsPerPixel() <= 8)
+        // fewer bits per pixel would need quantizing (and a bitmap without palette can't be converted at all)
+        return view.paletteSize() != 0 && (options.bitsPerPixel > 8 || options.bitsPerPixel >= view.bitsPerPixel());
+    else
+        return options.bitsPerPixel > 8;
+}
+
+// note: opacity is taken as is (like load_uimg() does), i.e. not scaled to QuantumDepth
+static Magick::PixelPacket make_pixel_packet(uint8_t a, uint8_t r, uint8_t g, uint8_t b)
+{
+    constexpr size_t shift = QuantumDepth - 8;
+
+    Magick::PixelPacket pixelPacket;
+    pixelPacket.red     = r << shift;
+    pixelPacket.green   = g << shift;
+    pixelPacket.blue    = b << shift;
+    pixelPacket.opacity = a;
+    return pixelPacket;
+}
+
+// truecolour chunks of any size (the value in the least significant bytes)
+static void decode_truecolor(const UimgView& view, Magick::PixelPacket* pPixelPackets)
+{
+    const size_t pixels = size_t(view.width()) * view.height();
+    const size_t bytesPerChunk = view.bytesPerChunk() > 0 ? view.bytesPerChunk() : view.bitsPerPixel() / 8;
+    const uint8_t* pChunk = view.bitmap().data;
+
+    for (size_t i = 0; i < pixels; ++i, pChunk += bytesPerChunk) {
+        uint32_t chunk = 0;
+        for (size_t j = 0; j < bytesPerChunk; ++j)
+            chunk = (chunk << 8) | pChunk[j];
+
+        switch (view.bitsPerPixel()) {
+        case 16:
+            pPixelPackets[i] = make_pixel_packet(0, ((chunk >> (6+5)) & 0x1f) << 3, ((chunk >> 5) & 0x3f) << 2, (chunk & 0x1f) << 3);
+            break;
+        case 24:
+            pPixelPackets[i] = make_pixel_packet(0, chunk >> 16, chunk >> 8, chunk);
+            break;
+        default:
+            pPixelPackets[i] = make_pixel_packet(chunk >> 24, chunk >> 16, chunk >> 8, chunk);
+            break;
+        }
+    }
+}
+
+// throws if 'view' can't be saved as 'options' after all
+static EncodeFunc get_transcoder(const UimgView& view, const ConversionOptions& options)
+{
+    if (options.bitsPerPixel <= 8 && view.width() % 16 != 0)
+        throw std::runtime_error("Width must be divisible by 16.");
+
+    return get_encoder(options.bitsPerPixel, options.bytesPerChunk);
+}
+
+void transcode(const UimgView& view, const ConversionOptions& options, std::ostream& os)
+{
+    const size_t pixels = size_t(view.width()) * view.height();
+    const EncodeFunc encode = get_transcoder(view, options);
+
+    std::vector<PaletteColor> colors(view.paletteSize());
+    for (size_t i = 0; i < colors.size(); ++i)
+        colors[i] = view.paletteColor(i);
+
+    // the encoders' input: indexes for indexed, pixels for truecolour output
+    std::vector<Magick::IndexPacket> indexPackets;
+    std::vector<Magick::PixelPacket> pixelPackets;
+
+    if (view.bitsPerPixel() <= 8) {
+        std::vector<uint8_t> indexes(pixels);
+        decode_indexes(view, indexes.data());
+
+        if (options.bitsPerPixel <= 8) {
+            indexPackets.assign(indexes.begin(), indexes.end());
+        } else {
+            // palette lookup (the palette has exactly as many entries as there are indexes)
+            std::array<Magick::PixelPacket, 256> lookup;
+            for (size_t i = 0; i < colors.size(); ++i)
+                lookup[i] = make_pixel_packet(0, colors[i].r, colors[i].g, colors[i].b);
+
+            pixelPackets.resize(pixels);
+            for (size_t i = 0; i < pixels; ++i)
+                pixelPackets[i] = lookup[indexes[i]];
+        }
+    } else {
+        pixelPackets.resize(pixels);
+        decode_truecolor(view, pixelPackets.data());
+    }
+
+    std::vector<uint8_t> atariImage(get_encoded_size(options.bitsPerPixel, options.bytesPerChunk, view.width(), view.height()));
+    encode(pixelPackets.data(), indexPackets.data(), view.width(), view.height(), atariImage.data());
+
+    save_uimg_header(os, options, view.width(), view.height());
+    if (options.paletteBits)
+        save_uimg_palette(os, options, colors, 1 << options.bitsPerPixel);
+
+    os.write(reinterpret_cast<const char*>(atariImage.data()), atariImage.size());
+}
+
+void transcode(const UimgView& view, const Target& target)
+{
+    // fail before touching the destination file
+    get_transcoder(view, target.options);
+
+    // the destination may be the source itself
+    save_uimg_file(target.outputFilename, [&](std::ostream& os) {
+        transcode(view, target.options, os);
+    });
+}
@@ -0,0 +1,41 @@
+/*
+ * uconvert: bitmap converter into Atari ST/STE/TT/Falcon-specific format
+ *
+ * Copyright (c) 2022 Miro Kropacek <miro.kropacek@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <ostream>
+
+#include "args.h"
+#include "uimg.h"
+
+// true if 'view' can be saved as 'options' just by rearranging its bits, i.e. without
+// resizing, quantizing or GraphicsMagick at all: indexed bitmaps into another layout
+// with at least as many bits per pixel or into truecolour, truecolour into truecolour
+// (but never if the native quantizer would build a new palette)
+bool can_transcode(const UimgView& view, const ConversionOptions& options);
+
+// the same output as decoding 'view' with load_uimg() and saving it would produce; like
+// there, a 32 bpp source's alpha channel is taken as is (not scaled to QuantumDepth), so
+// it doesn't survive into a 32 bpp output
+void transcode(const UimgView& view, const ConversionOptions& options, std::ostream& os);
+void transcode(const UimgView& view, const Target& target);
+
+#endif // TRANSCODE_H
@@ -5,6 +5,21 @@ CONFIG -= qt
 
 SOURCES += \
         args.cpp \
+        c2p.cpp \
+        cache.cpp \
+        convert.cpp \
+        dither.cpp \
+        encode.cpp \
+        hash.cpp \
+        json.cpp \
+        manifest.cpp \
+        palette.cpp \
+        quantize.cpp \
+        resample.cpp \
+        serve.cpp \
+        stats.cpp \
+        threadpool.cpp \
+        transcode.cpp \
         uconvert.cpp \
         uimg.cpp
 
@@ -16,10 +31,31 @@ QMAKE_LIBS     += $$system(GraphicsMagick++-config --libs)
 HEADERS += \
     args.h \
     bitfield.h \
+    c2p.h \
+    c2p_kernels.h \
+    cache.h \
+    convert.h \
+    dither.h \
+    encode.h \
+    hash.h \
+    json.h \
+    manifest.h \
     helpers.h \
     palette.h \
+    quantize.h \
+    resample.h \
+    serve.h \
+    stats.h \
+    threadpool.h \
+    transcode.h \
     uimg.h \
     version.h
 
 DISTFILES += \
-    Makefile
+    Makefile \
+    bench.cpp \
+    difftest.cpp \
+    libuconvert.cpp \
+    libuconvert.h \
+    reference.cpp \
+    reference.h
@@ -20,112 +20,420 @@
 
 #include "uimg.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define UIMG_X86
+#include <emmintrin.h>
+#endif
+
+#include "c2p.h"
+#include "encode.h"
 #include "helpers.h"
 #include "palette.h"
+#include "version.h"
+
+// GraphicsMagick's Q16 PixelPacket on a little endian machine: blue, green, red, opacity
+constexpr bool fastPixelPackets =
+    QuantumDepth == 16 && sizeof(Magick::PixelPacket) == 8
+    && offsetof(Magick::PixelPacket, blue) == 0 && offsetof(Magick::PixelPacket, green) == 2
+    && offsetof(Magick::PixelPacket, red) == 4 && offsetof(Magick::PixelPacket, opacity) == 6;
+
+// 'size' bytes of packed 1, 2 or 4 bpp pixels (the first one in the most significant bits) into
+// exactly 'pixels' indexes; the ones without a whole byte for them (the size is rounded down to
+// whole bytes) are 0
+static void unpack_indexes(const uint8_t* pPacked, size_t size, size_t pixels, int bitsPerPixel, uint8_t* pIndexes)
+{
+    const uint8_t* pPackedEnd = pPacked + size;
+    uint8_t* pIndexesEnd = pIndexes + pixels;
+
+#ifdef UIMG_X86
+    if (bitsPerPixel == 4) {
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        for (; pPackedEnd - pPacked >= 16 && pIndexesEnd - pIndexes >= 32; pPacked += 16, pIndexes += 32) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPacked));
+            const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+            const __m128i lo = _mm_and_si128(v, nibble);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pIndexes),      _mm_unpacklo_epi8(hi, lo));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pIndexes + 16), _mm_unpackhi_epi8(hi, lo));
+        }
+    }
+#endif
 
-bool is_uimg(const std::string& filePath)
+    const ptrdiff_t pixelsPerByte = 8 / bitsPerPixel;
+    for (; pPacked != pPackedEnd && pIndexesEnd - pIndexes >= pixelsPerByte; ++pPacked) {
+        for (int shift = 8 - bitsPerPixel; shift >= 0; shift -= bitsPerPixel)
+            *pIndexes++ = (*pPacked >> shift) & ((1 << bitsPerPixel) - 1);
+    }
+
+    std::fill(pIndexes, pIndexesEnd, 0);
+}
+
+static void expand_rgb565(const uint8_t* pChunks, size_t pixels, Magick::PixelPacket* pPixelPackets)
 {
-    std::ifstream ifs(filePath, std::ifstream::binary);
-    ifs.exceptions(std::ifstream::failbit);
+    size_t i = 0;
+
+#ifdef UIMG_X86
+    if constexpr (fastPixelPackets) {
+        const __m128i mask5 = _mm_set1_epi16(0x1f);
+        const __m128i mask6 = _mm_set1_epi16(0x3f);
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 8 <= pixels; i += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pChunks + i * 2));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));  // big endian
+
+            const __m128i r = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(v, 6+5), mask5), QuantumDepth - 5);
+            const __m128i g = _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(v, 5), mask6),   QuantumDepth - 6);
+            const __m128i b = _mm_slli_epi16(_mm_and_si128(v, mask5),                        QuantumDepth - 5);
+
+            const __m128i bgLo = _mm_unpacklo_epi16(b, g);
+            const __m128i bgHi = _mm_unpackhi_epi16(b, g);
+            const __m128i roLo = _mm_unpacklo_epi16(r, zero);
+            const __m128i roHi = _mm_unpackhi_epi16(r, zero);
+
+            __m128i* pOut = reinterpret_cast<__m128i*>(pPixelPackets + i);
+            _mm_storeu_si128(pOut,     _mm_unpacklo_epi32(bgLo, roLo));
+            _mm_storeu_si128(pOut + 1, _mm_unpackhi_epi32(bgLo, roLo));
+            _mm_storeu_si128(pOut + 2, _mm_unpacklo_epi32(bgHi, roHi));
+            _mm_storeu_si128(pOut + 3, _mm_unpackhi_epi32(bgHi, roHi));
+        }
+    }
+#endif
 
-    FileHeader fileHeader;
-    ifs.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+    for (; i < pixels; ++i) {
+        const uint16_t rgb565 = (pChunks[i * 2] << 8) | pChunks[i * 2 + 1];
 
-    fileHeader.version = (fileHeader.version >> 8) | (fileHeader.version << 8);
-    fileHeader.flags   = (fileHeader.flags >> 8)   | (fileHeader.flags << 8);
+        pPixelPackets[i].red     = ((rgb565 >> (6+5)) & 0x1f) << (QuantumDepth - 5);
+        pPixelPackets[i].green   = ((rgb565 >> 5)     & 0x3f) << (QuantumDepth - 6);
+        pPixelPackets[i].blue    = (rgb565            & 0x1f) << (QuantumDepth - 5);
+        pPixelPackets[i].opacity = 0;
+    }
+}
+
+// RGB565 zero-extended to 3 or 4 bytes
+static void expand_wide_rgb565(const uint8_t* pChunks, size_t bytesPerChunk, size_t pixels, Magick::PixelPacket* pPixelPackets)
+{
+    for (size_t i = 0; i < pixels; ++i, pChunks += bytesPerChunk) {
+        const uint16_t rgb565 = (pChunks[bytesPerChunk - 2] << 8) | pChunks[bytesPerChunk - 1];
 
-    return strncmp(fileHeader.id, "UIMG", 4) == 0
-            && fileHeader.bitsPerPixel != 0
-            && (fileHeader.bitsPerPixel > 8 || (fileHeader.flags & 0b11) != 0b00);
+        pPixelPackets[i].red     = ((rgb565 >> (6+5)) & 0x1f) << (QuantumDepth - 5);
+        pPixelPackets[i].green   = ((rgb565 >> 5)     & 0x3f) << (QuantumDepth - 6);
+        pPixelPackets[i].blue    = (rgb565            & 0x1f) << (QuantumDepth - 5);
+        pPixelPackets[i].opacity = 0;
+    }
 }
 
-Magick::Image load_uimg(const std::string& filePath)
+static void expand_rgb888(const uint8_t* pChunks, size_t pixels, Magick::PixelPacket* pPixelPackets)
+{
+    for (size_t i = 0; i < pixels; ++i, pChunks += 3) {
+        pPixelPackets[i].red     = pChunks[0] << (QuantumDepth - 8);
+        pPixelPackets[i].green   = pChunks[1] << (QuantumDepth - 8);
+        pPixelPackets[i].blue    = pChunks[2] << (QuantumDepth - 8);
+        pPixelPackets[i].opacity = 0;
+    }
+}
+
+// note: opacity is taken as is, i.e. not scaled to QuantumDepth
+static void expand_argb8888(const uint8_t* pChunks, size_t pixels, Magick::PixelPacket* pPixelPackets)
+{
+    size_t i = 0;
+
+#ifdef UIMG_X86
+    if constexpr (fastPixelPackets) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i scale = _mm_setr_epi16(1 << 8, 1 << 8, 1 << 8, 1, 1 << 8, 1 << 8, 1 << 8, 1);
+
+        for (; i + 4 <= pixels; i += 4) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pChunks + i * 4));
+
+            // ARGB bytes => BGRA words
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+            hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+
+            __m128i* pOut = reinterpret_cast<__m128i*>(pPixelPackets + i);
+            _mm_storeu_si128(pOut,     _mm_mullo_epi16(lo, scale));
+            _mm_storeu_si128(pOut + 1, _mm_mullo_epi16(hi, scale));
+        }
+    }
+#endif
+
+    for (; i < pixels; ++i) {
+        const uint8_t* pChunk = pChunks + i * 4;
+
+        pPixelPackets[i].opacity = pChunk[0];
+        pPixelPackets[i].red     = pChunk[1] << (QuantumDepth - 8);
+        pPixelPackets[i].green   = pChunk[2] << (QuantumDepth - 8);
+        pPixelPackets[i].blue    = pChunk[3] << (QuantumDepth - 8);
+    }
+}
+
+static inline uint16_t read_big_endian16(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t read_big_endian32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+UimgView::UimgView(const std::string& filePath)
+{
+    const int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Opening " + filePath + " failed.");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Not a UIMG file: " + filePath);
+    }
+
+    void* pMapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pMapped == MAP_FAILED)
+        throw std::runtime_error("Mapping " + filePath + " failed.");
+
+    m_pData = static_cast<const uint8_t*>(pMapped);
+    m_size = st.st_size;
+    m_mapped = true;
+
+    try {
+        parse();
+    } catch (...) {
+        munmap(const_cast<uint8_t*>(m_pData), m_size);
+        throw;
+    }
+}
+
+UimgView::UimgView(const uint8_t* pData, size_t size)
+    : m_pData(pData)
+    , m_size(size)
+{
+    parse();
+}
+
+UimgView::UimgView(UimgView&& other) noexcept
+    : m_pData(other.m_pData)
+    , m_size(other.m_size)
+    , m_mapped(other.m_mapped)
+    , m_version(other.m_version)
+    , m_flags(other.m_flags)
+    , m_bitsPerPixel(other.m_bitsPerPixel)
+    , m_bytesPerChunk(other.m_bytesPerChunk)
+    , m_width(other.m_width)
+    , m_height(other.m_height)
+    , m_paletteSize(other.m_paletteSize)
+    , m_palette(other.m_palette)
+    , m_bitmap(other.m_bitmap)
+    , m_rowSize(other.m_rowSize)
+{
+    // the mapping belongs to us now
+    other.m_mapped = false;
+}
+
+UimgView::~UimgView()
+{
+    if (m_mapped)
+        munmap(const_cast<uint8_t*>(m_pData), m_size);
+}
+
+bool UimgView::probe(const uint8_t* pData, size_t size)
+{
+    return size >= sizeof(FileHeader) && std::memcmp(pData, "UIMG", 4) == 0;
+}
+
+void UimgView::parse()
+{
+    if (!probe(m_pData, m_size))
+        throw std::runtime_error("Not a UIMG file.");
+
+    const uint8_t* p = m_pData + 4;
+
+    m_version = read_big_endian16(p);
+    m_flags = read_big_endian16(p + 2);
+    m_bitsPerPixel = p[4];
+    m_bytesPerChunk = static_cast<int8_t>(p[5]);
+    p += 6;
+
+    switch (m_bitsPerPixel) {
+    case 0: case 1: case 2: case 4: case 6: case 8: case 16: case 24: case 32:
+        break;
+    default:
+        throw_oss<std::runtime_error>(std::ostringstream()
+            << "Unexpected number of bits per pixel: " << m_bitsPerPixel
+        );
+    }
+
+    if (m_bytesPerChunk < -1 || m_bytesPerChunk > 4) {
+        throw_oss<std::runtime_error>(std::ostringstream()
+            << "Unexpected number of bytes per chunk: " << m_bytesPerChunk
+        );
+    }
+
+    const uint8_t* pEnd = m_pData + m_size;
+
+    if (m_bitsPerPixel) {
+        if (pEnd - p < 4)
+            throw std::runtime_error("Unexpected end of UIMG file.");
+
+        m_width = read_big_endian16(p);
+        m_height = read_big_endian16(p + 2);
+        p += 4;
+    }
+
+    // as many entries as the bitmap can address (save_palette() in uconvert.cpp)
+    if (paletteType() != 0b00 && m_bitsPerPixel <= 8)
+        m_paletteSize = size_t(1) << m_bitsPerPixel;
+
+    m_palette = { p, m_paletteSize * paletteEntrySize() };
+    if (static_cast<size_t>(pEnd - p) < m_palette.size)
+        throw std::runtime_error("Unexpected end of UIMG file.");
+    p += m_palette.size;
+
+    if (m_bitsPerPixel) {
+        m_rowSize = get_encoded_size(m_bitsPerPixel, m_bytesPerChunk, m_width, 1);
+        m_bitmap = { p, get_encoded_size(m_bitsPerPixel, m_bytesPerChunk, m_width, m_height) };
+        if (static_cast<size_t>(pEnd - p) < m_bitmap.size)
+            throw std::runtime_error("Unexpected end of UIMG file.");
+    }
+}
+
+uint32_t UimgView::paletteEntry(size_t i) const
+{
+    const uint8_t* p = m_palette.data + i * paletteEntrySize();
+    return paletteEntrySize() == 4 ? read_big_endian32(p) : read_big_endian16(p);
+}
+
+uint32_t UimgView::pixel(size_t x, size_t y) const
+{
+    switch (m_bytesPerChunk) {
+    case 0: {
+        // interleaved bitplanes: 'bpp' words per 16 pixels
+        const uint8_t* pGroup = row(y).data + (x / 16) * m_bitsPerPixel * 2;
+        const int bit = 15 - (x % 16);
+
+        uint32_t index = 0;
+        for (int i = 0; i < m_bitsPerPixel; ++i)
+            index |= ((read_big_endian16(pGroup + i * 2) >> bit) & 1) << i;
+        return index;
+    }
+
+    case -1: {
+        // packed pixels don't need to start at a byte boundary on each row
+        const size_t bitOffset = (y * m_width + x) * m_bitsPerPixel;
+        const int shift = 8 - m_bitsPerPixel - (bitOffset % 8);
+        return (m_bitmap.data[bitOffset / 8] >> shift) & ((1 << m_bitsPerPixel) - 1);
+    }
+
+    default: {
+        // big endian chunks
+        const uint8_t* pChunk = m_bitmap.data + (y * m_width + x) * m_bytesPerChunk;
+
+        uint32_t chunk = 0;
+        for (int i = 0; i < m_bytesPerChunk; ++i)
+            chunk = (chunk << 8) | pChunk[i];
+        return chunk;
+    }
+    }
+}
+
+bool is_uimg(const std::string& filePath)
 {
     std::ifstream ifs(filePath, std::ifstream::binary);
-    ifs.exceptions(std::ifstream::failbit);
 
-    FileHeader fileHeader;
-    ifs.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader));
+    uint8_t header[sizeof(FileHeader)];
+    if (!ifs.read(reinterpret_cast<char*>(header), sizeof(header)) || !UimgView::probe(header, sizeof(header)))
+        return false;
 
-    fileHeader.version = (fileHeader.version >> 8) | (fileHeader.version << 8);
-    fileHeader.flags   = (fileHeader.flags >> 8)   | (fileHeader.flags << 8);
+    const uint16_t flags = read_big_endian16(header + 6);
+    const uint8_t bitsPerPixel = header[8];
 
-    uint16_t width = 0;
-    width |= ifs.get();
-    width <<= 8;
-    width |= ifs.get();
+    return bitsPerPixel != 0
+            && (bitsPerPixel > 8 || (flags & 0b11) != 0b00);
+}
 
-    uint16_t height = 0;
-    height |= ifs.get();
-    height <<= 8;
-    height |= ifs.get();
+void decode_indexes(const UimgView& view, uint8_t* pIndexes)
+{
+    const size_t pixels = size_t(view.width()) * view.height();
+    const ByteSpan payload = view.bitmap();
+
+    switch (view.bytesPerChunk()) {
+    case 0:
+        if (pixels % 16 != 0)
+            throw std::runtime_error("Number of pixels must be divisible by 16.");
+
+        planar_to_chunky(payload.data, pixels, view.bitsPerPixel(), pIndexes);
+        break;
+
+    case -1:
+        unpack_indexes(payload.data, payload.size, pixels, view.bitsPerPixel(), pIndexes);
+        break;
+
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        // index in the last byte of every chunk
+        for (size_t i = 0; i < pixels; ++i)
+            pIndexes[i] = payload.data[i * view.bytesPerChunk() + view.bytesPerChunk() - 1];
+        break;
+
+    default:
+        throw_oss<std::invalid_argument>(std::ostringstream()
+            << "Unexpected number of bytes per chunk: " << view.bytesPerChunk()
+        );
+    }
+}
 
-    Magick::Image image({width, height}, {0, 0, 0});
+Magick::Image load_uimg(const std::string& filePath)
+{
+    return load_uimg(UimgView(filePath));
+}
 
-    if (fileHeader.bitsPerPixel <= 8) {
+Magick::Image load_uimg(const UimgView& view)
+{
+    Magick::Image image({view.width(), view.height()}, {0, 0, 0});
+
+    if (view.bitsPerPixel() <= 8) {
         image.classType(Magick::PseudoClass);
         image.type(Magick::PaletteType);
 
-        image.colorMapSize(1 << fileHeader.bitsPerPixel);
+        image.colorMapSize(1 << view.bitsPerPixel());
+
+        // not a bitmap we could convert
+        if (view.paletteSize() < image.colorMapSize()) {
+            throw_oss<std::invalid_argument>(std::ostringstream()
+                << "Unexpected palette type: " << view.paletteType()
+            );
+        }
 
         for (size_t i = 0; i < image.colorMapSize(); ++i) {
-            Magick::Color color;
+            const PaletteColor paletteColor = view.paletteColor(i);
 
-            switch (fileHeader.flags & 0b11) {
-            case 0b01: {
-                // ST/E compatible palette
-                StePaletteEntry palEntry = {};
-                palEntry.wrapper.value |= ifs.get();
-                palEntry.wrapper.value <<= 8;
-                palEntry.wrapper.value |= ifs.get();
-
-                constexpr size_t shift = QuantumDepth - (3+1);  // 3+1 bits per channel
-                color.redQuantum(   ((palEntry.r321 << 1) | palEntry.r0) << shift );
-                color.greenQuantum( ((palEntry.g321 << 1) | palEntry.g0) << shift );
-                color.blueQuantum(  ((palEntry.b321 << 1) | palEntry.b0) << shift );
-            } break;
-
-            case 0b10: {
-                // TT compatible palette
-                TtPaletteEntry palEntry = {};
-                palEntry.wrapper.value |= ifs.get();
-                palEntry.wrapper.value <<= 8;
-                palEntry.wrapper.value |= ifs.get();
-
-                constexpr size_t shift = QuantumDepth - 4;  // 4 bits per channel
-                color.redQuantum(   palEntry.r3210 << shift );
-                color.greenQuantum( palEntry.g3210 << shift );
-                color.blueQuantum(  palEntry.b3210 << shift );
-            } break;
-
-            case 0b11: {
-                // Falcon compatible palette
-                FalconPaletteEntry palEntry = {};
-                palEntry.wrapper.value |= ifs.get();
-                palEntry.wrapper.value <<= 8;
-                palEntry.wrapper.value |= ifs.get();
-                palEntry.wrapper.value <<= 8;
-                palEntry.wrapper.value |= ifs.get();
-                palEntry.wrapper.value <<= 8;
-                palEntry.wrapper.value |= ifs.get();
-
-                constexpr size_t shift = QuantumDepth - 8;  // 8 bits per channel
-                color.redQuantum(   ((palEntry.r765432 << 2) | palEntry.r10) << shift );
-                color.greenQuantum( ((palEntry.g765432 << 2) | palEntry.g10) << shift );
-                color.blueQuantum(  ((palEntry.b765432 << 2) | palEntry.b10) << shift );
-            } break;
-
-            default:
-                throw_oss<std::invalid_argument>(std::ostringstream()
-                    << "Unexpected palette type: " << (fileHeader.flags & 0b11)
-                );
-            }
+            constexpr size_t shift = QuantumDepth - 8;
+            Magick::Color color;
+            color.redQuantum(   paletteColor.r << shift );
+            color.greenQuantum( paletteColor.g << shift );
+            color.blueQuantum(  paletteColor.b << shift );
 
             image.colorMap(i, color);
         }
@@ -134,76 +442,37 @@ Magick::Image load_uimg(const std::string& filePath)
         image.type(Magick::TrueColorType);
     }
 
-    Magick::PixelPacket*       pPixelPackets = image.getPixels(0, 0, image.columns(), image.rows());
-    const Magick::PixelPacket* pPixelPacketsEnd = pPixelPackets + image.columns() * image.rows();
-
-    Magick::IndexPacket*       pIndexPackets = image.getIndexes();
-    const Magick::IndexPacket* pIndexPacketsEnd = pIndexPackets + image.columns() * image.rows();
+    // the whole bitmap at once, straight from the view
+    const size_t pixels = size_t(view.width()) * view.height();
+    const ByteSpan payload = view.bitmap();
 
-    while ((fileHeader.bytesPerChunk >= 2 && pPixelPackets != pPixelPacketsEnd)
-           || (fileHeader.bytesPerChunk < 2 && pIndexPackets != pIndexPacketsEnd)) {
-        switch (fileHeader.bytesPerChunk) {
-        case 0: {
-            std::vector<uint16_t> planes(fileHeader.bitsPerPixel);  // 16 pixels = 16 bits x bit depth
-            for (size_t i = 0; i < planes.size(); ++i) {
-                uint16_t plane = 0;
-                plane |= ifs.get();
-                plane <<= 8;
-                plane |= ifs.get();
-                planes[i] = plane;
-            }
+    Magick::PixelPacket* pPixelPackets = image.getPixels(0, 0, image.columns(), image.rows());
+    Magick::IndexPacket* pIndexPackets = image.getIndexes();
 
-            for (size_t i = 0; i < 16; ++i) {
-                uint8_t index = 0;
+    if (view.bitsPerPixel() <= 8) {
+        std::vector<uint8_t> indexes(pixels);
+        decode_indexes(view, indexes.data());
 
-                for (size_t j = 0; j < fileHeader.bitsPerPixel; ++j) {
-                    index |= ((planes[j] >> (15 - i)) & 1) << j;
-                }
-
-                *pIndexPackets++ = index;
-            }
-            break;
-        }
-        case -1: {
-            uint8_t chunk = ifs.get();
-
-            int shift = 8 - fileHeader.bitsPerPixel;
-            while (shift >= 0) {
-                *pIndexPackets++ = (chunk >> shift) & ((1 << fileHeader.bitsPerPixel) - 1);
-                shift -= fileHeader.bitsPerPixel;
-            };
-            break;
-        }
-        case 1:
-            *pIndexPackets++ = ifs.get();
+        std::copy(indexes.begin(), indexes.end(), pIndexPackets);
+    } else if (view.bitsPerPixel() == 16 && view.bytesPerChunk() > 2) {
+        expand_wide_rgb565(payload.data, view.bytesPerChunk(), pixels, pPixelPackets);
+    } else {
+        switch (view.bytesPerChunk()) {
+        case 2:
+            expand_rgb565(payload.data, pixels, pPixelPackets);
             break;
 
-        case 2: {
-            uint16_t rgb565 = 0;
-            rgb565 |= (ifs.get() << 8) & 0xff00;
-            rgb565 |= ifs.get() & 0x00ff;
-
-            pPixelPackets->red   = ((rgb565 >> (6+5)) & 0x1f) << (QuantumDepth - 5);
-            pPixelPackets->green = ((rgb565 >> 5)     & 0x3f) << (QuantumDepth - 6);
-            pPixelPackets->blue  = (rgb565            & 0x1f) << (QuantumDepth - 5);
-
-            pPixelPackets++;
-            break;
-        }
-        case 4:
-            pPixelPackets->opacity = ifs.get();
-            [[fallthrough]];
         case 3:
-            pPixelPackets->red   = ifs.get() << (QuantumDepth - 8);
-            pPixelPackets->green = ifs.get() << (QuantumDepth - 8);
-            pPixelPackets->blue  = ifs.get() << (QuantumDepth - 8);
+            expand_rgb888(payload.data, pixels, pPixelPackets);
+            break;
 
-            pPixelPackets++;
+        case 4:
+            expand_argb8888(payload.data, pixels, pPixelPackets);
             break;
 
         default:
             throw_oss<std::invalid_argument>(std::ostringstream()
-                << "Unexpected number of bytes per chunk: " << fileHeader.bytesPerChunk
+                << "Unexpected number of bytes per chunk: " << view.bytesPerChunk()
             );
         }
     }
@@ -212,3 +481,80 @@ Magick::Image load_uimg(const std::string& filePath)
 
     return image;
 }
+
+void save_uimg_header(std::ostream& os, const ConversionOptions& options, const uint16_t width, const uint16_t height)
+{
+    // ID
+    os.write("UIMG", 4);
+    os.put(VERSION >> 8);
+    os.put(VERSION & 0xff);
+    // flags: bit 15-8 7 6 5 4 3 2 1 0
+    //                             | |
+    //                             +-+- 00: no palette
+    //                                  01: ST/E compatible palette
+    //                                  10: TT compatible palette
+    //                                  11: Falcon compatible palette
+    const uint16_t flags = get_palette_type(options);
+
+    os.put(flags >> 8);
+    os.put(flags);
+    // bits per pixel (0 if bitmap not present)
+    os.put(options.bitsPerPixel);
+    // bytes per chunk (0 if planar words or bitmap not present, -1 if packed)
+    os.put(options.bytesPerChunk);
+
+    if (options.bitsPerPixel) {
+        // width
+        os.put(width >> 8);
+        os.put(width);
+        // height
+        os.put(height >> 8);
+        os.put(height);
+    }
+
+    // palette (st(e)/tt/falcon; if present)
+
+    // bitmap data (if present)
+}
+
+void save_uimg_palette(std::ostream& os, const ConversionOptions& options, const std::vector<PaletteColor>& colors, size_t paletteSize)
+{
+    const int paletteType = get_palette_type(options);
+    const size_t entrySize = get_palette_entry_size(paletteType);
+
+    for (size_t i = 0; i < paletteSize; ++i) {
+        const uint32_t value = i < colors.size() ? encode_palette_entry(paletteType, options.paletteBits, colors[i]) : 0;
+
+        // MSB first
+        for (int j = entrySize - 1; j >= 0; --j)
+            os.put(value >> (j * 8));
+    }
+}
+
+void save_uimg_file(const std::string& filename, const std::function<void(std::ostream&)>& save)
+{
+    namespace fs = std::filesystem;
+
+    // unique also among concurrent jobs writing the same file
+    const std::string tempFilename = filename + "." + std::to_string(getpid())
+        + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+    std::ofstream ofs(tempFilename, std::ofstream::binary);
+    if (!ofs)
+        throw std::runtime_error("Opening destination file failed.");
+
+    try {
+        save(ofs);
+
+        ofs.close();
+        if (!ofs)
+            throw std::runtime_error("Writing destination file failed.");
+
+        fs::rename(tempFilename, filename);
+    }
+    catch (...) {
+        std::error_code ec;
+        fs::remove(tempFilename, ec);
+        throw;
+    }
+}
@@ -21,11 +21,18 @@
 #ifndef UIMG_H
 #define UIMG_H
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <ostream>
 #include <string>
+#include <vector>
 
 #include <GraphicsMagick/Magick++/Image.h>
 
+#include "args.h"
+#include "palette.h"
+
 typedef struct {
     char        id[4];
     uint16_t    version;
@@ -34,7 +41,87 @@ typedef struct {
     int8_t      bytesPerChunk;
 } __attribute__((packed)) FileHeader;
 
+// contiguous read-only bytes
+struct ByteSpan {
+    const uint8_t*  data = nullptr;
+    size_t          size = 0;
+
+    const uint8_t* begin() const { return data; }
+    const uint8_t* end() const { return data + size; }
+};
+
+// typed read-only view of a UIMG file (memory-mapped) or of a buffer; nothing is copied
+// (all values are returned in host endianness, the spans contain raw big endian data)
+class UimgView {
+public:
+    // throws std::runtime_error if the file can't be mapped or is not a valid UIMG file
+    explicit UimgView(const std::string& filePath);
+    // 'pData' must outlive the view
+    UimgView(const uint8_t* pData, size_t size);
+    ~UimgView();
+
+    UimgView(UimgView&& other) noexcept;
+    UimgView& operator=(UimgView&& other) = delete;
+    UimgView(const UimgView&) = delete;
+    UimgView& operator=(const UimgView&) = delete;
+
+    // just the header and sizes, without throwing
+    static bool probe(const uint8_t* pData, size_t size);
+
+    uint16_t version() const { return m_version; }
+    uint16_t flags() const { return m_flags; }
+    int paletteType() const { return m_flags & 0b11; }  // 0: none, 1: ST/E, 2: TT, 3: Falcon
+    int16_t bitsPerPixel() const { return m_bitsPerPixel; }
+    int16_t bytesPerChunk() const { return m_bytesPerChunk; }
+    uint16_t width() const { return m_width; }      // 0 if no bitmap
+    uint16_t height() const { return m_height; }    // 0 if no bitmap
+
+    size_t paletteSize() const { return m_paletteSize; }    // in entries
+    size_t paletteEntrySize() const { return paletteType() == 0b11 ? 4 : 2; }   // in bytes
+    ByteSpan palette() const { return m_palette; }
+    // ST/E, TT (16-bit) or Falcon (32-bit) palette register value
+    uint32_t paletteEntry(size_t i) const;
+    PaletteColor paletteColor(size_t i) const { return decode_palette_entry(paletteType(), paletteEntry(i)); }
+
+    ByteSpan bitmap() const { return m_bitmap; }
+    size_t rowSize() const { return m_rowSize; }    // in bytes
+    ByteSpan row(size_t y) const { return { m_bitmap.data + y * m_rowSize, m_rowSize }; }
+    // index (bpp <= 8) or RGB565/RGB/ARGB chunk value (bpp > 8) of any layout
+    uint32_t pixel(size_t x, size_t y) const;
+
+    ByteSpan data() const { return { m_pData, m_size }; }
+
+private:
+    void parse();
+
+    const uint8_t*  m_pData;
+    size_t          m_size;
+    bool            m_mapped = false;
+
+    uint16_t        m_version = 0;
+    uint16_t        m_flags = 0;
+    int16_t         m_bitsPerPixel = 0;
+    int16_t         m_bytesPerChunk = 0;
+    uint16_t        m_width = 0;
+    uint16_t        m_height = 0;
+    size_t          m_paletteSize = 0;
+    ByteSpan        m_palette;
+    ByteSpan        m_bitmap;
+    size_t          m_rowSize = 0;
+};
+
 bool is_uimg(const std::string& filePath);
+// indexes of a bitmap with 1 - 8 bpp in any layout, exactly width * height of them
+void decode_indexes(const UimgView& view, uint8_t* pIndexes);
+Magick::Image load_uimg(const UimgView& view);
 Magick::Image load_uimg(const std::string& filePath);
 
+// header (all values big endian) and palette of 'paletteSize' entries, missing colours are saved as zeros
+void save_uimg_header(std::ostream& os, const ConversionOptions& options, uint16_t width, uint16_t height);
+void save_uimg_palette(std::ostream& os, const ConversionOptions& options, const std::vector<PaletteColor>& colors, size_t paletteSize);
+
+// calls save() with a temporary file next to 'filename' and renames it over 'filename' only when
+// complete, so the destination may be the source itself (still mapped by a UimgView)
+void save_uimg_file(const std::string& filename, const std::function<void(std::ostream&)>& save);
+
 #endif // UIMG_H